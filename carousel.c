@@ -0,0 +1,192 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "carousel.h"
+
+/* A hashed timer wheel: entries hang off slot (due / slot_bits) modulo
+   CAROUSEL_SLOTS, with their full due position kept so entries more
+   than one turn of the wheel away are simply passed over.  Finding the
+   next entry only looks at occupied slots from the cursor onwards, so
+   the cost depends on how many entries share a slot, not on how many
+   are registered. */
+
+static int before(struct carousel_entry_t* a, int ia, struct carousel_entry_t* b, int ib)
+{
+  return (a->due < b->due) || ((a->due == b->due) && (ia < ib));
+}
+
+static int slot_of(struct carousel_t* c, int64_t due)
+{
+  return (due / c->slot_bits) % CAROUSEL_SLOTS;
+}
+
+static void insert(struct carousel_t* c, int i)
+{
+  int s = slot_of(c, c->entries[i].due);
+
+  c->entries[i].next = c->slots[s];
+  c->slots[s] = i;
+  c->occupied[s / 64] |= 1ULL << (s % 64);
+}
+
+static void unlink_entry(struct carousel_t* c, int i)
+{
+  int s = slot_of(c, c->entries[i].due);
+  int* p = &c->slots[s];
+
+  while (*p != i)
+    p = &c->entries[*p].next;
+  *p = c->entries[i].next;
+  if (c->slots[s] < 0)
+    c->occupied[s / 64] &= ~(1ULL << (s % 64));
+}
+
+/* First occupied slot at or after s, without wrapping; -1 if none */
+static int next_occupied(struct carousel_t* c, int s)
+{
+  int w = s / 64;
+  uint64_t bits = c->occupied[w] & (~0ULL << (s % 64));
+
+  while (!bits) {
+    if (++w == CAROUSEL_SLOTS / 64)
+      return -1;
+    bits = c->occupied[w];
+  }
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+static int find_top(struct carousel_t* c)
+{
+  int s0 = slot_of(c, c->cursor);
+  int k = 0;
+  int best = -1;
+  int i;
+
+  /* One turn of the wheel from the cursor - an entry counts if it is
+     due before the end of the slot's window in this turn */
+  while (k < CAROUSEL_SLOTS) {
+    int s = (s0 + k) % CAROUSEL_SLOTS;
+    int t = next_occupied(c, s);
+    if (t < 0) {
+      k += CAROUSEL_SLOTS - s;
+      continue;
+    }
+    k += t - s;
+    if (k >= CAROUSEL_SLOTS)
+      break;
+
+    int64_t end = c->cursor + (k + 1) * c->slot_bits;
+    for (i = c->slots[t]; i >= 0; i = c->entries[i].next) {
+      if ((c->entries[i].due < end) && ((best < 0) || before(&c->entries[i], i, &c->entries[best], best)))
+        best = i;
+    }
+    if (best >= 0) {
+      c->cursor += k * c->slot_bits;
+      return best;
+    }
+    k++;
+  }
+
+  /* Nothing due within a turn - fall back to looking at everything */
+  for (i = 0; i < c->n; i++) {
+    if ((best < 0) || before(&c->entries[i], i, &c->entries[best], best))
+      best = i;
+  }
+  if (best >= 0)
+    c->cursor = (c->entries[best].due / c->slot_bits) * c->slot_bits;
+  return best;
+}
+
+int carousel_init(struct carousel_t* c, int max)
+{
+  int i;
+
+  c->n = 0;
+  c->max = max;
+  c->slot_bits = 1;
+  c->cursor = 0;
+  c->top = -1;
+  for (i = 0; i < CAROUSEL_SLOTS; i++)
+    c->slots[i] = -1;
+  for (i = 0; i < CAROUSEL_SLOTS / 64; i++)
+    c->occupied[i] = 0;
+  c->entries = calloc(max, sizeof(struct carousel_entry_t));
+  return c->entries ? 0 : -1;
+}
+
+int carousel_add(struct carousel_t* c, int type, int arg, int interval, int64_t phase)
+{
+  struct carousel_entry_t* e;
+
+  if (c->n == c->max)
+    return -1;
+  e = &c->entries[c->n];
+  e->due = phase;
+  e->interval = (interval > 0) ? interval : 1;
+  e->type = type;
+  e->arg = arg;
+  e->next = -1;
+  return c->n++;
+}
+
+void carousel_start(struct carousel_t* c)
+{
+  int min_interval = 0;
+  int i;
+
+  /* Size the slots so the shortest interval spans a quarter of the
+     wheel - most entries are then within one turn of the cursor */
+  for (i = 0; i < c->n; i++) {
+    if ((min_interval == 0) || (c->entries[i].interval < min_interval))
+      min_interval = c->entries[i].interval;
+  }
+  c->slot_bits = min_interval / (CAROUSEL_SLOTS / 4);
+  if (c->slot_bits < 1)
+    c->slot_bits = 1;
+
+  for (i = 0; i < c->n; i++)
+    insert(c, i);
+  c->cursor = 0;
+  c->top = -1;
+}
+
+struct carousel_entry_t* carousel_top(struct carousel_t* c)
+{
+  if (c->top < 0)
+    c->top = find_top(c);
+  return (c->top < 0) ? NULL : &c->entries[c->top];
+}
+
+void carousel_advance(struct carousel_t* c)
+{
+  int i = (c->top < 0) ? find_top(c) : c->top;
+
+  if (i < 0)
+    return;
+  unlink_entry(c, i);
+  c->entries[i].due += c->entries[i].interval;
+  insert(c, i);
+  c->top = -1;
+}
@@ -0,0 +1,46 @@
+#ifndef _CAROUSEL_H
+#define _CAROUSEL_H
+
+#include <stdint.h>
+
+/* Table carousel - a timer wheel of repeating PSI/SI insertions, keyed
+   on output bit position.  Each entry has its own interval and phase;
+   type and arg are for the caller (e.g. which table, which service). */
+
+#define CAROUSEL_SLOTS 256
+
+struct carousel_entry_t {
+  int64_t due;     /* Output bit position of the next insertion */
+  int interval;    /* In bits */
+  int type;
+  int arg;
+  int next;        /* Next entry in the same slot, -1 for none */
+};
+
+struct carousel_t {
+  int n;
+  int max;
+  struct carousel_entry_t* entries;
+  int64_t slot_bits;   /* Width of one slot */
+  int64_t cursor;      /* Start of the slot the earliest entry is in */
+  int top;             /* Earliest entry, -1 when it needs finding */
+  int slots[CAROUSEL_SLOTS];
+  uint64_t occupied[CAROUSEL_SLOTS / 64];
+};
+
+int carousel_init(struct carousel_t* c, int max);
+
+/* First insertion at bit position phase, then every interval bits.
+   Returns the entry index, or -1 if the carousel is full. */
+int carousel_add(struct carousel_t* c, int type, int arg, int interval, int64_t phase);
+
+/* Call after the last carousel_add() */
+void carousel_start(struct carousel_t* c);
+
+/* The entry due first - ties go to the one added first */
+struct carousel_entry_t* carousel_top(struct carousel_t* c);
+
+/* The top entry has been output - schedule its next insertion */
+void carousel_advance(struct carousel_t* c);
+
+#endif
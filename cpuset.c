@@ -0,0 +1,125 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+
+#include "cpuset.h"
+
+int cpuset_parse(const char* list, cpu_set_t* set)
+{
+  const char* p = list;
+  char* end;
+  long first, last, i;
+
+  CPU_ZERO(set);
+  while (*p) {
+    if (!isdigit((unsigned char)*p))
+      return -1;
+    first = last = strtol(p, &end, 10);
+    p = end;
+    if (*p == '-') {
+      p++;
+      if (!isdigit((unsigned char)*p))
+        return -1;
+      last = strtol(p, &end, 10);
+      p = end;
+    }
+    if ((last < first) || (last >= CPU_SETSIZE))
+      return -1;
+    for (i = first; i <= last; i++)
+      CPU_SET(i, set);
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+
+  return CPU_COUNT(set) ? CPU_COUNT(set) : -1;
+}
+
+char* cpuset_format(cpu_set_t* set, char* buf, int len)
+{
+  int n = 0;
+  int i, j;
+
+  buf[0] = 0;
+  for (i = 0; i < CPU_SETSIZE; i++) {
+    if (!CPU_ISSET(i, set))
+      continue;
+    for (j = i; (j + 1 < CPU_SETSIZE) && CPU_ISSET(j + 1, set); j++)
+      ;
+    if (n < len) {
+      if (j > i)
+        n += snprintf(buf + n, len - n, "%s%d-%d", n ? "," : "", i, j);
+      else
+        n += snprintf(buf + n, len - n, "%s%d", n ? "," : "", i);
+    }
+    i = j;
+  }
+
+  return buf;
+}
+
+/* The node a CPU is on, from its nodeN link in sysfs */
+static int cpu_node(int cpu)
+{
+  char path[64];
+  struct dirent* d;
+  DIR* dir;
+  int node = -1;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+  while ((d = readdir(dir)) != NULL) {
+    if ((strncmp(d->d_name, "node", 4) == 0) && isdigit((unsigned char)d->d_name[4])) {
+      node = atoi(d->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+
+  return node;
+}
+
+int cpuset_node(cpu_set_t* set)
+{
+  int node = -1;
+  int i;
+
+  for (i = 0; i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, set)) {
+      int n = cpu_node(i);
+      if ((n < 0) || ((node >= 0) && (n != node)))
+        return -1;
+      node = n;
+    }
+  }
+
+  return node;
+}
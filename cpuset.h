@@ -0,0 +1,18 @@
+#ifndef _CPUSET_H
+#define _CPUSET_H
+
+/* Callers need _GNU_SOURCE for cpu_set_t */
+#include <sched.h>
+
+/* Parse a CPU list such as "0-3,8" into set.  Returns the number of
+   CPUs in the set, or -1 if the list is invalid. */
+int cpuset_parse(const char* list, cpu_set_t* set);
+
+/* Format set as a CPU list, e.g. "0-3,8" */
+char* cpuset_format(cpu_set_t* set, char* buf, int len);
+
+/* NUMA node that all the CPUs in set belong to, or -1 if they span
+   more than one (or the kernel has no NUMA information) */
+int cpuset_node(cpu_set_t* set);
+
+#endif
@@ -21,8 +21,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <stdint.h>
+#include <string.h>
 #include "crc32.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_PCLMUL_CRC
+#endif
+
 /* CRC code taken from tvheadend */
 
 
@@ -75,7 +81,11 @@ static uint32_t crc_tab[256] = {
   0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
-uint32_t psi_crc32(uint8_t *data, size_t datalen, uint32_t crc)
+/* CRC-32/MPEG-2 is MSB-first, so the slicing and folding below work on
+   big-endian words, and the CRC register can be carried from one call to
+   the next with any of the implementations. */
+
+uint32_t psi_crc32_table(uint8_t *data, size_t datalen, uint32_t crc)
 {
   while(datalen--)
     crc = (crc << 8) ^ crc_tab[((crc >> 24) ^ *data++) & 0xff];
@@ -83,3 +93,129 @@ uint32_t psi_crc32(uint8_t *data, size_t datalen, uint32_t crc)
   return crc;
 }
 
+/* crc_tab8[k][b] is the CRC register after byte b followed by k zero bytes */
+static uint32_t crc_tab8[8][256];
+
+uint32_t psi_crc32_slice8(uint8_t *data, size_t datalen, uint32_t crc)
+{
+  while (datalen >= 8) {
+    crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    crc = crc_tab8[7][crc >> 24] ^ crc_tab8[6][(crc >> 16) & 0xff] ^
+          crc_tab8[5][(crc >> 8) & 0xff] ^ crc_tab8[4][crc & 0xff] ^
+          crc_tab8[3][data[4]] ^ crc_tab8[2][data[5]] ^
+          crc_tab8[1][data[6]] ^ crc_tab8[0][data[7]];
+    data += 8;
+    datalen -= 8;
+  }
+  return psi_crc32_table(data, datalen, crc);
+}
+
+#ifdef HAVE_PCLMUL_CRC
+
+/* Carry-less multiply folding, as in Intel's "Fast CRC Computation for
+   Generic Polynomials Using PCLMULQDQ Instruction".  A 128-bit block
+   H*x^64 + L moved n bits further along is congruent (mod P) to
+   H*(x^(n+64) mod P) + L*(x^n mod P), so the message is folded four
+   blocks at a time into 512 bits, then into 128, and the CRC of those
+   16 bytes is the CRC of everything folded into them. */
+
+static uint64_t fold_512[2];   /* x^576 mod P, x^512 mod P */
+static uint64_t fold_128[2];   /* x^192 mod P, x^128 mod P */
+
+__attribute__((target("pclmul,ssse3")))
+static __m128i fold(__m128i x, __m128i k)
+{
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+uint32_t psi_crc32_pclmul(uint8_t *data, size_t datalen, uint32_t crc)
+{
+  const __m128i bswap = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  const __m128i k512 = _mm_set_epi64x(fold_512[0], fold_512[1]);
+  const __m128i k128 = _mm_set_epi64x(fold_128[0], fold_128[1]);
+  __m128i x0, x1, x2, x3;
+  uint8_t tmp[16];
+
+  if (datalen < 64)
+    return psi_crc32_slice8(data, datalen, crc);
+
+  /* The initial register is the same as XORing it into the first 4 bytes */
+  x0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)data), bswap);
+  x0 = _mm_xor_si128(x0, _mm_set_epi32(crc, 0, 0, 0));
+  x1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + 16)), bswap);
+  x2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + 32)), bswap);
+  x3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + 48)), bswap);
+  data += 64;
+  datalen -= 64;
+
+  while (datalen >= 64) {
+    x0 = _mm_xor_si128(fold(x0, k512), _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)data), bswap));
+    x1 = _mm_xor_si128(fold(x1, k512), _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + 16)), bswap));
+    x2 = _mm_xor_si128(fold(x2, k512), _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + 32)), bswap));
+    x3 = _mm_xor_si128(fold(x3, k512), _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + 48)), bswap));
+    data += 64;
+    datalen -= 64;
+  }
+
+  x0 = _mm_xor_si128(fold(x0, k128), x1);
+  x0 = _mm_xor_si128(fold(x0, k128), x2);
+  x0 = _mm_xor_si128(fold(x0, k128), x3);
+  while (datalen >= 16) {
+    x0 = _mm_xor_si128(fold(x0, k128), _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)data), bswap));
+    data += 16;
+    datalen -= 16;
+  }
+
+  _mm_storeu_si128((__m128i*)tmp, _mm_shuffle_epi8(x0, bswap));
+  crc = psi_crc32_slice8(tmp, 16, 0);
+  return psi_crc32_slice8(data, datalen, crc);
+}
+
+/* x^n mod P */
+static uint32_t xpow_mod(int n)
+{
+  uint32_t r = 1;
+
+  while (n--)
+    r = (r << 1) ^ ((r & 0x80000000) ? 0x04c11db7 : 0);
+  return r;
+}
+
+#endif
+
+static uint32_t (*crc_impl)(uint8_t *data, size_t datalen, uint32_t crc) = psi_crc32_table;
+static const char* crc_impl_name = "table";
+
+const char* psi_crc32_init(void)
+{
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    crc_tab8[0][i] = crc_tab[i];
+    for (k = 1; k < 8; k++)
+      crc_tab8[k][i] = (crc_tab8[k-1][i] << 8) ^ crc_tab[crc_tab8[k-1][i] >> 24];
+  }
+  crc_impl = psi_crc32_slice8;
+  crc_impl_name = "slicing-by-8";
+
+#ifdef HAVE_PCLMUL_CRC
+  fold_512[0] = xpow_mod(576);
+  fold_512[1] = xpow_mod(512);
+  fold_128[0] = xpow_mod(192);
+  fold_128[1] = xpow_mod(128);
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+    crc_impl = psi_crc32_pclmul;
+    crc_impl_name = "pclmul";
+  }
+#endif
+
+  return crc_impl_name;
+}
+
+uint32_t psi_crc32(uint8_t *data, size_t datalen, uint32_t crc)
+{
+  return crc_impl(data, datalen, crc);
+}
+
@@ -4,6 +4,19 @@
 #include <stdint.h>
 #include <stddef.h>
 
+/* Pick the fastest implementation for this CPU - until it is called,
+   psi_crc32() uses the byte-at-a-time table.  Returns its name. */
+const char* psi_crc32_init(void);
+
 uint32_t psi_crc32(uint8_t *data, size_t datalen, uint32_t crc);
 
+/* psi_crc32_table() works at any time.  slice8 and pclmul use tables
+   built by psi_crc32_init(), and pclmul also needs PCLMULQDQ and
+   SSSE3. */
+uint32_t psi_crc32_table(uint8_t *data, size_t datalen, uint32_t crc);
+uint32_t psi_crc32_slice8(uint8_t *data, size_t datalen, uint32_t crc);
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t psi_crc32_pclmul(uint8_t *data, size_t datalen, uint32_t crc);
+#endif
+
 #endif
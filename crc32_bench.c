@@ -0,0 +1,116 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* Checks every CRC-32/MPEG-2 implementation against the byte-at-a-time
+   table, then measures each one on section-sized buffers.  Build with
+   "make crc32_bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "crc32.h"
+
+struct crc_impl_t {
+  const char* name;
+  uint32_t (*fn)(uint8_t *data, size_t datalen, uint32_t crc);
+};
+
+static struct crc_impl_t impls[] = {
+  { "table", psi_crc32_table },
+  { "slicing-by-8", psi_crc32_slice8 },
+#if defined(__x86_64__) || defined(__i386__)
+  { "pclmul", psi_crc32_pclmul },
+#endif
+  { "psi_crc32", psi_crc32 },
+};
+#define NIMPLS (int)(sizeof(impls) / sizeof(impls[0]))
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void)
+{
+  static uint8_t buf[4096 + 16];
+  static int sizes[] = { 16, 64, 188, 256, 1024, 4096 };
+  volatile uint32_t sink = 0;
+  int errors = 0;
+  int i, j, len, off;
+
+  printf("psi_crc32 uses %s\n", psi_crc32_init());
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("pclmul") || !__builtin_cpu_supports("ssse3")) {
+    printf("No PCLMULQDQ on this CPU - skipping pclmul\n");
+    impls[2] = impls[1];
+  }
+#endif
+
+  srand(1);
+  for (i = 0; i < (int)sizeof(buf); i++)
+    buf[i] = rand();
+
+  /* Every length up to a maximum-size section, at a few alignments and
+     starting registers, including a section's own CRC checking to 0 */
+  for (len = 0; len <= 4096; len++) {
+    for (off = 0; off < 16; off += 5) {
+      uint32_t init = (len & 1) ? 0xffffffff : (uint32_t)rand();
+      uint32_t expected = psi_crc32_table(buf + off, len, init);
+      for (j = 1; j < NIMPLS; j++) {
+        uint32_t crc = impls[j].fn(buf + off, len, init);
+        if (crc != expected) {
+          if (errors++ < 10)
+            printf("MISMATCH: %s len %d offset %d init %08x: %08x, expected %08x\n", impls[j].name, len, off, init, crc, expected);
+        }
+      }
+    }
+  }
+  printf("Sections of 0-4096 bytes: %s\n", errors ? "FAILED" : "every CRC equals psi_crc32_table()");
+
+  printf("%-8s", "bytes");
+  for (j = 0; j < NIMPLS; j++)
+    printf("%14s", impls[j].name);
+  printf("    (MB/s)\n");
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+    printf("%-8d", sizes[i]);
+    for (j = 0; j < NIMPLS; j++) {
+      long iters = 0;
+      double t0 = now(), t;
+      do {
+        int k;
+        for (k = 0; k < 1000; k++)
+          sink += impls[j].fn(buf, sizes[i], 0xffffffff);
+        iters += 1000;
+        t = now() - t0;
+      } while (t < 0.2);
+      printf("%14.0f", (double)iters * sizes[i] / t / 1e6);
+    }
+    printf("\n");
+  }
+
+  return errors ? 1 : 0;
+}
@@ -20,14 +20,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <pthread.h>
 #include <curl/curl.h>
 
@@ -36,6 +35,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "psi_create.h"
 #include "crc32.h"
 #include "parse_config.h"
+#include "output.h"
+#include "ingest.h"
+#include "tsbatch.h"
+#include "tr101290.h"
+#include "stats.h"
+#include "cpuset.h"
+#include "pktsched.h"
+#include "carousel.h"
 
 static uint8_t null_packet[188] = {
   0x47, 0x1f, 0xff, 0x10, 0xff, 0xff, 0xff, 0xff,
@@ -64,6 +71,43 @@ static uint8_t null_packet[188] = {
   0xff, 0xff, 0xff, 0xff
 };
 
+/* Null packets are written in bulk from a page of pre-built copies */
+#define NULL_PAGE_PACKETS 64
+static uint8_t null_page[NULL_PAGE_PACKETS*188];
+
+static void init_null_page(void)
+{
+  int i;
+
+  for (i = 0; i < NULL_PAGE_PACKETS; i++)
+    memcpy(null_page + i*188, null_packet, 188);
+}
+
+/* Write a run of n null packets.  Returns the number written, which is
+   less than n if the ringbuffer is full. */
+static int write_null_packets(struct ringbuffer_t* rb, int n)
+{
+  int done = 0;
+
+  while (done < n) {
+    int count = MIN(n - done, NULL_PAGE_PACKETS);
+    uint8_t* p = rb_reserve(rb, count*188);
+
+    if (p == NULL) {
+      count = rb_get_bytes_free(rb) / 188;
+      if (count == 0)
+        break;
+      p = rb_reserve(rb, count*188);
+    }
+
+    memcpy(p, null_page, count*188);
+    rb_commit(rb, count*188);
+    done += count;
+  }
+
+  return done;
+}
+
 void dump_service(struct service_t* services, int i)
 {
   fprintf(stderr,"Service %d:\n",i);
@@ -75,132 +119,146 @@ void dump_service(struct service_t* services, int i)
   fprintf(stderr,"  lcn: %d\n",services[i].lcn);
 }
 
-void check_cc(char *msg, int service, uint8_t *my_cc, uint8_t *buf)
+/* Check the continuity counters of the first n packets of a batch.
+   Errors are counted in sv->errors and summarised periodically by
+   ts_errors_report(). */
+void check_cc(struct service_t* sv, struct ts_batch_t* b, int n)
 {
-  if (buf[0] != 0x47) {
-    fprintf(stderr,"%s: Service %d, NO SYNC BYTE: 0x%02x 0x%02x 0x%02x 0x%02x\n",msg,service,buf[0],buf[1],buf[2],buf[3]);
-    return;
-  }
+  uint8_t* my_cc = &sv->my_cc[0];
+  int i;
+
+  for (i = 0; i < n; i++) {
+    int flags = b->flags[i];
+    int pid = b->pid[i];
+    int cc = b->cc[i];
+
+    if (flags & (TS_NO_SYNC | TS_TEI)) {
+      if (flags & TS_NO_SYNC) {
+        ts_error(sv->errors, TSERR_SYNC, -1);
+        continue;
+      }
+      ts_error(sv->errors, TSERR_TEI, pid);
+    }
 
-  int pid = (((buf[1] & 0x1f) << 8) | buf[2]);
-  int discontinuity_indicator=(buf[5]&0x80)>>7;
-  int adaption_field_control=(buf[3]&0x30)>>4;
-  if (my_cc[pid]==0xff) {
-    my_cc[pid]=buf[3]&0x0f;
-  } else {
-    if ((adaption_field_control!=0) && (adaption_field_control!=2)) {
-      my_cc[pid]++; my_cc[pid]%=16;
+    if (my_cc[pid]==0xff) {
+      my_cc[pid]=cc;
+    } else if (flags & TS_HAS_PAYLOAD) {
+      my_cc[pid] = (my_cc[pid] + 1) & 0x0f;
     }
-  }
 
-  if ((discontinuity_indicator==0) && (my_cc[pid]!=(buf[3]&0x0f))) {
-    fprintf(stderr,"%s: Service %d, PID %d - packet incontinuity - expected %02x, found %02x\n",msg,service,pid,my_cc[pid],buf[3]&0x0f);
-    my_cc[pid]=buf[3]&0x0f;
+    if ((!(flags & TS_DISCONTINUITY)) && (my_cc[pid]!=cc)) {
+      ts_error(sv->errors, TSERR_CC, pid);
+      my_cc[pid]=cc;
+    }
   }
 }
 
-
-static size_t
-curl_callback(void *contents, size_t size, size_t nmemb, void *userp)
+/* Wait for input, and classify the packets available (up to
+   TS_BATCH_MAX).  Returns the number of packets at *pkts. */
+static int peek_batch(struct service_t* sv, struct ts_batch_t* b, uint8_t** pkts)
 {
-  struct service_t* sv = userp;
-  int count = size*nmemb;
+  int n;
 
-  // Check input stream for CC errors
-  int needed = 188 - sv->curl_bytes;
-  int bytes_left = count;
-  //  fprintf(stderr,"Processing %d bytes, needed=%d\n",count,needed);
-  uint8_t *p = contents;
-  while (bytes_left >= needed) {
-    memcpy(&sv->curl_buf[sv->curl_bytes],p,needed);
-    bytes_left -= needed;
-    sv->curl_bytes = 0;
-    p += needed;
-    //check_cc("curl",sv->id, &sv->curl_cc[0], &sv->curl_buf[0]);
-    needed = 188;
-  }
-  if (bytes_left) {
-    sv->curl_bytes = bytes_left;
-    memcpy(&sv->curl_buf[0],p,sv->curl_bytes);
-  }
-  //  fprintf(stderr,"End of processing, %d bytes, byte_left=%d\n",count,bytes_left);
+  *pkts = rb_peek(&sv->inbuf,188);
+  n = MIN(rb_get_bytes_available(&sv->inbuf) / 188, TS_BATCH_MAX);
+  ts_classify(*pkts, n, b);
+  return n;
+}
 
-  int n = rb_write(&sv->inbuf, contents, count);
+/* Finish with the first n packets of a batch */
+static void consume_batch(struct service_t* sv, struct ts_batch_t* b, int n)
+{
+  check_cc(sv, b, n);
+  rb_consume(&sv->inbuf, 188 * n);
+  sv->trace.read_pos += 188 * n;
+}
 
-  if (n < count) {
-    fprintf(stderr,"\nERROR: Stream %d, Input buffer full, dropping %d bytes\n",sv->id,(count)-n);
-  }
+static void read_section(struct service_t* sv, struct section_t* next, struct section_t* curr, uint8_t* buf, int table_id, int pid)
+{
+  if (process_section(next, curr, buf, table_id) < 0)
+    ts_error(sv->errors, TSERR_CRC, pid);
+}
 
-  /* Confirm there are bytes in the buffer */
-  sv->status=1;
 
-  //fprintf(stderr,"curl_callback, stream=%s, size=%d, written=%d\n",sv->name,(int)count,n);
-  return count; /* Pretend we've consumed all */
+/* Let the ingest thread drop everything we don't read - only PAT, SDT,
+   EIT, the PMT and the PIDs we are remapping get into the ringbuffer */
+static void update_pid_filter(struct service_t* sv)
+{
+  uint64_t pids[8192/64];
+  int pid;
+
+  memset(pids, 0, sizeof(pids));
+  for (pid = 0; pid < 8192; pid++) {
+    if ((pid == 0) || (pid == 0x11) || (pid == 0x12) || (pid == sv->pmt_pid) || (sv->pid_map[pid]))
+      pids[pid >> 6] |= 1ULL << (pid & 63);
+  }
 
+  sv->pid_filter_pending = (ingest_set_pid_filter(sv, pids) < 0);
 }
 
-static void *curl_thread(void* userp)
+/* The input PMT has a new version - remap its streams, rebuild our PMT
+   and let the new PIDs through the ingest filter */
+static void pmt_changed(struct service_t* sv)
 {
-  struct service_t *sv = userp;
-  CURL *curl;
-
-  rb_init(&sv->inbuf);
+  fprintf(stderr,"Service %d: PMT version changed (%d -> %d), remapping PIDs\n",sv->id,sv->pmt_version,(sv->pmt->buf[5] & 0x3e) >> 1);
 
-  curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, sv->url);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)sv);
-  curl_easy_setopt(curl, CURLOPT_USERAGENT, "dvb2dvb/git-master");
-  curl_easy_perform(curl); /* ignores error */
-  curl_easy_cleanup(curl);
-
-  return NULL;
+  memset(sv->pid_map, 0, 8192 * sizeof(uint16_t));
+  process_pmt(sv);
+  create_pmt(sv);
+  if (sv->ait_pid) {
+    create_ait(sv);
+  }
+  update_pid_filter(sv);
 }
 
 /* Read PAT/PMT/SDT from stream and stop at first packet with PCR */
 int init_service(struct service_t* sv)
 {
-  uint8_t buf[188];
-  int n;
+  struct ts_batch_t b;
+  uint8_t *pkts, *buf;
   int pid;
-  int i = 0;
+  int i, n;
+  int found = 0;
 
   // First find the PAT, to identify the service_id and pmt_pid
-  while(1) {
-    n = rb_read(&sv->inbuf,buf,188);
-    check_cc("rb_read0",sv->id, &sv->my_cc[0], buf);
-    (void)n;
-    i++;
-    pid = (((buf[1] & 0x1f) << 8) | buf[2]);
-
-    //fprintf(stderr,"Searching for PAT, pid=%d %02x %02x %02x %02x\n",pid,buf[0],buf[1],buf[2],buf[3]);
-    if (pid==0) {
-      process_pat(sv,buf);
-      break;
+  while (!found) {
+    n = peek_batch(sv, &b, &pkts);
+    for (i = 0; i < n; i++) {
+      //fprintf(stderr,"Searching for PAT, pid=%d\n",b.pid[i]);
+      if (b.pid[i]==0) {
+        process_pat(sv,pkts + i*188);
+        found = 1;
+        i++;
+        break;
+      }
     }
+    consume_batch(sv, &b, i);
   }
 
   // Now process the other tables, in any order
   //  PMT: sv->pmt_pid
   //  SDT: 
-  while((!sv->pmt.length) || (!sv->sdt.length)) {
-    n = rb_read(&sv->inbuf,buf,188);
-    check_cc("rb_read1",sv->id, &sv->my_cc[0], buf);
-    i++;
-    pid = (((buf[1] & 0x1f) << 8) | buf[2]);
-    if (pid==sv->pmt_pid) {
-      process_section(&sv->next_pmt,&sv->pmt,buf,0x02);
-    } else if (pid==17) {
-      process_section(&sv->next_sdt,&sv->sdt,buf,0x42);
-      if (sv->sdt.length) {
-        process_sdt(sv);
+  while((!sv->pmt->length) || (!sv->sdt->length)) {
+    n = peek_batch(sv, &b, &pkts);
+    for (i = 0; (i < n) && ((!sv->pmt->length) || (!sv->sdt->length)); i++) {
+      pid = b.pid[i];
+      buf = pkts + i*188;
+      if (pid==sv->pmt_pid) {
+        read_section(sv,sv->next_pmt,sv->pmt,buf,0x02,pid);
+      } else if (pid==17) {
+        read_section(sv,sv->next_sdt,sv->sdt,buf,0x42,pid);
+        if (sv->sdt->length) {
+          process_sdt(sv);
+        }
       }
     }
+    consume_batch(sv, &b, i);
   }
 
   process_pmt(sv);
+  update_pid_filter(sv);
 
-  //fprintf(stderr,"Read SDT (%d bytes) and PMT (%d bytes)\n",sv->sdt.length,sv->pmt.length);
+  //fprintf(stderr,"Read SDT (%d bytes) and PMT (%d bytes)\n",sv->sdt->length,sv->pmt->length);
 
   // Read until we find a packet with a PCR
   // TODO: Merge this into the loop above, so we are always using the latest PMT/PAT when we have found a PCR.
@@ -216,91 +274,120 @@ int init_service(struct service_t* sv)
   return 0;  
 }
 
+/* Packets are inspected in place in the input ringbuffer, and only
+   the ones we are going to output are copied to sv->buf. */
 void read_to_next_pcr(struct mux_t* mux, struct service_t* sv)
 {
+  struct ts_batch_t b;
   int found = 0;
-  uint8_t* buf = (uint8_t*)(&sv->buf) + 188 * sv->packets_in_buf;
+  uint8_t* buf = sv->buf + 188 * sv->packets_in_buf;
+  uint8_t* pkts;
+  int i, n;
+
+  if (sv->pid_filter_pending)
+    update_pid_filter(sv);
 
   while (!found) {
-    int n = rb_read(&sv->inbuf,buf,188);
-    check_cc("rb_read2",sv->id, &sv->my_cc[0], buf);
-    (void)n;
-    int pid = (((buf[1] & 0x1f) << 8) | buf[2]);
-    if (pid==sv->pcr_pid) {
-      if (((buf[3] & 0x20) == 0x20) && (buf[4] > 5) && (buf[5] & 0x10)) {
-        sv->first_pcr = sv->second_pcr;
-        sv->second_pcr  = (uint64_t)buf[6] << 25;
-        sv->second_pcr |= (uint64_t)buf[7] << 17;
-        sv->second_pcr |= (uint64_t)buf[8] << 9;
-        sv->second_pcr |= (uint64_t)buf[9] << 1;
-        sv->second_pcr |= ((uint64_t)buf[10] >> 7) & 0x01;
-        sv->second_pcr *= 300;
-        sv->second_pcr += ((buf[10] & 0x01) << 8) | buf[11];
-
-        if (sv->second_pcr < sv->first_pcr) {
-          fprintf(stderr,"WARNING: PCR wraparound - first_pcr=%s",pts2hmsu(sv->first_pcr,'.'));
-          fprintf(stderr,", second_pcr=%s",pts2hmsu(sv->second_pcr,'.'));
+    n = peek_batch(sv, &b, &pkts);
+    uint64_t trace_pos = latency_next(&sv->trace);
+    for (i = 0; (i < n) && (!found); i++) {
+      uint8_t* pkt = pkts + i*188;
+      int pid = b.pid[i];
+      if (pid==sv->pcr_pid) {
+        if (b.flags[i] & TS_HAS_PCR) {
+          sv->first_pcr = sv->second_pcr;
+          sv->second_pcr  = (uint64_t)pkt[6] << 25;
+          sv->second_pcr |= (uint64_t)pkt[7] << 17;
+          sv->second_pcr |= (uint64_t)pkt[8] << 9;
+          sv->second_pcr |= (uint64_t)pkt[9] << 1;
+          sv->second_pcr |= ((uint64_t)pkt[10] >> 7) & 0x01;
+          sv->second_pcr *= 300;
+          sv->second_pcr += ((pkt[10] & 0x01) << 8) | pkt[11];
+
+          if (sv->second_pcr < sv->first_pcr) {
+            fprintf(stderr,"WARNING: PCR wraparound - first_pcr=%s",pts2hmsu(sv->first_pcr,'.'));
+            fprintf(stderr,", second_pcr=%s",pts2hmsu(sv->second_pcr,'.'));
+          } else if (sv->second_pcr - sv->first_pcr > TS_MAX_PCR_INTERVAL) {
+            ts_error(sv->errors, TSERR_PCR_GAP, pid);
+          }
+          found = 1;
         }
-        found = 1;
       }
-    }
 
-    if (pid==0x12) {
-      process_section(&sv->next_eit,&sv->eit,buf,0x4e);  // EITpf, actual TS
-      if (sv->eit.length) {
-        struct section_t new_eit;
-        if (rewrite_eit(&new_eit, &sv->eit, sv->service_id, sv->new_service_id, sv->onid, mux) == 0) {  // This is for this service
-          int npackets = copy_section(buf, &new_eit, 0x12);
-          sv->packets_in_buf += npackets;
-          buf += npackets * 188;
+      if (pid==sv->pmt_pid) {
+        read_section(sv,sv->next_pmt,sv->pmt,pkt,0x02,pid);
+        if ((sv->pmt->length) && (((sv->pmt->buf[5] & 0x3e) >> 1) != sv->pmt_version))
+          pmt_changed(sv);
+      }
+
+      if (pid==0x12) {
+        read_section(sv,sv->next_eit,sv->eit,pkt,0x4e,pid);  // EITpf, actual TS
+        if (sv->eit->length) {
+          struct section_t new_eit;
+          if (rewrite_eit(&new_eit, sv->eit, sv->service_id, sv->new_service_id, sv->onid, mux) == 0) {  // This is for this service
+            int npackets = copy_section(buf, &new_eit, 0x12);
+            sv->packets_in_buf += npackets;
+            buf += npackets * 188;
+          }
+          sv->eit->length = 0; // Clear section, we are done with it.
         }
-        sv->eit.length = 0; // Clear section, we are done with it.
       }
-    }
 
-    if (sv->pid_map[pid]) {
-      // Change PID
-      buf[1] = (buf[1] & ~0x1f) | ((sv->pid_map[pid] & 0x1f00) >> 8);
-      buf[2] = sv->pid_map[pid] & 0x00ff;
+      if (sv->pid_map[pid]) {
+        // Copy and change PID
+        memcpy(buf, pkt, 188);
+        buf[1] = (buf[1] & ~0x1f) | ((sv->pid_map[pid] & 0x1f00) >> 8);
+        buf[2] = sv->pid_map[pid] & 0x00ff;
+
+        if (sv->trace.read_pos + i*188 >= trace_pos) {
+          latency_mux_in(mux->latency, &sv->trace, sv->trace.read_pos + i*188, sv->packets_in_buf);
+          trace_pos = UINT64_MAX;
+        }
 
-      sv->packets_in_buf++;
-      buf += 188;
+        sv->packets_in_buf++;
+        buf += 188;
+      }
     }
+    consume_batch(sv, &b, i);
   }
 }
 
 void sync_to_pcr(struct service_t* sv)
 {
-  int n;
+  struct ts_batch_t b;
+  uint8_t *pkts, *buf;
   int pid;
-  uint8_t buf[188];
+  int i, n;
 
   while (1) {
-    n = rb_read(&sv->inbuf,buf,188);
-    check_cc("rb_read3",sv->id, &sv->my_cc[0], buf);
-    (void)n;
-    pid = (((buf[1] & 0x1f) << 8) | buf[2]);
-    if (pid==sv->pmt_pid) {
-      process_section(&sv->next_pmt,&sv->pmt,buf,0x02);
-    } else if (pid==17) {
-      process_section(&sv->next_sdt,&sv->sdt,buf,0x42);
-    } else if (pid==sv->pcr_pid) {
-      // e.g. 4709 0320 b7 10 ff5b d09c 00ab
-      if (((buf[3] & 0x20) == 0x20) && (buf[4] > 5) && (buf[5] & 0x10)) {
-        sv->start_pcr  = (uint64_t)buf[6] << 25;
-        sv->start_pcr |= (uint64_t)buf[7] << 17;
-        sv->start_pcr |= (uint64_t)buf[8] << 9;
-        sv->start_pcr |= (uint64_t)buf[9] << 1;
-        sv->start_pcr |= ((uint64_t)buf[10] >> 7) & 0x01;
-        sv->start_pcr *= 300;
-        sv->start_pcr += ((buf[10] & 0x01) << 8) | buf[11];
-        sv->second_pcr = sv->start_pcr;
-        fprintf(stderr,"Service %d, pid=%d, start_pcr=%lld (%s)\n",sv->id,pid,sv->start_pcr,pts2hmsu(sv->start_pcr,'.'));
-        memcpy(&sv->buf,buf,188);
-        sv->packets_in_buf = 1;
-        return;
+    n = peek_batch(sv, &b, &pkts);
+    for (i = 0; i < n; i++) {
+      pid = b.pid[i];
+      buf = pkts + i*188;
+      if (pid==sv->pmt_pid) {
+        read_section(sv,sv->next_pmt,sv->pmt,buf,0x02,pid);
+      } else if (pid==17) {
+        read_section(sv,sv->next_sdt,sv->sdt,buf,0x42,pid);
+      } else if (pid==sv->pcr_pid) {
+        // e.g. 4709 0320 b7 10 ff5b d09c 00ab
+        if (b.flags[i] & TS_HAS_PCR) {
+          sv->start_pcr  = (uint64_t)buf[6] << 25;
+          sv->start_pcr |= (uint64_t)buf[7] << 17;
+          sv->start_pcr |= (uint64_t)buf[8] << 9;
+          sv->start_pcr |= (uint64_t)buf[9] << 1;
+          sv->start_pcr |= ((uint64_t)buf[10] >> 7) & 0x01;
+          sv->start_pcr *= 300;
+          sv->start_pcr += ((buf[10] & 0x01) << 8) | buf[11];
+          sv->second_pcr = sv->start_pcr;
+          fprintf(stderr,"Service %d, pid=%d, start_pcr=%lld (%s)\n",sv->id,pid,sv->start_pcr,pts2hmsu(sv->start_pcr,'.'));
+          memcpy(sv->buf,buf,188);
+          sv->packets_in_buf = 1;
+          consume_batch(sv, &b, i + 1);
+          return;
+        }
       }
     }
+    consume_batch(sv, &b, n);
   }
 }
 
@@ -369,82 +456,90 @@ static int calc_channel_capacity(struct dvb_modulator_parameters *params)
   return channel_capacity/544*423;
 }
 
-static void *output_thread(void* userp)
+static int ms_to_bits(int channel_capacity, int ms)
 {
-  struct mux_t *m = userp;
-  int mod_fd;
-  int result;
-  int channel_capacity;
-  int gain;
-
-  /* Open Device */
-  if ((mod_fd = open(m->device, O_RDWR)) < 0) {
-    fprintf(stderr,"Failed to open device.\n");
-    return;
-  }
-
-  m->dvbmod_params.cell_id = 0;
-  result = ioctl(mod_fd, DVBMOD_SET_PARAMETERS, &m->dvbmod_params);
-
-  struct dvb_modulator_gain_range gain_range;
-  gain_range.frequency_khz = m->dvbmod_params.frequency_khz;
-  result = ioctl(mod_fd, DVBMOD_GET_RF_GAIN_RANGE, &gain_range);
-  fprintf(stderr,"Gain range: %d to %d\n",gain_range.min_gain,gain_range.max_gain);
-
-  result = ioctl(mod_fd, DVBMOD_SET_RF_GAIN, &m->gain);
-  fprintf(stderr,"Gain set to %d\n",m->gain);
-
-  /* Wait for 4MB in the ringbuffer */
-  while (rb_get_bytes_used(&m->outbuf) < 10*1024*1024) {
-    usleep(50000);
-  }
+  return ((int64_t)(((int64_t)channel_capacity * (int64_t)(ms)) / 1000));
+}
 
-  /* The main transfer loop */
-  unsigned char buf[188*200];
-  int n;
-  unsigned long long bytes_sent = 0;
-  while(1) {
-    n = rb_read(&m->outbuf,buf,sizeof(buf));
-    if (n == 0) { break; }
-
-    int to_write = n;
-    int bytes_done = 0;
-    while (bytes_done < to_write) {
-      n = write(mod_fd,buf+bytes_done,to_write-bytes_done);
-      if (n == 0) {
-        /* This shouldn't happen */
-        fprintf(stderr,"Zero write\n");
-        usleep(500);
-      } else if (n <= 0) {
-	fprintf(stderr,"Write error %d: ",n);
-        perror("Write error: ");
-      } else {
-        //if (n < sizeof(buf)) { fprintf(stderr,"Short write - %d bytes\n",n); }
-        //fprintf(stderr,"Wrote %d\n",n);
-        bytes_sent += n;
-        bytes_done += n;
-        //fprintf(stderr,"Bytes sent: %llu\r",bytes_sent);
-      }
-    }
-  }  
+static int ms_to_bytes(int bitrate, int ms)
+{
+  return ms_to_bits(bitrate, ms) / 8;
+}
 
-  close(mod_fd);
-  return;
+/* Allocate a service's tables.  Called from the mux thread, so that
+   they are on its NUMA node. */
+static int service_alloc(struct service_t* sv)
+{
+  struct service_sections_t* sections = calloc(1, sizeof(struct service_sections_t));
+
+  sv->buf = malloc(INPUT_BUFFER_SIZE_IN_PACKETS*188);
+  sv->bitpos = calloc(INPUT_BUFFER_SIZE_IN_PACKETS, sizeof(int64_t));
+  sv->pid_map = calloc(8192, sizeof(uint16_t));
+  sv->my_cc = malloc(8192);
+  sv->errors = calloc(1, sizeof(struct ts_errors_t));
+  sv->ingest_errors = calloc(1, sizeof(struct ts_errors_t));
+  if (!(sections && sv->buf && sv->bitpos && sv->pid_map && sv->my_cc && sv->errors && sv->ingest_errors))
+    return -1;
+
+  memset(sv->my_cc, 0xff, 8192);
+
+  sv->pmt = &sections->pmt;
+  sv->sdt = &sections->sdt;
+  sv->eit = &sections->eit;
+  sv->next_pmt = &sections->next_pmt;
+  sv->next_sdt = &sections->next_sdt;
+  sv->next_eit = &sections->next_eit;
+  sv->ait = &sections->ait;
+  sv->new_pmt = &sections->new_pmt;
+  return 0;
 }
 
-static int ms_to_bits(int channel_capacity, int ms)
+/* Called when only the last packet read (the one with the PCR) is left
+   to output - read up to the next PCR and schedule the packets in
+   between. */
+static void refill_service(struct mux_t* m, struct service_t* sv)
 {
-  return ((int64_t)(((int64_t)channel_capacity * (int64_t)(ms)) / 1000));
+  int j;
+
+  // Move last packet to start of buffer
+  sv->first_pcr = sv->second_pcr;
+  memcpy(sv->buf, sv->buf + (188 * (sv->packets_in_buf-1)), 188);
+  sv->packets_written = 0;
+  sv->packets_in_buf = 1;
+  if (sv->trace.slot >= 0)  // Only the unwritten last packet can still be traced
+    sv->trace.slot = 0;
+
+  read_to_next_pcr(m,sv);
+
+  int64_t pcr_diff = sv->second_pcr - sv->first_pcr;
+  sv->pcr_delta = pcr_diff;
+  sv->pcr_delta_max = MAX(sv->pcr_delta_max, pcr_diff);
+  int npackets = sv->packets_in_buf;
+  //double packet_duration = pcr_diff / (double)npackets;
+  //fprintf(stderr,"Stream %d: pcr_diff = %lld, npackets=%lld, packet duration=%.8g ticks\n",sv->id,pcr_diff,npackets,packet_duration);
+
+  // Now calculate the output position for each packet, in terms of total bits written so far.
+  for (j=0;j<sv->packets_in_buf;j++) {
+    int64_t  packet_pcr = sv->first_pcr + ((j * pcr_diff)/(npackets-1)) - sv->start_pcr;
+    sv->bitpos[j] = (packet_pcr * m->channel_capacity) / 27000000;
+    //fprintf(stderr, "Stream %d, packet %d, packet_pcr = %lld, bitpos %lld\n",sv->id,j,packet_pcr,sv->bitpos[j]);
+  }
 }
 
+/* Carousel entry types, in the order of the stats psi_sections counters */
+enum { PSI_NONE = -1, PSI_PAT, PSI_PMT, PSI_SDT, PSI_NIT, PSI_AIT };
+
 /* The main thread for each mux */
 static void *mux_thread(void* userp)
 {
   struct mux_t *m = userp;
-  int i,j;
+  int i;
 
-  /* Calculate target bitrate */
-  m->channel_capacity = calc_channel_capacity(&m->dvbmod_params);
+  /* Calculate target bitrate, unless it was given in the config */
+  if (m->bitrate)
+    m->channel_capacity = m->bitrate;
+  else
+    m->channel_capacity = calc_channel_capacity(&m->dvbmod_params);
   fprintf(stderr,"Channel capacity = %dbps\n",m->channel_capacity);
 
   // SI table frequencies, in bits based on above bitrate
@@ -454,8 +549,28 @@ static void *mux_thread(void* userp)
   m->nit_freq_in_bits = ms_to_bits(m->channel_capacity,1000);
   m->ait_freq_in_bits = ms_to_bits(m->channel_capacity,500);
 
-  /* Initialise output ringbuffer */
-  rb_init(&m->outbuf);
+  /* A pinned mux allocates its ringbuffers up front, from this thread,
+     so they are on its NUMA node */
+  int rb_flags = m->cpus ? RB_PREFAULT : 0;
+
+  /* Initialise output ringbuffer.  The output thread is latency
+     critical, so spin briefly before parking. */
+  int outbuf_size = ms_to_bytes(m->channel_capacity, m->output_buffer_ms ? m->output_buffer_ms : DEFAULT_OUTPUT_BUFFER_MS);
+  if (rb_init(&m->outbuf, outbuf_size, rb_flags | (m->hugepages ? RB_HUGEPAGES : 0)) < 0) {
+    fprintf(stderr,"Could not create output buffer, aborting\n");
+    return NULL;
+  }
+  rb_set_wait(&m->outbuf, RB_WAIT_HYBRID, output_chunk_size(m->output), OUTPUT_PUBLISH_BATCH, OUTPUT_SPIN_COUNT);
+
+  if (m->latency_trace)
+    m->latency = latency_create();
+
+  /* The analyser must be running before any output is written */
+  if (m->tr101290) {
+    m->analyser = tr101290_create(m);
+    if (m->analyser == NULL)
+      fprintf(stderr,"WARNING: Could not start the TR 101 290 analyser\n");
+  }
 
   /* Start output thread */
   fprintf(stderr,"Creating output thread\n");
@@ -468,22 +583,44 @@ static void *mux_thread(void* userp)
     return;
   }
 
+  /* Start the input event loop thread(s) */
+  char name[32];
+  snprintf(name, sizeof(name), "Mux %d", m->id);
+  m->ingest = ingest_create(m->ingest_threads, m->ingest_buffer_size, &m->ingest_sched, name);
+  if (m->ingest == NULL) {
+    fprintf(stderr,"Could not start ingest threads, aborting\n");
+    return NULL;
+  }
+
   for (i=0;i<m->nservices;i++) {
     m->services[i].id = i;
     m->services[i].new_pmt_pid = (i+1)*100;
-    for (j=0;j<8192;j++) { m->services[i].my_cc[j] = 0xff; }
-    for (j=0;j<8192;j++) { m->services[i].curl_cc[j] = 0xff; }
+    if (service_alloc(&m->services[i]) < 0) {
+      fprintf(stderr,"Could not allocate service %d, aborting\n",i);
+      return NULL;
+    }
+    m->services[i].trace.enabled = (m->latency != NULL);
+    m->services[i].trace.slot = -1;
+
+    /* Size the input buffer from the expected bitrate and jitter budget */
+    struct service_t* sv = &m->services[i];
+    int inbuf_size = ms_to_bytes(sv->max_bitrate ? sv->max_bitrate : DEFAULT_INPUT_MAX_BITRATE,
+                                 sv->buffer_ms ? sv->buffer_ms : DEFAULT_INPUT_BUFFER_MS);
+    if (rb_init(&sv->inbuf, inbuf_size, rb_flags) < 0) {
+      fprintf(stderr,"Could not create input buffer for service %d, aborting\n",i);
+      return NULL;
+    }
 
-    fprintf(stderr,"Creating thread %d\n",i);
-    int error = pthread_create(&m->services[i].curl_threadid,
-                               NULL, /* default attributes please */
-                               curl_thread,
-                               (void *)&m->services[i]);
+    /* The mux thread reads one packet at a time, but the input is
+       buffered for seconds - once it has run dry, park it until a
+       good batch is available (or the 100ms park timeout expires)
+       rather than waking it for every chunk received. */
+    rb_set_wait(&m->services[i].inbuf, RB_WAIT_BLOCK, INGEST_WAKE_LEVEL, 0, 0);
 
-    if (error)
-      fprintf(stderr, "Couldn't run thread number %d, errno %d\n", i, error);
+    if (ingest_add_service(m->ingest, &m->services[i]) < 0)
+      fprintf(stderr, "Couldn't start service %d\n", i);
     else
-      fprintf(stderr, "Thread %d, gets %s\n", i, m->services[i].url);
+      fprintf(stderr, "Service %d, gets %s\n", i, m->services[i].url);
   }
 
   for (i=0;i<m->nservices;i++) {
@@ -508,7 +645,7 @@ static void *mux_thread(void* userp)
   /* Flush the input buffers */  
   for (i=0;i<m->nservices;i++) {
     int to_skip = (rb_get_bytes_used(&m->services[i].inbuf)/188) * 188;
-    rb_skip(&m->services[i].inbuf, to_skip);
+    rb_consume(&m->services[i].inbuf, to_skip);
     fprintf(stderr,"Skipped %d bytes from service %d\n",to_skip,i);
     // Reset CC counters
     for (j=0;j<8192;j++) { m->services[i].my_cc[j] = 0xff; }
@@ -525,88 +662,94 @@ static void *mux_thread(void* userp)
   create_sdt(&m->sdt, m);
   create_nit(&m->nit, m);
 
+  if (m->stats_shm || m->stats_port) {
+    m->stats = stats_create(m);
+    if (m->stats == NULL)
+      fprintf(stderr,"WARNING: Could not create the stats page\n");
+  }
+  uint64_t psi_sections[STATS_PSI_TYPES] = { 0 };
+
+  /* Now the helper threads have all been started (so won't inherit
+     them), switch to the mux thread's own scheduling settings */
+  snprintf(name, sizeof(name), "Mux %d mux thread", m->id);
+  rt_apply(name, &m->mux_sched);
+
   int64_t output_bitpos = 0;
-  int64_t next_pat_bitpos = 0;
-  int64_t next_pmt_bitpos = 0;
-  int64_t next_sdt_bitpos = 0;
-  int64_t next_nit_bitpos = 0;
-  int64_t next_ait_bitpos = 0;
+
+  // The PSI/SI carousel.  Each service's PMT is given its own phase, so
+  // the PMTs are spread evenly over the interval instead of being sent
+  // as one burst; the SI tables are likewise kept apart from the PAT.
+  struct carousel_t carousel;
+  if (carousel_init(&carousel, 4 + m->nservices) < 0) {
+    fprintf(stderr,"Could not create PSI carousel, aborting\n");
+    return NULL;
+  }
+  carousel_add(&carousel, PSI_PAT, 0, m->pat_freq_in_bits, 0);
+  for (i=0;i<m->nservices;i++) {
+    carousel_add(&carousel, PSI_PMT, i, m->pmt_freq_in_bits, (int64_t)m->pmt_freq_in_bits * i / m->nservices);
+  }
+  carousel_add(&carousel, PSI_SDT, 0, m->sdt_freq_in_bits, m->pat_freq_in_bits / 4);
+  carousel_add(&carousel, PSI_NIT, 0, m->nit_freq_in_bits, m->pat_freq_in_bits / 2);
+  if (m->services[0].ait_pid)
+    carousel_add(&carousel, PSI_AIT, 0, m->ait_freq_in_bits, m->pat_freq_in_bits * 3 / 4);
+  carousel_start(&carousel);
+
+  // Schedule the first packets from every service.  After this, only
+  // the service a packet has just been output from needs to be looked at.
+  struct pktsched_t sched;
+  if (pktsched_init(&sched, m->nservices) < 0) {
+    fprintf(stderr,"Could not create packet scheduler, aborting\n");
+    return NULL;
+  }
+  int64_t* first_bitpos = calloc(m->nservices, sizeof(int64_t));
+  for (i=0;i<m->nservices;i++) {
+    refill_service(m, &m->services[i]);
+    first_bitpos[i] = m->services[i].bitpos[0];
+  }
+  pktsched_build(&sched, first_bitpos);
+  free(first_bitpos);
 
   // The main output loop.  We output one TS packet (either real or padding) in each iteration.
   int x = 1;
   int64_t padding_bits = 0;
   int eit_cc = 0;
-  while (1) {
-    // Ensure we have enough data for every service.
-    for (i=0;i<m->nservices;i++) {
-      if (m->services[i].packets_in_buf-m->services[i].packets_written == 1) {  // Will contain a PCR.
-        struct service_t* sv = &m->services[i];
-
-        // Move last packet to start of buffer
-        sv->first_pcr = sv->second_pcr;
-        memcpy(&sv->buf, (uint8_t*)(&sv->buf) + (188 * (sv->packets_in_buf-1)), 188);
-        sv->packets_written = 0;
-        sv->packets_in_buf = 1;
-
-        read_to_next_pcr(m,sv);
-
-        int64_t pcr_diff = sv->second_pcr - sv->first_pcr;
-        int npackets = sv->packets_in_buf;
-        //double packet_duration = pcr_diff / (double)npackets;
-        //fprintf(stderr,"Stream %d: pcr_diff = %lld, npackets=%lld, packet duration=%.8g ticks\n",i,pcr_diff,npackets,packet_duration);
-
-        // Now calculate the output position for each packet, in terms of total bits written so far.
-        for (j=0;j<sv->packets_in_buf;j++) {
-          int64_t  packet_pcr = sv->first_pcr + ((j * pcr_diff)/(npackets-1)) - sv->start_pcr;
-          sv->bitpos[j] = (packet_pcr * m->channel_capacity) / 27000000;
-          //fprintf(stderr, "Stream %d, packet %d, packet_pcr = %lld, bitpos %lld\n",i,j,packet_pcr,sv->bitpos[j]);
-        }
-      }
-    }
-
-    // Find the service with the most urgent packet (i.e. earliest bitpos)
-    struct service_t* sv = &m->services[0];
-    for (i=1;i<m->nservices;i++) {
-      if (m->services[i].bitpos[m->services[i].packets_written] < sv->bitpos[sv->packets_written]) {
-        sv = &m->services[i];
-      }
-    }
+  while (!atomic_load_explicit(&m->output_stopped, memory_order_acquire)) {
+    // The service with the most urgent packet (i.e. earliest bitpos)
+    struct service_t* sv = &m->services[pktsched_top(&sched)];
 
     //fprintf(stderr,"output_bitpos=%d, sv->bitpos[sv->packets_written]=%d\n",output_bitpos,sv->bitpos[sv->packets_written]);
 
 #if 0
-    fprintf(stderr,"output_bitpos  next_pat   next_pmt   next_sdt   next_nit");
+    fprintf(stderr,"output_bitpos  next_psi");
     for (i=0;i<m->nservices;i++) { fprintf(stderr,"  service_%d",i); }
     fprintf(stderr,"\n");
-    fprintf(stderr,"%lld %lld %lld %lld %lld",output_bitpos,next_pat_bitpos,next_pmt_bitpos,next_sdt_bitpos,next_sdt_bitpos);
+    fprintf(stderr,"%lld %lld",output_bitpos,carousel_top(&carousel)->due);
     for (i=0;i<m->nservices;i++) { fprintf(stderr," %lld",m->services[i].bitpos[m->services[i].packets_written]); }
     fprintf(stderr,"\n");
 //    return 0;
 #endif
 
-    /* Now check for PSI packets */
-    int next_psi = 0;
+    /* Now check for PSI packets - these go first if due at the same time */
+    struct carousel_entry_t* psi = carousel_top(&carousel);
+    int next_psi = PSI_NONE;
     int64_t next_bitpos = sv->bitpos[sv->packets_written];
-    if (next_pat_bitpos <= next_bitpos) { next_psi = 1; next_bitpos = next_pat_bitpos; }
-    if (next_pmt_bitpos <= next_bitpos) { next_psi = 2; next_bitpos = next_pmt_bitpos; }
-    if (next_sdt_bitpos <= next_bitpos) { next_psi = 3; next_bitpos = next_sdt_bitpos; }
-    if (next_nit_bitpos <= next_bitpos) { next_psi = 4; next_bitpos = next_nit_bitpos; }
-    if ((m->services[0].ait_pid) && (next_ait_bitpos <= next_bitpos)) { next_psi = 5; next_bitpos = next_ait_bitpos; } 
+    if (psi->due <= next_bitpos) { next_psi = psi->type; next_bitpos = psi->due; }
 
     /* Output NULL packets until we reach next_bitpos */
-    while (next_bitpos > output_bitpos) {
+    if (next_bitpos > output_bitpos) {
+      int npadding = (next_bitpos - output_bitpos + 188*8 - 1) / (188*8);
       //fprintf(stderr,"next_bitpos=%lld, output_bitpos=%lld            \n",next_bitpos,output_bitpos);
-      rb_write(&m->outbuf, null_packet, 188);
-      padding_bits += 188*8;
-      output_bitpos += 188*8;
+      write_null_packets(&m->outbuf, npadding);
+      padding_bits += npadding * 188*8;
+      output_bitpos += npadding * 188*8;
     }
 
     /* Now output whichever packet is next */
-    int n,res;
+    int n = 0, res;
     uint8_t* buf;
     int pid;
     switch (next_psi) {
-      case 0:
+      case PSI_NONE:
         buf = &sv->buf[188*sv->packets_written];
         pid = (((buf[1] & 0x1f) << 8) | buf[2]);
         if (pid==0x12) { // EIT - fix CC
@@ -615,55 +758,81 @@ static void *mux_thread(void* userp)
         }
         res = rb_write(&m->outbuf, &sv->buf[188*sv->packets_written], 188);
         if (res != 188) { fprintf(stderr,"Write error - res=%d\n",res); }
+        if (sv->packets_written == sv->trace.slot)
+          latency_mux_out(m->latency, &sv->trace, output_bitpos / 8);
         n = 1;
         sv->packets_written++;
+        sv->packets_out++;
+
+        if (sv->packets_in_buf-sv->packets_written == 1)  // Will contain a PCR.
+          refill_service(m, sv);
+        pktsched_update_top(&sched, sv->bitpos[sv->packets_written]);
         break;
 
-      case 1: // PAT
+      case PSI_PAT:
         n = write_section(&m->outbuf, &m->pat, 0);
-        next_pat_bitpos += m->pat_freq_in_bits;
         break;
 
-      case 2: // PMT
-        n = 0;
-        for (i=0;i<m->nservices;i++) {
-          n += write_section(&m->outbuf,&m->services[i].new_pmt, m->services[i].new_pmt_pid);
-        }
-        next_pmt_bitpos += m->pmt_freq_in_bits;
+      case PSI_PMT:
+        n = write_section(&m->outbuf, m->services[psi->arg].new_pmt, m->services[psi->arg].new_pmt_pid);
         break;
 
-      case 3: // SDT
+      case PSI_SDT:
         n = write_section(&m->outbuf, &m->sdt, 0x11);
-        next_sdt_bitpos += m->sdt_freq_in_bits;
         break;
 
-      case 4: // NIT
+      case PSI_NIT:
         n = write_section(&m->outbuf, &m->nit, 0x10);
-        next_nit_bitpos += m->nit_freq_in_bits;
         break;
 
-      case 5: // AIT
-        n = write_section(&m->outbuf, &m->services[0].ait, m->services[0].ait_pid);
-        next_ait_bitpos += m->ait_freq_in_bits;
+      case PSI_AIT:
+        n = write_section(&m->outbuf, m->services[0].ait, m->services[0].ait_pid);
         break;
     }
     output_bitpos += n * 188*8;
+    if (next_psi != PSI_NONE) {
+      psi_sections[next_psi]++;
+      carousel_advance(&carousel);
+    }
 
     if (x==1000) {
       x = 0;
+      if (m->stats)
+        stats_update(m->stats, output_bitpos, padding_bits, psi_sections);
+      fprintf(stderr,"Mux %d: ",m->id);
       for (i=0;i<m->nservices;i++) {
-        fprintf(stderr,"%10d  ",rb_get_bytes_used(&m->services[i].inbuf));
+        struct service_t* s = &m->services[i];
+        uint64_t filtered = atomic_load_explicit(&s->packets_filtered, memory_order_relaxed);
+        uint64_t in = atomic_load_explicit(&s->packets_in, memory_order_relaxed);
+        fprintf(stderr,"%10d (%2d%% filtered)  ",rb_get_bytes_used(&s->inbuf),
+                in ? (int)(100 * filtered / in) : 0);
       }
       fprintf(stderr,"Average capacity used: %.3g%%  Outbuf = %10d               \r",100.0*(double)(output_bitpos-padding_bits)/(double)output_bitpos,rb_get_bytes_used(&m->outbuf));
+
+      for (i=0;i<m->nservices;i++) {
+        struct service_t* s = &m->services[i];
+        struct ts_errors_t* errors[2] = { s->errors, s->ingest_errors };
+        char name[32];
+        snprintf(name, sizeof(name), "Mux %d service %d", m->id, i);
+        ts_errors_report(name, errors, 2, &s->errors_report);
+      }
+      if (m->latency)
+        latency_report(m->latency);
     }
     x++;
   }
+
+  fprintf(stderr,"\nMux %d: output has stopped, stopping mux\n",m->id);
+  if (m->stats)
+    stats_stop(m->stats);
+  return NULL;
 }
 
 int main(int argc, char* argv[])
 {
   int nmuxes;
   struct mux_t *muxes;
+  int i;
 
   if (argc != 2) {
     fprintf(stderr,"Usage: dvb2dvb config.json\n");
@@ -677,27 +846,67 @@ int main(int argc, char* argv[])
     return 1;
   }
 
-  if (nmuxes != 1) {
-    fprintf(stderr,"[JSON] Error - only 1 mux supported for now\n");
-    return 1;
-  }
-
   /* Must initialize libcurl before any threads are started */
   curl_global_init(CURL_GLOBAL_ALL);
+  init_null_page();
+  fprintf(stderr,"Using %s CRC-32\n", psi_crc32_init());
+  fprintf(stderr,"Using %s packet classifier\n", ts_classify_init());
+  fprintf(stderr,"Using %s sync search\n", tssync_init());
+
+  /* Lock memory before anything is allocated, so the ringbuffers are
+     locked as they are created */
+  for (i=0;i<nmuxes;i++) {
+    if (muxes[i].mlockall) {
+      rt_lock_memory();
+      break;
+    }
+  }
 
-  /* TODO: Do this for each mux */
+  /* Each mux runs independently, with its own mux, output and ingest
+     threads.  These all inherit the mux thread's CPU affinity. */
+  for (i=0;i<nmuxes;i++) {
+    struct mux_t* m = &muxes[i];
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+
+    m->id = i;
+    pthread_attr_init(&attr);
+    if (m->cpus) {
+      cpu_set_t allowed;
+      int n = cpuset_parse(m->cpus, &cpus);
+      if (n < 0) {
+        fprintf(stderr,"[JSON] Invalid CPU list \"%s\" for mux %d\n",m->cpus,i);
+        return 1;
+      }
+      sched_getaffinity(0, sizeof(allowed), &allowed);
+      CPU_AND(&cpus, &cpus, &allowed);
+      if (CPU_COUNT(&cpus) == 0) {
+        fprintf(stderr,"None of CPUs %s for mux %d are available\n",m->cpus,i);
+        return 1;
+      }
+      if (CPU_COUNT(&cpus) < n)
+        fprintf(stderr,"WARNING: Only %d of CPUs %s for mux %d are available\n",CPU_COUNT(&cpus),m->cpus,i);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+      int node = cpuset_node(&cpus);
+      if (node >= 0)
+        fprintf(stderr,"Mux %d runs on CPUs %s (NUMA node %d)\n",i,m->cpus,node);
+      else
+        fprintf(stderr,"Mux %d runs on CPUs %s\n",i,m->cpus);
+    }
 
-  fprintf(stderr,"Creating mux processing thread 0\n");
-  int error = pthread_create(&muxes[0].threadid,
-                             NULL, /* default attributes please */
-                             mux_thread,
-                             (void *)muxes);
+    fprintf(stderr,"Creating mux processing thread %d\n",i);
+    int error = pthread_create(&m->threadid, &attr, mux_thread, (void *)m);
+    pthread_attr_destroy(&attr);
+    if (error) {
+      fprintf(stderr,"Couldn't create mux thread %d - errno %d\n",i,error);
+      return 1;
+    }
+  }
 
-  fprintf(stderr,"Created mux thread - error=%d\n",error);
-  fprintf(stderr,"Waiting for mux thread to terminate...\n");
-  
-  pthread_join(muxes[0].threadid, NULL);
+  fprintf(stderr,"Waiting for mux threads to terminate...\n");
+  for (i=0;i<nmuxes;i++)
+    pthread_join(muxes[i].threadid, NULL);
 
-  fprintf(stderr,"Mux thread terminated.\n");
+  fprintf(stderr,"Mux threads terminated.\n");
   return 0;
 }
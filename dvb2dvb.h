@@ -25,7 +25,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "ringbuffer.h"
+#include "tssync.h"
+#include "tserror.h"
+#include "latency.h"
+#include "rtsched.h"
 #include "dvbmod.h"
 
 #ifndef MAX
@@ -40,12 +45,24 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // So we make the buffer hold 2048 TS packets (about 371KB)
 #define INPUT_BUFFER_SIZE_IN_PACKETS 2048
 
+// Defaults for sizing the ringbuffers, all overridable in the config file.
+// Each service's input ringbuffer holds buffer_ms of data at max_bitrate.
+#define DEFAULT_INPUT_MAX_BITRATE 20000000
+#define DEFAULT_INPUT_BUFFER_MS   3000
+// The output ringbuffer holds output_buffer_ms at the channel capacity, and
+// output starts once output_prefill_ms of data has been muxed.
+#define DEFAULT_OUTPUT_BUFFER_MS  4000
+#define DEFAULT_OUTPUT_PREFILL_MS 2500
+
 struct section_t
 {
   int length;
   int bytes_read;
   uint8_t buf[4096];
   int cc;
+  uint8_t* packets;  /* Output sections - pre-built TS packets, see packetise_section() */
+  int npackets;
+  int pid;
 };
 
 struct hbbtv_t
@@ -56,8 +73,37 @@ struct hbbtv_t
   int AIT_version_number;
 };
 
+/* Per-service tables, allocated separately from service_t (see
+   service_alloc() in dvb2dvb.c) */
+struct service_sections_t
+{
+  struct section_t pmt;
+  struct section_t sdt;
+  struct section_t eit;
+  struct section_t next_pmt;
+  struct section_t next_sdt;
+  struct section_t next_eit;
+  struct section_t ait;
+  struct section_t new_pmt;
+};
+
+/* The mux thread's per-packet state comes first, so it shares a cache
+   line or two.  The large tables - PID map, CC counters, section
+   buffers and per-PID error counts - are separate allocations, and the
+   fields the ingest thread writes start on their own cache line. */
 struct service_t
 {
+  /* Mux thread, for every packet output */
+  int packets_in_buf;
+  int packets_written;
+  uint64_t packets_out;       /* Packets muxed */
+  uint8_t* buf;               /* INPUT_BUFFER_SIZE_IN_PACKETS packets, up to the next PCR */
+  int64_t* bitpos;            /* ... and the output position of each */
+  int64_t start_pcr;
+  int64_t first_pcr;
+  int64_t second_pcr;
+  int pcr_pid;
+
   int id;
   int status; /* 0 = not started, 1 = streaming */
   char *url;
@@ -70,44 +116,69 @@ struct service_t
   int new_service_id;
   int lcn;
   int pmt_pid;
-  int pcr_pid;
+  int pmt_version;           /* Version of the input PMT we are using */
   int new_pmt_pid;           /* First PID used (for PMT) in output stream */
   int ait_pid;
-  uint16_t pid_map[8192];
-  int64_t start_pcr;
-  int64_t first_pcr;
-  int64_t second_pcr;
-  int packets_in_buf;
-  int packets_written;
-  uint8_t my_cc[8192];
-  uint8_t buf[INPUT_BUFFER_SIZE_IN_PACKETS*188];
-  int64_t bitpos[INPUT_BUFFER_SIZE_IN_PACKETS];
-
-  uint8_t curl_cc[8192];
-  uint8_t curl_buf[188];
-  int curl_bytes;
-
-  struct section_t pmt;
-  struct section_t sdt;
-  struct section_t eit;
-  struct section_t next_pmt;
-  struct section_t next_sdt;
-  struct section_t next_eit;
+  int max_bitrate;           /* Expected peak input bitrate in bits/s, 0 for default */
+  int buffer_ms;             /* Input jitter budget in ms, 0 for default */
+  uint16_t* pid_map;         /* 8192 entries, 0 for PIDs not output */
+  uint8_t* my_cc;            /* 8192 entries */
+
+  struct section_t* pmt;     /* All in one struct service_sections_t */
+  struct section_t* sdt;
+  struct section_t* eit;
+  struct section_t* next_pmt;
+  struct section_t* next_sdt;
+  struct section_t* next_eit;
+  struct section_t* ait;
+  struct section_t* new_pmt;
 
   struct hbbtv_t hbbtv;
-  struct section_t ait;
 
-  struct section_t new_pmt;
+  int64_t pcr_delta;          /* Ticks between the last two PCRs */
+  int64_t pcr_delta_max;      /* ... and the most seen */
 
-  /* Curl-related fields */
-  pthread_t curl_threadid;
+  struct ts_errors_t* errors;         /* Input errors found by the mux thread */
+  struct ts_errors_t* ingest_errors;  /* ... and by the ingest thread */
+  struct ts_errors_report_t errors_report;
 
-  struct ringbuffer_t inbuf;  /* Input ringbuffer for curl requests */
+  /* Curl-related fields */
+  void* curl __attribute__((aligned(64)));  /* Easy handle, owned by the ingest thread */
+  int native_http;                  /* Use the built-in HTTP client instead of curl */
+  struct service_t* ingest_next;    /* Ingest engine's list of services to add */
+
+  struct tssync_t sync;       /* Input alignment, owned by the ingest thread */
+  /* Input counters - written by the ingest thread, read by the mux thread */
+  _Atomic uint64_t packets_in;        /* Input packets */
+  _Atomic uint64_t packets_filtered;  /* ... and how many of them pid_filter dropped */
+  _Atomic uint64_t bytes_in;          /* Bytes received */
+
+  /* PIDs the mux thread wants from this input, one bit per PID.  NULL
+     lets everything through (until the PMT has been read).  Updated by
+     publishing the other copy of pid_filter_buf, once the ingest thread
+     has acknowledged the current one in pid_filter_ack. */
+  uint64_t* _Atomic pid_filter;
+  uint64_t* _Atomic pid_filter_ack;  /* Filter the ingest thread has moved to */
+  int pid_filter_pending;            /* Mux thread - an update is waiting for the ack */
+  uint64_t pid_filter_buf[2][8192/64];
+
+  struct ringbuffer_t inbuf;  /* Input ringbuffer for the ingest thread */
+
+  struct lat_service_t trace;  /* Latency tracing through the service */
 };
 
+struct output_t;
+struct ingest_t;
+struct tr101290_t;
+struct stats_t;
+
 struct mux_t
 {
-  char* device;
+  int id;
+  char* device;              /* Modulator device, or output file/address */
+  struct output_t* output;   /* Output backend */
+  void* output_priv;         /* Backend state */
+  int bitrate;               /* Output bitrate, 0 to calculate from dvbmod_params */
   struct dvb_modulator_parameters dvbmod_params;
   int gain;
   int tsid;
@@ -121,6 +192,30 @@ struct mux_t
   int nit_freq_in_bits;
   int ait_freq_in_bits;
 
+  int output_buffer_ms;  /* 0 for default */
+  int output_prefill_ms; /* 0 for default */
+  int hugepages;         /* Back the output ringbuffer with huge pages */
+  int ingest_threads;    /* Input event loop threads, 0 for default */
+  int ingest_buffer_size;  /* curl receive buffer per service, 0 for default */
+  int io_uring_depth;    /* Writes kept in flight by the io_uring writer, 0 for blocking write() */
+  int io_uring_chunk;    /* Bytes per io_uring write, 0 for default */
+  int ttl;               /* IP outputs - multicast TTL, 0 for default */
+  char* multicast_if;    /* IP outputs - interface name for multicast, NULL for routing table */
+  int udp_batch;         /* IP outputs - datagrams per sendmmsg(), 0 for default */
+  int txtime_lookahead_us;  /* Kernel-paced IP outputs - 0 for default */
+  char* txtime_clock;       /* Kernel-paced IP outputs - "monotonic" (fq) or "tai" (etf) */
+  int measure_send_times;   /* IP outputs - report kernel send time vs ideal */
+  char* send_time_log;      /* IP outputs - per-datagram send times as CSV */
+  int tr101290;             /* Run the TR 101 290 analyser on the output */
+  char* stats_shm;          /* Shared memory name for the stats page, NULL for none */
+  int stats_port;           /* Serve Prometheus stats on this localhost port, 0 for none */
+  int latency_trace;        /* Trace sampled packets from input to output */
+  char* cpus;               /* CPU list for all the mux's threads, e.g. "2-3", NULL for any */
+  struct thread_sched_t mux_sched;     /* Real-time scheduling for the mux thread, */
+  struct thread_sched_t output_sched;  /* ... the output thread */
+  struct thread_sched_t ingest_sched;  /* ... and the ingest threads */
+  int mlockall;             /* Lock all memory, for every mux */
+
   struct section_t pat;
   struct section_t sdt;
   struct section_t nit;
@@ -130,6 +225,11 @@ struct mux_t
 
   pthread_t threadid;  /* Mux processing thread id */
   pthread_t output_threadid;  /* Output thread id */
+  _Atomic int output_stopped; /* Set when the output thread has given up */
+  struct ingest_t* ingest;    /* Input event loop(s) */
+  struct tr101290_t* analyser;  /* Output analyser, NULL if disabled */
+  struct stats_t* stats;        /* Live statistics, NULL if disabled */
+  struct latency_t* latency;    /* Latency histograms, NULL if disabled */
 
   struct ringbuffer_t outbuf;  /* Output ringbuffer to write to modulator */
 };
@@ -0,0 +1,419 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <curl/curl.h>
+
+#include "dvb2dvb.h"
+#include "ingest.h"
+
+/* The ingest engine - all service inputs are driven by a small number
+   of event loop threads, instead of one thread per service.
+
+   Each thread runs a curl multi handle in its socket-action mode:
+   curl tells us which sockets to watch (added to an epoll set) and when
+   it next needs a timeout (a timerfd in the same set).  Services using
+   the built-in HTTP client (ingest_http.c) put their sockets in the
+   same epoll set.  New services
+   are handed to a thread through a locked list, and an eventfd wakes
+   it up to add them.  Services are shared round-robin between the
+   threads.
+*/
+
+#define INGEST_MAX_EVENTS 64
+
+struct ingest_thread_t
+{
+  pthread_t threadid;
+  struct thread_sched_t* sched;
+  char name[64];
+  CURLM* multi;
+  int epfd;
+  int evfd;      /* Signalled when services are added to pending */
+  int tfd;       /* curl's timeout */
+  struct ingest_source_t wakeup_src;
+  struct ingest_source_t timer_src;
+  int buffer_size;
+
+  pthread_mutex_t lock;
+  struct service_t* pending;
+};
+
+struct ingest_t
+{
+  int nthreads;
+  int next;
+  struct ingest_thread_t* threads;
+};
+
+/* The ingest thread is the only writer of its service's counters */
+static void ingest_count(_Atomic uint64_t* counter, uint64_t n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* Remove packets on PIDs the mux thread doesn't use from the count
+   aligned bytes at p, moving the pending bytes after them down too.
+   Returns the number of bytes left. */
+static int ingest_filter(struct service_t* sv, uint64_t* filter, uint8_t* p, int count)
+{
+  uint8_t* w = p;
+  int i;
+
+  for (i = 0; i < count; i += 188) {
+    int pid = (((p[i+1] & 0x1f) << 8) | p[i+2]);
+    if (filter[pid >> 6] & (1ULL << (pid & 63))) {
+      if (w != p + i)
+        memcpy(w, p + i, 188);
+      w += 188;
+    }
+  }
+
+  ingest_count(&sv->packets_in, count / 188);
+  if (w != p + count) {
+    ingest_count(&sv->packets_filtered, (p + count - w) / 188);
+    memmove(w, p + count, sv->sync.pending);
+  }
+
+  return w - p;
+}
+
+/* Publish a new PID filter (a bitmap of 8192 bits) for a service.  The
+   ingest thread picks up the whole new bitmap at once, from its next
+   chunk.  Called from the mux thread.  The other copy may only be
+   overwritten once the ingest thread has acknowledged the current one
+   (it is then finished with the other) - returns -1 if it has not yet,
+   and the caller should try again later. */
+int ingest_set_pid_filter(struct service_t* sv, uint64_t* pids)
+{
+  uint64_t* curr = atomic_load_explicit(&sv->pid_filter, memory_order_relaxed);
+  uint64_t* next = (curr == sv->pid_filter_buf[0]) ? sv->pid_filter_buf[1] : sv->pid_filter_buf[0];
+
+  if (curr && (atomic_load_explicit(&sv->pid_filter_ack, memory_order_acquire) != curr))
+    return -1;
+
+  memcpy(next, pids, sizeof(sv->pid_filter_buf[0]));
+  atomic_store_explicit(&sv->pid_filter, next, memory_order_release);
+  return 0;
+}
+
+/* n new bytes have been written at p + sv->sync.pending, where p is the
+   input ringbuffer's write pointer.  Realign them, filter out unwanted
+   PIDs and commit whole packets. */
+void ingest_commit(struct service_t* sv, uint8_t* p, int n)
+{
+  uint64_t resyncs = sv->sync.resyncs;
+  ingest_count(&sv->bytes_in, n);
+  int count = tssync_process(&sv->sync, p, n);
+  uint64_t* filter = atomic_load_explicit(&sv->pid_filter, memory_order_acquire);
+
+  /* Done with any older filter - let the mux thread reuse it */
+  if (filter != atomic_load_explicit(&sv->pid_filter_ack, memory_order_relaxed))
+    atomic_store_explicit(&sv->pid_filter_ack, filter, memory_order_release);
+
+  while (resyncs++ < sv->sync.resyncs)
+    ts_error(sv->ingest_errors, TSERR_SYNC, -1);
+
+  if (count && filter)
+    count = ingest_filter(sv, filter, p, count);
+
+  if (count) {
+    if (sv->trace.enabled)
+      latency_ingest(&sv->trace, count);
+    rb_commit(&sv->inbuf, count);
+
+    /* Confirm there are bytes in the buffer */
+    sv->status = 1;
+  }
+}
+
+static size_t
+ingest_callback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+  struct service_t* sv = userp;
+  int count = size*nmemb;
+
+  /* Copied straight into the ringbuffer - ingest_commit() realigns it */
+  int n = MIN(count, rb_get_bytes_free(&sv->inbuf) - sv->sync.pending);
+
+  if (n < count) {
+    fprintf(stderr,"\nERROR: Stream %d, Input buffer full, dropping %d bytes\n",sv->id,(count)-n);
+  }
+
+  if (n > 0) {
+    uint8_t* buf = rb_reserve(&sv->inbuf, sv->sync.pending + n);
+    memcpy(buf + sv->sync.pending, contents, n);
+    ingest_commit(sv, buf, n);
+  }
+
+  return count; /* Pretend we've consumed all */
+}
+
+/* CURLMOPT_SOCKETFUNCTION - keep the epoll set in step with what curl
+   wants to watch.  socketp is the socket's ingest_source_t once it is
+   in the set. */
+static int ingest_socket_cb(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
+{
+  struct ingest_thread_t* t = userp;
+  struct ingest_source_t* src = socketp;
+  struct epoll_event ev;
+  (void)easy;
+
+  if (what == CURL_POLL_REMOVE) {
+    if (src) {
+      epoll_ctl(t->epfd, EPOLL_CTL_DEL, s, NULL);
+      curl_multi_assign(t->multi, s, NULL);
+      free(src);
+    }
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+
+  if (src) {
+    ev.data.ptr = src;
+    epoll_ctl(t->epfd, EPOLL_CTL_MOD, s, &ev);
+  } else {
+    src = malloc(sizeof(struct ingest_source_t));
+    if (src == NULL) {
+      fprintf(stderr,"Could not allocate ingest source for socket %d\n",(int)s);
+      return -1;  /* curl fails the transfer */
+    }
+    src->type = INGEST_SRC_CURL;
+    src->fd = s;
+    ev.data.ptr = src;
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, s, &ev);
+    curl_multi_assign(t->multi, s, src);
+  }
+  return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION - -1 cancels the timeout, 0 means "now" */
+static int ingest_timer_cb(CURLM* multi, long timeout_ms, void* userp)
+{
+  struct ingest_thread_t* t = userp;
+  struct itimerspec its;
+  (void)multi;
+
+  memset(&its, 0, sizeof(its));
+  if (timeout_ms > 0) {
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  } else if (timeout_ms == 0) {
+    its.it_value.tv_nsec = 1;
+  }
+  timerfd_settime(t->tfd, 0, &its, NULL);
+  return 0;
+}
+
+static void ingest_add_pending(struct ingest_thread_t* t)
+{
+  struct service_t* sv;
+  uint64_t val;
+
+  if (read(t->evfd, &val, sizeof(val)) < 0)
+    return;
+
+  pthread_mutex_lock(&t->lock);
+  sv = t->pending;
+  t->pending = NULL;
+  pthread_mutex_unlock(&t->lock);
+
+  while (sv) {
+    if (sv->native_http) {
+      if (http_url_supported(sv->url)) {
+        http_conn_start(sv, t->epfd);
+        sv = sv->ingest_next;
+        continue;
+      }
+      fprintf(stderr,"WARNING: Stream %d, built-in HTTP client only supports http:// - using curl\n",sv->id);
+    }
+
+    CURL* curl = curl_easy_init();
+
+    curl_easy_setopt(curl, CURLOPT_URL, sv->url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, ingest_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)sv);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)sv);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "dvb2dvb/git-master");
+    curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, (long)t->buffer_size);
+    curl_multi_add_handle(t->multi, curl);
+
+    sv->curl = curl;
+    sv = sv->ingest_next;
+  }
+}
+
+/* Clean up finished transfers.  Like the old per-service threads, a
+   stream that ends is not restarted. */
+static void ingest_check_done(struct ingest_thread_t* t)
+{
+  CURLMsg* msg;
+  int left;
+
+  while ((msg = curl_multi_info_read(t->multi, &left))) {
+    if (msg->msg == CURLMSG_DONE) {
+      struct service_t* sv;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&sv);
+      fprintf(stderr,"\nStream %d (%s) ended: %s\n",sv->id,sv->url,curl_easy_strerror(msg->data.result));
+      curl_multi_remove_handle(t->multi, msg->easy_handle);
+      curl_easy_cleanup(msg->easy_handle);
+      sv->curl = NULL;
+    }
+  }
+}
+
+static void *ingest_thread(void* userp)
+{
+  struct ingest_thread_t* t = userp;
+  struct epoll_event events[INGEST_MAX_EVENTS];
+  int running;
+  int i, n;
+
+  rt_apply(t->name, t->sched);
+
+  while (1) {
+    n = epoll_wait(t->epfd, events, INGEST_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      struct ingest_source_t* src = events[i].data.ptr;
+      uint64_t val;
+      int flags;
+
+      switch (src->type) {
+        case INGEST_SRC_WAKEUP:
+          ingest_add_pending(t);
+          break;
+
+        case INGEST_SRC_TIMER:
+          if (read(t->tfd, &val, sizeof(val)) > 0)
+            curl_multi_socket_action(t->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+          break;
+
+        case INGEST_SRC_CURL:
+          flags = ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+                  ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                  ((events[i].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+          curl_multi_socket_action(t->multi, src->fd, flags, &running);
+          break;
+
+        case INGEST_SRC_HTTP:
+          http_conn_event((struct http_conn_t*)src, events[i].events);
+          break;
+      }
+    }
+
+    ingest_check_done(t);
+  }
+
+  return NULL;
+}
+
+struct ingest_t* ingest_create(int nthreads, int buffer_size, struct thread_sched_t* sched, const char* name)
+{
+  struct ingest_t* ig = calloc(1, sizeof(struct ingest_t));
+  struct epoll_event ev;
+  int i;
+
+  ig->nthreads = nthreads ? nthreads : DEFAULT_INGEST_THREADS;
+  ig->threads = calloc(ig->nthreads, sizeof(struct ingest_thread_t));
+
+  for (i = 0; i < ig->nthreads; i++) {
+    struct ingest_thread_t* t = &ig->threads[i];
+
+    t->buffer_size = buffer_size ? buffer_size : DEFAULT_INGEST_BUFFER_SIZE;
+    t->sched = sched;
+    snprintf(t->name, sizeof(t->name), "%s ingest thread %d", name, i);
+    pthread_mutex_init(&t->lock, NULL);
+
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    t->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    t->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if ((t->epfd < 0) || (t->evfd < 0) || (t->tfd < 0)) {
+      perror("Could not create ingest thread");
+      return NULL;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    t->wakeup_src.type = INGEST_SRC_WAKEUP;
+    t->wakeup_src.fd = t->evfd;
+    ev.data.ptr = &t->wakeup_src;
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->evfd, &ev);
+    t->timer_src.type = INGEST_SRC_TIMER;
+    t->timer_src.fd = t->tfd;
+    ev.data.ptr = &t->timer_src;
+    epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->tfd, &ev);
+
+    t->multi = curl_multi_init();
+    curl_multi_setopt(t->multi, CURLMOPT_SOCKETFUNCTION, ingest_socket_cb);
+    curl_multi_setopt(t->multi, CURLMOPT_SOCKETDATA, t);
+    curl_multi_setopt(t->multi, CURLMOPT_TIMERFUNCTION, ingest_timer_cb);
+    curl_multi_setopt(t->multi, CURLMOPT_TIMERDATA, t);
+
+    int error = pthread_create(&t->threadid, NULL, ingest_thread, (void *)t);
+    if (error) {
+      fprintf(stderr,"Couldn't create ingest thread %d, errno %d\n",i,error);
+      return NULL;
+    }
+  }
+
+  fprintf(stderr,"Created %d ingest thread%s\n",ig->nthreads,ig->nthreads == 1 ? "" : "s");
+  return ig;
+}
+
+/* Start fetching a service.  Called from the mux thread. */
+int ingest_add_service(struct ingest_t* ig, struct service_t* sv)
+{
+  struct ingest_thread_t* t = &ig->threads[ig->next];
+  uint64_t one = 1;
+
+  ig->next = (ig->next + 1) % ig->nthreads;
+
+  pthread_mutex_lock(&t->lock);
+  sv->ingest_next = t->pending;
+  t->pending = sv;
+  pthread_mutex_unlock(&t->lock);
+
+  if (write(t->evfd, &one, sizeof(one)) < 0) {
+    perror("Could not wake ingest thread");
+    return -1;
+  }
+
+  return 0;
+}
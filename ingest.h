@@ -0,0 +1,59 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#ifndef _INGEST_H
+#define _INGEST_H
+
+#include "dvb2dvb.h"
+
+#define DEFAULT_INGEST_THREADS 1
+#define DEFAULT_INGEST_BUFFER_SIZE (256*1024)   /* CURLOPT_BUFFERSIZE */
+#define INGEST_WAKE_LEVEL (188*128)             /* Input level that wakes a waiting mux thread */
+
+struct ingest_t;
+
+/* Everything in an ingest thread's epoll set starts with one of these,
+   so events can be dispatched by type */
+struct ingest_source_t
+{
+  int type;
+  int fd;
+};
+
+#define INGEST_SRC_WAKEUP 0
+#define INGEST_SRC_TIMER  1
+#define INGEST_SRC_CURL   2
+#define INGEST_SRC_HTTP   3
+
+struct ingest_t* ingest_create(int nthreads, int buffer_size, struct thread_sched_t* sched, const char* name);
+int ingest_add_service(struct ingest_t* ig, struct service_t* sv);
+void ingest_commit(struct service_t* sv, uint8_t* p, int n);
+int ingest_set_pid_filter(struct service_t* sv, uint64_t* pids);
+
+/* ingest_http.c - the built-in HTTP/1.1 client */
+struct http_conn_t;
+
+int http_url_supported(char* url);
+struct http_conn_t* http_conn_start(struct service_t* sv, int epfd);
+int http_conn_event(struct http_conn_t* c, uint32_t events);
+
+#endif
@@ -0,0 +1,634 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include "dvb2dvb.h"
+#include "ingest.h"
+
+/* A minimal HTTP/1.1 client for plain http:// inputs, driven by the
+   ingest thread's epoll loop.
+
+   The response body is recv()ed straight into the free space at the
+   tail of the service's input ringbuffer.  Chunked transfer encoding
+   is removed in place, and the data is aligned to sync in place
+   (tssync.c) before it is committed - so there is no intermediate
+   buffer and no extra copy.
+
+   Received bytes that can't be committed yet (partial packets, or
+   while looking for sync) stay at the ringbuffer's write pointer, and
+   the next recv() appends to them.
+
+   Host names are looked up by a short-lived thread, which wakes the
+   event loop through a pipe, so a slow DNS server only holds up its
+   own stream.  Each address returned is tried in turn.
+
+   Redirects (301, 302, 303, 307, 308) are followed, up to
+   HTTP_MAX_REDIRECTS.  Like the curl inputs, a stream that ends or
+   fails is not restarted.
+*/
+
+#define HTTP_MAX_REDIRECTS 5
+#define HTTP_HEADER_MAX 8192
+#define HTTP_RECV_MAX (256*1024)
+
+#define HTTP_RESOLVING  0
+#define HTTP_CONNECTING 1
+#define HTTP_SENDING    2
+#define HTTP_HEADERS    3
+#define HTTP_BODY       4
+
+#define CHUNK_SIZE      0   /* Reading the hex chunk size */
+#define CHUNK_EXT       1   /* Skipping to the end of the size line */
+#define CHUNK_DATA      2
+#define CHUNK_DATA_END  3   /* Skipping the CRLF after the data */
+#define CHUNK_DONE      4   /* Zero-length chunk seen */
+
+struct http_conn_t
+{
+  struct ingest_source_t src;   /* Must be first */
+  struct service_t* sv;
+  int epfd;
+  int state;
+  int redirects;
+
+  char* url;
+  char host[256];
+  char port[8];
+  char* path;
+
+  struct addrinfo* ai;          /* Set by the resolver thread */
+  struct addrinfo* next_ai;     /* Next address to try */
+  int gai_err;
+  int resolve_fd;               /* Resolver thread's end of the pipe */
+
+  char request[2048];
+  int request_len;
+  int request_sent;
+
+  char headers[HTTP_HEADER_MAX];
+  int headers_len;
+
+  int chunked;
+  int chunk_state;
+  uint64_t chunk_left;
+};
+
+int http_url_supported(char* url)
+{
+  return (strncasecmp(url, "http://", 7) == 0);
+}
+
+/* Split an http:// URL into c->host, c->port and c->path */
+static int http_parse_url(struct http_conn_t* c)
+{
+  char* p;
+  char* host_end;
+  int len;
+
+  if (!http_url_supported(c->url))
+    return -1;
+
+  /* Make sure there is a path, so it always points into c->url */
+  if (strchr(c->url + 7, '/') == NULL) {
+    len = strlen(c->url);
+    c->url = realloc(c->url, len + 2);
+    strcpy(c->url + len, "/");
+  }
+
+  p = c->url + 7;
+  c->path = strchr(p, '/');
+  host_end = c->path;
+
+  strcpy(c->port, "80");
+  if (*p == '[') {
+    /* [IPv6]:port */
+    char* close_bracket = memchr(p, ']', host_end - p);
+    if (close_bracket == NULL)
+      return -1;
+    len = close_bracket - p - 1;
+    if ((len <= 0) || (len >= (int)sizeof(c->host)))
+      return -1;
+    memcpy(c->host, p + 1, len);
+    c->host[len] = 0;
+    p = close_bracket + 1;
+  } else {
+    char* colon = memchr(p, ':', host_end - p);
+    char* end = colon ? colon : host_end;
+    len = end - p;
+    if ((len <= 0) || (len >= (int)sizeof(c->host)))
+      return -1;
+    memcpy(c->host, p, len);
+    c->host[len] = 0;
+    p = end;
+  }
+
+  if (*p == ':') {
+    len = host_end - p - 1;
+    if ((len <= 0) || (len >= (int)sizeof(c->port)))
+      return -1;
+    memcpy(c->port, p + 1, len);
+    c->port[len] = 0;
+  }
+
+  return 0;
+}
+
+static void http_close_socket(struct http_conn_t* c)
+{
+  if (c->src.fd >= 0) {
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->src.fd, NULL);
+    close(c->src.fd);
+    c->src.fd = -1;
+  }
+}
+
+static void http_free_addresses(struct http_conn_t* c)
+{
+  if (c->ai) {
+    freeaddrinfo(c->ai);
+    c->ai = NULL;
+  }
+  c->next_ai = NULL;
+}
+
+static void http_free(struct http_conn_t* c, char* reason)
+{
+  fprintf(stderr,"\nStream %d (%s) ended: %s\n",c->sv->id,c->url,reason);
+  http_close_socket(c);
+  http_free_addresses(c);
+  free(c->url);
+  free(c);
+}
+
+static int http_watch(struct http_conn_t* c, uint32_t events)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = c;
+  return epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->src.fd, &ev);
+}
+
+/* Runs getaddrinfo() away from the event loop, then wakes the loop.  c
+   is left alone once the pipe has been written to. */
+static void* http_resolve_thread(void* userp)
+{
+  struct http_conn_t* c = userp;
+  struct addrinfo hints;
+  int fd = c->resolve_fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  c->gai_err = getaddrinfo(c->host, c->port, &hints, &c->ai);
+
+  while ((write(fd, "", 1) < 0) && (errno == EINTR));
+  close(fd);
+  return NULL;
+}
+
+/* Start connecting to the next address that gets as far as connect() */
+static int http_try_connect(struct http_conn_t* c)
+{
+  while (c->next_ai) {
+    struct addrinfo* ai = c->next_ai;
+    c->next_ai = ai->ai_next;
+
+    c->src.fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->src.fd < 0)
+      continue;
+    if ((connect(c->src.fd, ai->ai_addr, ai->ai_addrlen) == 0) || (errno == EINPROGRESS)) {
+      c->state = HTTP_CONNECTING;
+      return http_watch(c, EPOLLOUT);
+    }
+    fprintf(stderr,"Could not connect to %s: %s\n",c->url,strerror(errno));
+    close(c->src.fd);
+    c->src.fd = -1;
+  }
+
+  return -1;
+}
+
+/* The resolver thread has finished */
+static int http_resolved(struct http_conn_t* c)
+{
+  char byte;
+
+  while ((read(c->src.fd, &byte, 1) < 0) && (errno == EINTR));
+  http_close_socket(c);
+
+  if (c->gai_err) {
+    fprintf(stderr,"Could not resolve %s: %s\n",c->host,gai_strerror(c->gai_err));
+    c->ai = NULL;
+    return -1;
+  }
+  c->next_ai = c->ai;
+  return http_try_connect(c);
+}
+
+static int http_connect(struct http_conn_t* c)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  int fds[2];
+  int error;
+
+  if (http_parse_url(c) < 0) {
+    fprintf(stderr,"Invalid URL %s\n",c->url);
+    return -1;
+  }
+
+  if (strcmp(c->port, "80"))
+    c->request_len = snprintf(c->request, sizeof(c->request),
+                              "GET %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: dvb2dvb/git-master\r\nAccept: */*\r\nConnection: close\r\n\r\n",
+                              c->path, c->host, c->port);
+  else
+    c->request_len = snprintf(c->request, sizeof(c->request),
+                              "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: dvb2dvb/git-master\r\nAccept: */*\r\nConnection: close\r\n\r\n",
+                              c->path, c->host);
+  if (c->request_len >= (int)sizeof(c->request))
+    return -1;
+
+  c->request_sent = 0;
+  c->headers_len = 0;
+  c->chunked = 0;
+  c->chunk_state = CHUNK_SIZE;
+  c->chunk_left = 0;
+  c->state = HTTP_RESOLVING;
+
+  http_free_addresses(c);
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    return -1;
+  c->src.fd = fds[0];
+  c->resolve_fd = fds[1];
+  if (http_watch(c, EPOLLIN) < 0) {
+    close(fds[1]);
+    return -1;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  error = pthread_create(&thread, &attr, http_resolve_thread, (void *)c);
+  pthread_attr_destroy(&attr);
+  if (error) {
+    fprintf(stderr,"Couldn't create resolver thread for %s, errno %d\n",c->url,error);
+    close(fds[1]);
+    return -1;
+  }
+
+  return 0;
+}
+
+struct http_conn_t* http_conn_start(struct service_t* sv, int epfd)
+{
+  struct http_conn_t* c = calloc(1, sizeof(struct http_conn_t));
+
+  c->src.type = INGEST_SRC_HTTP;
+  c->src.fd = -1;
+  c->sv = sv;
+  c->epfd = epfd;
+  c->url = strdup(sv->url);
+
+  if (http_connect(c) < 0) {
+    http_free(c, "connection failed");
+    return NULL;
+  }
+
+  return c;
+}
+
+static int hexval(int ch)
+{
+  if ((ch >= '0') && (ch <= '9')) return ch - '0';
+  if ((ch >= 'a') && (ch <= 'f')) return ch - 'a' + 10;
+  if ((ch >= 'A') && (ch <= 'F')) return ch - 'A' + 10;
+  return -1;
+}
+
+/* Remove chunked framing from n bytes at buf, in place.  Returns the
+   number of payload bytes left at buf, or -1 on a framing error. */
+static int http_dechunk(struct http_conn_t* c, uint8_t* buf, int n)
+{
+  uint8_t* r = buf;
+  uint8_t* w = buf;
+  uint8_t* end = buf + n;
+
+  while (r < end) {
+    switch (c->chunk_state) {
+      case CHUNK_DATA: {
+        int count = MIN((uint64_t)(end - r), c->chunk_left);
+        if (w != r)
+          memmove(w, r, count);
+        w += count;
+        r += count;
+        c->chunk_left -= count;
+        if (c->chunk_left == 0)
+          c->chunk_state = CHUNK_DATA_END;
+        break;
+      }
+
+      case CHUNK_SIZE: {
+        int d = hexval(*r);
+        if (d >= 0) {
+          if (c->chunk_left >> 56)
+            return -1;
+          c->chunk_left = c->chunk_left * 16 + d;
+          r++;
+        } else {
+          c->chunk_state = CHUNK_EXT;
+        }
+        break;
+      }
+
+      case CHUNK_EXT:
+        if (*r++ == '\n')
+          c->chunk_state = c->chunk_left ? CHUNK_DATA : CHUNK_DONE;
+        break;
+
+      case CHUNK_DATA_END:
+        if (*r++ == '\n')
+          c->chunk_state = CHUNK_SIZE;
+        break;
+
+      case CHUNK_DONE:
+        /* Trailers - ignored */
+        r = end;
+        break;
+    }
+  }
+
+  return w - buf;
+}
+
+/* n new body bytes have arrived at p + sv->sync.pending (p is the
+   ringbuffer's write pointer).  Decode them, then align and commit. */
+static int http_body(struct http_conn_t* c, uint8_t* p, int n)
+{
+  if (c->chunked) {
+    n = http_dechunk(c, p + c->sv->sync.pending, n);
+    if (n < 0)
+      return -1;
+  }
+
+  ingest_commit(c->sv, p, n);
+  return 0;
+}
+
+/* Copy body bytes that arrived with the headers into the ringbuffer */
+static int http_body_copy(struct http_conn_t* c, uint8_t* data, int n)
+{
+  uint8_t* p = rb_reserve(&c->sv->inbuf, c->sv->sync.pending + n);
+
+  if (p == NULL) {
+    /* Input buffer full - drop data */
+    fprintf(stderr,"\nERROR: Stream %d, Input buffer full, dropping %d bytes\n",c->sv->id,n);
+    return 0;
+  }
+  memcpy(p + c->sv->sync.pending, data, n);
+  return http_body(c, p, n);
+}
+
+/* Parse the response headers.  Returns 1 to start reading the body, 0
+   if a redirect was followed, -1 on error. */
+static int http_response(struct http_conn_t* c, char* body, int body_len)
+{
+  char* line = c->headers;
+  char* location = NULL;
+  int status;
+
+  if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+    fprintf(stderr,"Invalid HTTP response from %s\n",c->url);
+    return -1;
+  }
+
+  while ((line = strstr(line, "\r\n")) != NULL) {
+    line += 2;
+    if (*line == '\r')
+      break;
+    char* eol = strstr(line, "\r\n");
+    if (eol == NULL)
+      break;
+    *eol = 0;
+
+    if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+      if (strcasestr(line + 18, "chunked"))
+        c->chunked = 1;
+    } else if (!strncasecmp(line, "Location:", 9)) {
+      location = line + 9;
+      while (*location == ' ')
+        location++;
+    }
+
+    *eol = '\r';
+    line = eol;
+  }
+
+  if ((status == 301) || (status == 302) || (status == 303) || (status == 307) || (status == 308)) {
+    char* new_url;
+
+    if (location == NULL) {
+      fprintf(stderr,"Redirect without Location from %s\n",c->url);
+      return -1;
+    }
+    char* eol = strstr(location, "\r\n");
+    if (eol)
+      *eol = 0;
+
+    if (++c->redirects > HTTP_MAX_REDIRECTS) {
+      fprintf(stderr,"Too many redirects from %s\n",c->sv->url);
+      return -1;
+    }
+
+    if (strstr(location, "://")) {
+      if (!http_url_supported(location)) {
+        fprintf(stderr,"Redirected to %s - use the curl client for that\n",location);
+        return -1;
+      }
+      new_url = strdup(location);
+    } else {
+      /* Relative to the current server, or the current path */
+      int base = (c->path - c->url);
+      if (location[0] != '/') {
+        char* slash = strrchr(c->path, '/');
+        base = slash ? (slash + 1 - c->url) : base;
+      }
+      new_url = malloc(base + strlen(location) + 1);
+      memcpy(new_url, c->url, base);
+      strcpy(new_url + base, location);
+    }
+
+    fprintf(stderr,"Stream %d redirected to %s\n",c->sv->id,new_url);
+    http_close_socket(c);
+    free(c->url);
+    c->url = new_url;
+    return (http_connect(c) < 0) ? -1 : 0;
+  }
+
+  if (status != 200) {
+    fprintf(stderr,"HTTP error %d from %s\n",status,c->url);
+    return -1;
+  }
+
+  c->state = HTTP_BODY;
+  if (body_len)
+    return (http_body_copy(c, (uint8_t*)body, body_len) < 0) ? -1 : 1;
+  return 1;
+}
+
+static int http_read_headers(struct http_conn_t* c)
+{
+  int space = HTTP_HEADER_MAX - 1 - c->headers_len;
+  int n = recv(c->src.fd, c->headers + c->headers_len, space, 0);
+  char* end;
+
+  if (n < 0)
+    return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+  if (n == 0)
+    return -1;
+
+  c->headers_len += n;
+  c->headers[c->headers_len] = 0;
+
+  end = strstr(c->headers, "\r\n\r\n");
+  if (end == NULL)
+    return (c->headers_len == HTTP_HEADER_MAX - 1) ? -1 : 0;
+
+  end += 4;
+  return http_response(c, end, c->headers + c->headers_len - end);
+}
+
+static int http_read_body(struct http_conn_t* c)
+{
+  struct ringbuffer_t* rb = &c->sv->inbuf;
+  int space = rb_get_bytes_free(rb) - c->sv->sync.pending;
+  int n;
+
+  if (space <= 0) {
+    /* Input buffer full - drop data */
+    uint8_t tmp[16384];
+    n = recv(c->src.fd, tmp, sizeof(tmp), 0);
+    if (n > 0)
+      fprintf(stderr,"\nERROR: Stream %d, Input buffer full, dropping %d bytes\n",c->sv->id,n);
+  } else {
+    int want = MIN(space, HTTP_RECV_MAX);
+    uint8_t* p = rb_reserve(rb, c->sv->sync.pending + want);
+
+    n = recv(c->src.fd, p + c->sv->sync.pending, want, 0);
+    if (n > 0) {
+      if (http_body(c, p, n) < 0) {
+        fprintf(stderr,"Invalid chunked encoding from %s\n",c->url);
+        return -1;
+      }
+      if ((c->chunked) && (c->chunk_state == CHUNK_DONE))
+        return -1;
+    }
+  }
+
+  if (n < 0)
+    return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+  if (n == 0)
+    return -1;
+  return 0;
+}
+
+/* Handle an epoll event.  Returns -1 (and frees c) when the stream has
+   ended. */
+int http_conn_event(struct http_conn_t* c, uint32_t events)
+{
+  struct epoll_event ev;
+  int err = 0;
+  socklen_t len = sizeof(err);
+  int res;
+
+  switch (c->state) {
+    case HTTP_RESOLVING:
+      if (http_resolved(c) < 0) {
+        http_free(c, "connection failed");
+        return -1;
+      }
+      return 0;
+
+    case HTTP_CONNECTING:
+      if ((getsockopt(c->src.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err)) {
+        fprintf(stderr,"Could not connect to %s: %s\n",c->url,strerror(err));
+        http_close_socket(c);
+        if (http_try_connect(c) < 0) {
+          http_free(c, "connection failed");
+          return -1;
+        }
+        return 0;
+      }
+      http_free_addresses(c);
+      c->state = HTTP_SENDING;
+      /* Fall through */
+
+    case HTTP_SENDING:
+      res = send(c->src.fd, c->request + c->request_sent, c->request_len - c->request_sent, MSG_NOSIGNAL);
+      if (res < 0) {
+        if ((errno == EAGAIN) || (errno == EINTR))
+          return 0;
+        http_free(c, strerror(errno));
+        return -1;
+      }
+      c->request_sent += res;
+      if (c->request_sent == c->request_len) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->src.fd, &ev);
+        c->state = HTTP_HEADERS;
+      }
+      return 0;
+
+    case HTTP_HEADERS:
+      res = http_read_headers(c);
+      if (res < 0) {
+        http_free(c, "invalid response");
+        return -1;
+      }
+      return 0;
+
+    case HTTP_BODY:
+      if (http_read_body(c) < 0) {
+        http_free(c, (events & EPOLLERR) ? "connection error" : "end of stream");
+        return -1;
+      }
+      return 0;
+  }
+
+  return 0;
+}
@@ -0,0 +1,245 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+/* Sampled end-to-end latency tracing.
+
+   TS packets have no room for a timestamp, so traces are kept to one
+   side, keyed by stream position.  Every LAT_SAMPLE_MS the ingest
+   thread queues the input position and arrival time of the packets it
+   is committing.  The mux thread picks the sample up when it copies
+   that packet (or the next one it outputs) into sv->buf, and follows
+   it to the output ringbuffer, where it is queued again with its
+   output position for the output thread to time the device write.
+
+   Only one packet per service is traced through sv->buf at a time, and
+   samples are dropped rather than waited for if a queue is full, so
+   tracing costs a couple of comparisons per packet. */
+
+static char* names[LAT_STAGES] = { "ingest", "mux", "output", "total" };
+
+char* latency_stage_name(int stage)
+{
+  return names[stage];
+}
+
+static int64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int lat_bucket(uint64_t v)
+{
+  int shift;
+
+  if (v < LAT_SUB_BUCKETS)
+    return v;
+  if (v >= (1ULL << 40))
+    v = (1ULL << 40) - 1;
+
+  /* Leaves v >> shift in [LAT_SUB_BUCKETS/2, LAT_SUB_BUCKETS) */
+  shift = 63 - __builtin_clzll(v) - 6;
+  return shift * (LAT_SUB_BUCKETS / 2) + (v >> shift);
+}
+
+/* Middle of a bucket */
+static uint64_t lat_bucket_value(int i)
+{
+  int shift;
+
+  if (i < LAT_SUB_BUCKETS)
+    return i;
+  shift = i / (LAT_SUB_BUCKETS / 2) - 1;
+  return ((uint64_t)(i - shift * (LAT_SUB_BUCKETS / 2)) << shift) + (1ULL << (shift - 1));
+}
+
+/* Each histogram has a single writer */
+static void lat_add(_Atomic uint64_t* counter, uint64_t n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void lat_record(struct lat_hist_t* h, int64_t us)
+{
+  if (us < 0)
+    us = 0;
+  lat_add(&h->buckets[lat_bucket(us)], 1);
+  lat_add(&h->sum_us, us);
+  if ((uint64_t)us > atomic_load_explicit(&h->max_us, memory_order_relaxed))
+    atomic_store_explicit(&h->max_us, us, memory_order_relaxed);
+  atomic_store_explicit(&h->count, atomic_load_explicit(&h->count, memory_order_relaxed) + 1, memory_order_release);
+}
+
+uint64_t lat_hist_percentile(struct lat_hist_t* h, double p)
+{
+  uint64_t count = atomic_load_explicit(&h->count, memory_order_acquire);
+  uint64_t target = (uint64_t)(count * p / 100.0 + 0.5);
+  uint64_t seen = 0;
+  int i;
+
+  if (count == 0)
+    return 0;
+  if (target == 0)
+    target = 1;
+
+  uint64_t max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    if (seen >= target)
+      return (lat_bucket_value(i) < max) ? lat_bucket_value(i) : max;
+  }
+  return max;
+}
+
+static int lat_push(struct lat_queue_t* q, struct lat_sample_t* s)
+{
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&q->tail, memory_order_acquire) == LAT_QUEUE_SIZE)
+    return -1;
+  q->samples[head & (LAT_QUEUE_SIZE - 1)] = *s;
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return 0;
+}
+
+/* The oldest sample, or NULL if the queue is empty */
+static struct lat_sample_t* lat_front(struct lat_queue_t* q)
+{
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+  if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+    return NULL;
+  return &q->samples[tail & (LAT_QUEUE_SIZE - 1)];
+}
+
+static void lat_pop(struct lat_queue_t* q)
+{
+  atomic_store_explicit(&q->tail, atomic_load_explicit(&q->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+struct latency_t* latency_create(void)
+{
+  return calloc(1, sizeof(struct latency_t));
+}
+
+void latency_ingest(struct lat_service_t* t, int count)
+{
+  int64_t now = now_us();
+
+  if (now >= t->next_sample_us) {
+    struct lat_sample_t s = { t->write_pos, now, now };
+    lat_push(&t->queue, &s);
+    t->next_sample_us = now + LAT_SAMPLE_MS * 1000;
+  }
+  t->write_pos += count;
+}
+
+uint64_t latency_next(struct lat_service_t* t)
+{
+  struct lat_sample_t* s;
+
+  if ((!t->enabled) || (t->slot >= 0) || ((s = lat_front(&t->queue)) == NULL))
+    return UINT64_MAX;
+  return s->pos;
+}
+
+void latency_mux_in(struct latency_t* l, struct lat_service_t* t, uint64_t pos, int slot)
+{
+  struct lat_sample_t* s;
+  int64_t now = now_us();
+
+  /* Take the latest sample at or before pos - any earlier ones were on
+     packets that aren't output */
+  while ((s = lat_front(&t->queue)) && (s->pos <= pos)) {
+    t->sample = *s;
+    lat_pop(&t->queue);
+  }
+
+  lat_record(&l->hist[LAT_INGEST], now - t->sample.t_ingest);
+  t->sample.t_stage = now;
+  t->slot = slot;
+}
+
+void latency_mux_out(struct latency_t* l, struct lat_service_t* t, uint64_t out_pos)
+{
+  int64_t now = now_us();
+
+  lat_record(&l->hist[LAT_MUX], now - t->sample.t_stage);
+  t->sample.pos = out_pos;
+  t->sample.t_stage = now;
+  lat_push(&l->queue, &t->sample);
+  t->slot = -1;
+}
+
+void latency_output(struct latency_t* l, int count)
+{
+  struct lat_sample_t* s;
+  int64_t now;
+
+  l->out_pos += count;
+  if (((s = lat_front(&l->queue)) == NULL) || (s->pos >= l->out_pos))
+    return;
+
+  now = now_us();
+  do {
+    lat_record(&l->hist[LAT_OUTPUT], now - s->t_stage);
+    lat_record(&l->hist[LAT_TOTAL], now - s->t_ingest);
+    lat_pop(&l->queue);
+  } while ((s = lat_front(&l->queue)) && (s->pos < l->out_pos));
+}
+
+/* Called by the mux thread, prints the percentiles so far at most once
+   every LAT_REPORT_INTERVAL_MS */
+void latency_report(struct latency_t* l)
+{
+  int64_t now_ms = now_us() / 1000;
+  char msg[512];
+  int len = 0;
+  int i;
+
+  if (now_ms - l->last_report_ms < LAT_REPORT_INTERVAL_MS)
+    return;
+  l->last_report_ms = now_ms;
+
+  for (i = 0; i < LAT_STAGES; i++) {
+    struct lat_hist_t* h = &l->hist[i];
+    if (atomic_load_explicit(&h->count, memory_order_acquire) == 0)
+      continue;
+    len += snprintf(msg + len, sizeof(msg) - len, "%s%s %.1f/%.1f/%.1fms",
+                    len ? ", " : "", names[i],
+                    lat_hist_percentile(h, 50) / 1000.0,
+                    lat_hist_percentile(h, 99) / 1000.0,
+                    atomic_load_explicit(&h->max_us, memory_order_relaxed) / 1000.0);
+  }
+
+  if (len)
+    fprintf(stderr,"\nLatency (p50/p99/max): %s\n",msg);
+}
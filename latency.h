@@ -0,0 +1,92 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Stages a traced packet is timed through */
+#define LAT_INGEST      0   /* Received -> read by the mux thread */
+#define LAT_MUX         1   /* Read by the mux thread -> output ringbuffer */
+#define LAT_OUTPUT      2   /* Output ringbuffer -> written to the device */
+#define LAT_TOTAL       3   /* Received -> written to the device */
+#define LAT_STAGES      4
+
+#define LAT_SAMPLE_MS        10     /* How often the ingest thread starts a trace */
+#define LAT_QUEUE_SIZE       1024   /* Traces in flight per queue (seconds of output buffering), a power of 2 */
+#define LAT_REPORT_INTERVAL_MS 10000
+
+/* Log-linear histogram of microseconds: values below LAT_SUB_BUCKETS
+   are exact, above that each power of 2 is split into
+   LAT_SUB_BUCKETS/2 buckets (so within 1.6%), up to 2^40us. */
+#define LAT_SUB_BUCKETS  128
+#define LAT_BUCKETS      ((40 - 6) * (LAT_SUB_BUCKETS / 2) + LAT_SUB_BUCKETS)
+
+struct lat_hist_t {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum_us;
+  _Atomic uint64_t max_us;
+  _Atomic uint64_t buckets[LAT_BUCKETS];
+};
+
+struct lat_sample_t {
+  uint64_t pos;        /* Stream position of the traced packet */
+  int64_t t_ingest;    /* Times in us */
+  int64_t t_stage;     /* Start of the current stage */
+};
+
+/* Single producer, single consumer */
+struct lat_queue_t {
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  struct lat_sample_t samples[LAT_QUEUE_SIZE];
+};
+
+/* Per service */
+struct lat_service_t {
+  int enabled;
+
+  /* Mux thread */
+  int slot;                /* Traced packet's index in sv->buf, -1 for none */
+  uint64_t read_pos;       /* Bytes consumed from the input ringbuffer */
+  struct lat_sample_t sample;
+
+  /* Ingest thread */
+  uint64_t write_pos __attribute__((aligned(64)));  /* Bytes committed to the input ringbuffer */
+  int64_t next_sample_us;
+  struct lat_queue_t queue;
+};
+
+/* Per mux */
+struct latency_t {
+  struct lat_hist_t hist[LAT_STAGES];
+  struct lat_queue_t queue;  /* Mux thread -> output thread */
+  uint64_t out_pos;          /* Output thread - bytes written */
+  int64_t last_report_ms;
+};
+
+struct latency_t* latency_create(void);
+
+/* Ingest thread - count bytes committed to the input ringbuffer */
+void latency_ingest(struct lat_service_t* t, int count);
+
+/* Mux thread - stream position of the next sample waiting to be picked
+   up, or UINT64_MAX */
+uint64_t latency_next(struct lat_service_t* t);
+
+/* Mux thread - the packet at pos has been copied to sv->buf[slot] */
+void latency_mux_in(struct latency_t* l, struct lat_service_t* t, uint64_t pos, int slot);
+
+/* Mux thread - the traced packet was written at out_pos in the output */
+void latency_mux_out(struct latency_t* l, struct lat_service_t* t, uint64_t out_pos);
+
+/* Output thread - count bytes written to the device */
+void latency_output(struct latency_t* l, int count);
+
+/* Value (in us) at percentile p (0-100) */
+uint64_t lat_hist_percentile(struct lat_hist_t* h, double p);
+
+void latency_report(struct latency_t* l);
+
+char* latency_stage_name(int stage);
+
+#endif
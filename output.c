@@ -0,0 +1,327 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "dvb2dvb.h"
+#include "output.h"
+#include "tr101290.h"
+
+void pacer_init(struct pacer_t* pacer, int bitrate)
+{
+  clock_gettime(CLOCK_MONOTONIC, &pacer->start);
+  pacer->bitrate = bitrate;
+}
+
+/* Time to send bytes at bitrate.  Whole seconds and the remainder are
+   done separately, so bits * 10^9 can't overflow on long runs. */
+uint64_t pacer_bytes_to_ns(uint64_t bytes, int bitrate)
+{
+  uint64_t bits = bytes * 8;
+
+  return (bits / bitrate) * 1000000000ULL + (bits % bitrate) * 1000000000ULL / bitrate;
+}
+
+/* When the given number of bytes is due to have been sent */
+static void pacer_deadline(struct pacer_t* pacer, uint64_t bytes, struct timespec* ts)
+{
+  uint64_t ns = pacer_bytes_to_ns(bytes, pacer->bitrate);
+
+  ts->tv_sec = pacer->start.tv_sec + ns / 1000000000;
+  ts->tv_nsec = pacer->start.tv_nsec + ns % 1000000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+void pacer_wait(struct pacer_t* pacer, uint64_t bytes)
+{
+  struct timespec ts;
+
+  pacer_deadline(pacer, bytes, &ts);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+int pacer_due(struct pacer_t* pacer, uint64_t bytes)
+{
+  struct timespec ts, now;
+
+  pacer_deadline(pacer, bytes, &ts);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec > ts.tv_sec) || ((now.tv_sec == ts.tv_sec) && (now.tv_nsec >= ts.tv_nsec)));
+}
+
+/* Write all count bytes, retrying short writes */
+int write_all(int fd, uint8_t* buf, int count)
+{
+  int bytes_done = 0;
+  int n;
+
+  while (bytes_done < count) {
+    n = write(fd,buf+bytes_done,count-bytes_done);
+    if (n == 0) {
+      /* This shouldn't happen */
+      fprintf(stderr,"Zero write\n");
+      usleep(500);
+    } else if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Write error");
+      return -1;
+    } else {
+      bytes_done += n;
+    }
+  }
+
+  return count;
+}
+
+/* Sinks that write to a file descriptor */
+struct fd_output_t
+{
+  int fd;
+  int paced;
+  uint64_t bytes_sent;
+  struct pacer_t pacer;
+};
+
+/* "dvbmod" - IT9507 DVB-T modulator */
+static int dvbmod_open(struct mux_t* m)
+{
+  struct fd_output_t* out = calloc(1, sizeof(struct fd_output_t));
+
+  if (out == NULL) {
+    fprintf(stderr,"Out of memory opening %s\n",m->device);
+    return -1;
+  }
+
+  /* Open Device */
+  if ((out->fd = open(m->device, O_RDWR)) < 0) {
+    fprintf(stderr,"Failed to open device %s.\n",m->device);
+    free(out);
+    return -1;
+  }
+
+  m->output_priv = out;
+  return 0;
+}
+
+static int dvbmod_configure(struct mux_t* m)
+{
+  struct fd_output_t* out = m->output_priv;
+
+  m->dvbmod_params.cell_id = 0;
+  if (ioctl(out->fd, DVBMOD_SET_PARAMETERS, &m->dvbmod_params) < 0) {
+    perror("DVBMOD_SET_PARAMETERS");
+  }
+
+  struct dvb_modulator_gain_range gain_range;
+  gain_range.frequency_khz = m->dvbmod_params.frequency_khz;
+  if (ioctl(out->fd, DVBMOD_GET_RF_GAIN_RANGE, &gain_range) == 0) {
+    fprintf(stderr,"Gain range: %d to %d\n",gain_range.min_gain,gain_range.max_gain);
+  }
+
+  if (ioctl(out->fd, DVBMOD_SET_RF_GAIN, &m->gain) == 0) {
+    fprintf(stderr,"Gain set to %d\n",m->gain);
+  }
+
+  return 0;
+}
+
+/* "file" and "file_unpaced" - a file, FIFO or stdout ("-").  The
+   paced version writes at the channel capacity, as a modulator would
+   consume it. */
+static int file_open_common(struct mux_t* m, int paced)
+{
+  struct fd_output_t* out = calloc(1, sizeof(struct fd_output_t));
+
+  if (out == NULL) {
+    fprintf(stderr,"Out of memory opening %s\n",m->device);
+    return -1;
+  }
+
+  if (!strcmp(m->device, "-")) {
+    out->fd = STDOUT_FILENO;
+  } else if ((out->fd = open(m->device, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    fprintf(stderr,"Failed to open output file %s.\n",m->device);
+    free(out);
+    return -1;
+  }
+
+  out->paced = paced;
+  m->output_priv = out;
+  return 0;
+}
+
+static int file_open(struct mux_t* m)
+{
+  return file_open_common(m, 1);
+}
+
+static int file_unpaced_open(struct mux_t* m)
+{
+  return file_open_common(m, 0);
+}
+
+static int fd_write(struct mux_t* m, uint8_t* buf, int count)
+{
+  struct fd_output_t* out = m->output_priv;
+
+  if (out->paced) {
+    if (out->bytes_sent == 0)
+      pacer_init(&out->pacer, m->channel_capacity);
+    else
+      pacer_wait(&out->pacer, out->bytes_sent);
+  }
+
+  if (write_all(out->fd, buf, count) < 0)
+    return -1;
+
+  out->bytes_sent += count;
+  return count;
+}
+
+static int fd_run_async(struct mux_t* m)
+{
+  struct fd_output_t* out = m->output_priv;
+
+  return uring_output_loop(m, out->fd, out->paced ? &out->pacer : NULL);
+}
+
+static void fd_close(struct mux_t* m)
+{
+  struct fd_output_t* out = m->output_priv;
+
+  if (out->fd != STDOUT_FILENO)
+    close(out->fd);
+  free(out);
+  m->output_priv = NULL;
+}
+
+static struct output_t outputs[] = {
+  { "dvbmod", 0, dvbmod_open, dvbmod_configure, fd_write, fd_run_async, fd_close },
+  { "file", 0, file_open, NULL, fd_write, fd_run_async, fd_close },
+  { "file_unpaced", 0, file_unpaced_open, NULL, fd_write, fd_run_async, fd_close },
+  { "udp", UDP_CHUNK_SIZE, udp_open, NULL, udp_write, NULL, udp_close },
+  { "rtp", UDP_CHUNK_SIZE, rtp_open, NULL, udp_write, NULL, udp_close },
+  { "udp_txtime", UDP_CHUNK_SIZE, udp_txtime_open, NULL, udp_write, NULL, udp_close },
+  { "rtp_txtime", UDP_CHUNK_SIZE, rtp_txtime_open, NULL, udp_write, NULL, udp_close },
+};
+
+struct output_t* find_output(char* name)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(outputs)/sizeof(outputs[0]); i++) {
+    if (!strcmp(outputs[i].name, name))
+      return &outputs[i];
+  }
+
+  return NULL;
+}
+
+/* Release output that has been written, passing it to the analyser
+   and latency tracing */
+void output_consume(struct mux_t* m, int count)
+{
+  if (m->analyser)
+    tr101290_tap(m->analyser, m->outbuf.read_ptr, count);
+  rb_consume(&m->outbuf, count);
+  if (m->latency)
+    latency_output(m->latency, count);
+}
+
+int output_chunk_size(struct output_t* out)
+{
+  return out->chunk_size ? out->chunk_size : OUTPUT_CHUNK_SIZE;
+}
+
+static void output_run(struct mux_t* m)
+{
+  struct output_t *out = m->output;
+  int chunk_size = output_chunk_size(out);
+
+  if (out->open(m) < 0) {
+    return;
+  }
+
+  if ((out->configure) && (out->configure(m) < 0)) {
+    out->close(m);
+    return;
+  }
+
+  /* Wait for the ringbuffer to fill to the prefill level */
+  int prefill_ms = m->output_prefill_ms ? m->output_prefill_ms : DEFAULT_OUTPUT_PREFILL_MS;
+  int prefill = (int64_t)m->channel_capacity * prefill_ms / 8000;
+  rb_wait(&m->outbuf, MIN(prefill, m->outbuf.size / 2));
+
+  if (m->io_uring_depth) {
+    if (out->run_async) {
+      if (out->run_async(m) < 0)
+        fprintf(stderr,"Output to %s failed, stopping output thread\n",m->device);
+      out->close(m);
+      return;
+    }
+    fprintf(stderr,"WARNING: Output %s does not support io_uring, using blocking writes\n",out->name);
+  }
+
+  /* The main transfer loop - write straight from the ringbuffer */
+  while(1) {
+    uint8_t* buf = rb_peek(&m->outbuf,chunk_size);
+
+    if (buf == NULL) {
+      fprintf(stderr,"Output chunk (%d bytes) is larger than the output buffer (%d bytes), stopping output thread\n",chunk_size,m->outbuf.size);
+      break;
+    }
+    if (out->write(m, buf, chunk_size) < 0) {
+      fprintf(stderr,"Output to %s failed, stopping output thread\n",m->device);
+      break;
+    }
+    output_consume(m,chunk_size);
+  }
+
+  out->close(m);
+}
+
+void *output_thread(void* userp)
+{
+  struct mux_t *m = userp;
+  char name[32];
+
+  snprintf(name, sizeof(name), "Mux %d output thread", m->id);
+  rt_apply(name, &m->output_sched);
+
+  output_run(m);
+
+  /* Tell the mux thread nothing is reading its output any more */
+  atomic_store_explicit(&m->output_stopped, 1, memory_order_release);
+  return NULL;
+}
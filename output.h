@@ -0,0 +1,69 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stdint.h>
+#include <time.h>
+#include "dvb2dvb.h"
+
+// Output ringbuffer tuning - see rb_set_wait()
+#define OUTPUT_CHUNK_SIZE (188*200)   /* Bytes per rb_peek() from the output ringbuffer */
+#define OUTPUT_PUBLISH_BATCH (188*20) /* Mux thread publishes output packets to the output thread 20 at a time */
+#define OUTPUT_SPIN_COUNT 1000
+
+// IP outputs send 7 TS packets per datagram
+#define UDP_PACKETS_PER_DATAGRAM 7
+#define UDP_DATAGRAMS_PER_CHUNK 28
+#define UDP_CHUNK_SIZE (188*UDP_PACKETS_PER_DATAGRAM*UDP_DATAGRAMS_PER_CHUNK)
+#define DEFAULT_UDP_BATCH 4           /* Datagrams per sendmmsg() call */
+#define DEFAULT_UDP_TTL 16
+#define DEFAULT_TXTIME_LOOKAHEAD_US 2000  /* How far ahead of the wire the kernel-paced outputs run */
+
+/* An output backend.  open() is called from the output thread before
+   any data is available, configure() (optional) straight after it.
+   write() must consume all count bytes, returning count or -1 on a
+   fatal error.  count is always chunk_size, or OUTPUT_CHUNK_SIZE if
+   chunk_size is 0.  Backends keep their state in mux->output_priv.
+   run_async() (optional) replaces the write() loop when the mux has
+   io_uring_depth set, and returns when output stops. */
+struct output_t
+{
+  char* name;
+  int chunk_size;
+  int (*open)(struct mux_t* mux);
+  int (*configure)(struct mux_t* mux);
+  int (*write)(struct mux_t* mux, uint8_t* buf, int count);
+  int (*run_async)(struct mux_t* mux);
+  void (*close)(struct mux_t* mux);
+};
+
+/* Sleeps until a given number of bytes is due to be sent at a
+   constant bitrate */
+struct pacer_t
+{
+  struct timespec start;
+  int bitrate;
+};
+
+struct output_t* find_output(char* name);
+int output_chunk_size(struct output_t* out);
+void output_consume(struct mux_t* m, int count);
+void *output_thread(void* userp);
+
+void pacer_init(struct pacer_t* pacer, int bitrate);
+uint64_t pacer_bytes_to_ns(uint64_t bytes, int bitrate);
+void pacer_wait(struct pacer_t* pacer, uint64_t bytes);
+int pacer_due(struct pacer_t* pacer, uint64_t bytes);
+int write_all(int fd, uint8_t* buf, int count);
+
+/* output_uring.c */
+int uring_output_loop(struct mux_t* mux, int fd, struct pacer_t* pacer);
+
+/* output_udp.c */
+int udp_open(struct mux_t* mux);
+int rtp_open(struct mux_t* mux);
+int udp_txtime_open(struct mux_t* mux);
+int rtp_txtime_open(struct mux_t* mux);
+int udp_write(struct mux_t* mux, uint8_t* buf, int count);
+void udp_close(struct mux_t* mux);
+
+#endif
@@ -0,0 +1,546 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "dvb2dvb.h"
+#include "output.h"
+
+/* "udp" and "rtp" - TS over UDP (optionally RTP, RFC 2250) to a
+   unicast or multicast "address:port" in device.
+
+   Each datagram carries UDP_PACKETS_PER_DATAGRAM TS packets, sent
+   straight from the output ringbuffer.  Datagrams are sent in batches
+   of udp_batch with one sendmmsg() call, and each batch is paced to the
+   channel capacity with clock_nanosleep(TIMER_ABSTIME).
+
+   "udp_txtime" and "rtp_txtime" hand the fine pacing to the kernel.
+   Every datagram carries its ideal departure time (SO_TXTIME), and the
+   fq or etf qdisc on the outgoing interface holds it until then.  The
+   thread itself only has to stay txtime_lookahead_us ahead, so its
+   wakeup jitter no longer reaches the wire.  Without one of those
+   qdiscs the kernel ignores the departure times.
+
+   With measure_send_times (or send_time_log) set, the kernel's software
+   transmit timestamp of every datagram is read back from the socket's
+   error queue and compared with its ideal departure time.
+*/
+
+#define RTP_HEADER_SIZE 12
+#define RTP_PAYLOAD_MP2T 33
+#define DATAGRAM_SIZE (188*UDP_PACKETS_PER_DATAGRAM)
+
+/* Ideal departure times kept for datagrams whose timestamps haven't
+   come back yet - must cover everything in flight */
+#define SEND_TIMES_RING 4096
+#define SEND_STATS_INTERVAL_NS 5000000000LL
+
+struct send_stats_t
+{
+  FILE* log;
+  uint64_t ideal_ns[SEND_TIMES_RING];  /* CLOCK_REALTIME, indexed by datagram number */
+  uint64_t nrecorded;
+  int64_t min, max;
+  double sum, sumsq;
+  uint64_t last_report_ns;
+  int txtime_errors;
+};
+
+struct udp_output_t
+{
+  int fd;
+  int rtp;
+  int batch;
+  uint64_t bytes_sent;
+  uint64_t datagrams_sent;
+  struct pacer_t pacer;
+
+  int txtime;
+  int txtime_clock;
+  uint64_t lead_ns;           /* Ideal time of the first byte, after pacer start */
+  uint64_t start_txtime_ns;   /* Pacer start on txtime_clock */
+  uint64_t start_real_ns;     /* Pacer start on CLOCK_REALTIME */
+
+  uint16_t rtp_seq;
+  uint32_t rtp_ssrc;
+  uint8_t rtp_hdr[UDP_DATAGRAMS_PER_CHUNK][RTP_HEADER_SIZE];
+
+  struct mmsghdr msgs[UDP_DATAGRAMS_PER_CHUNK];
+  struct iovec iov[UDP_DATAGRAMS_PER_CHUNK][2];
+  uint8_t control[UDP_DATAGRAMS_PER_CHUNK][CMSG_SPACE(sizeof(uint64_t))];
+
+  struct send_stats_t* stats;  /* NULL unless measuring */
+};
+
+static uint64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Split "host:port" (or "[v6host]:port") and resolve it */
+static int udp_resolve(char* device, struct addrinfo** res)
+{
+  char host[256];
+  char* port;
+  struct addrinfo hints;
+  int err;
+
+  if (strlen(device) >= sizeof(host))
+    return -1;
+  strcpy(host, device);
+
+  port = strrchr(host, ':');
+  if (port == NULL)
+    return -1;
+  *port++ = 0;
+
+  char* h = host;
+  if ((h[0] == '[') && (port[-2] == ']')) {
+    h++;
+    port[-2] = 0;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICSERV;
+
+  if ((err = getaddrinfo(h, port, &hints, res)) != 0) {
+    fprintf(stderr,"Could not resolve %s: %s\n",device,gai_strerror(err));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int udp_set_multicast(int fd, struct addrinfo* ai, int ttl, char* ifname)
+{
+  int loop = 1;
+  int ifindex = 0;
+
+  if (ifname) {
+    if ((ifindex = if_nametoindex(ifname)) == 0) {
+      fprintf(stderr,"Unknown multicast interface %s\n",ifname);
+      return -1;
+    }
+  }
+
+  if (ai->ai_family == AF_INET) {
+    struct sockaddr_in* sin = (struct sockaddr_in*)ai->ai_addr;
+    if (!IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+      return 0;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+      perror("IP_MULTICAST_TTL");
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+      perror("IP_MULTICAST_LOOP");
+    if (ifindex) {
+      struct ip_mreqn mreq;
+      memset(&mreq, 0, sizeof(mreq));
+      mreq.imr_ifindex = ifindex;
+      if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_MULTICAST_IF");
+        return -1;
+      }
+    }
+  } else if (ai->ai_family == AF_INET6) {
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)ai->ai_addr;
+    if (!IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+      return 0;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) < 0)
+      perror("IPV6_MULTICAST_HOPS");
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+      perror("IPV6_MULTICAST_LOOP");
+    if ((ifindex) && (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0)) {
+      perror("IPV6_MULTICAST_IF");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int udp_enable_txtime(struct udp_output_t* out, struct mux_t* m)
+{
+  struct sock_txtime cfg;
+
+  out->txtime_clock = CLOCK_MONOTONIC;    /* fq */
+  if (m->txtime_clock) {
+    if (!strcmp(m->txtime_clock, "tai")) {
+      out->txtime_clock = CLOCK_TAI;      /* etf, usually */
+    } else if (strcmp(m->txtime_clock, "monotonic")) {
+      fprintf(stderr,"Unknown txtime_clock %s, expected \"monotonic\" or \"tai\"\n",m->txtime_clock);
+      return -1;
+    }
+  }
+
+  cfg.clockid = out->txtime_clock;
+  cfg.flags = SOF_TXTIME_REPORT_ERRORS;
+  if (setsockopt(out->fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0) {
+    perror("SO_TXTIME");
+    return -1;
+  }
+
+  out->txtime = 1;
+  out->lead_ns = (uint64_t)(m->txtime_lookahead_us ? m->txtime_lookahead_us : DEFAULT_TXTIME_LOOKAHEAD_US) * 1000;
+  return 0;
+}
+
+static int udp_enable_measurement(struct udp_output_t* out, struct mux_t* m)
+{
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+              SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+  if (setsockopt(out->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+    perror("SO_TIMESTAMPING");
+    return -1;
+  }
+
+  out->stats = calloc(1, sizeof(struct send_stats_t));
+  if (out->stats == NULL) {
+    fprintf(stderr,"Out of memory for send time statistics\n");
+    return -1;
+  }
+  out->stats->min = INT64_MAX;
+  out->stats->max = INT64_MIN;
+
+  if (m->send_time_log) {
+    if ((out->stats->log = fopen(m->send_time_log, "w")) == NULL) {
+      fprintf(stderr,"Failed to open send time log %s\n",m->send_time_log);
+      free(out->stats);
+      out->stats = NULL;
+      return -1;
+    }
+    fprintf(out->stats->log,"datagram,ideal_ns,actual_ns,error_ns\n");
+  }
+
+  return 0;
+}
+
+static void send_stats_report(struct send_stats_t* st, uint64_t now)
+{
+  uint64_t n = st->nrecorded;
+  double mean, sd;
+
+  if (n == 0)
+    return;
+
+  mean = st->sum / n;
+  sd = st->sumsq / n - mean * mean;
+  sd = (sd > 0) ? sqrt(sd) : 0;
+
+  fprintf(stderr,"\nSend timing: %llu datagrams, error mean %.1fus sd %.1fus min %.1fus max %.1fus, %d txtime errors\n",
+          (unsigned long long)n, mean / 1000, sd / 1000, st->min / 1000.0, st->max / 1000.0, st->txtime_errors);
+
+  st->nrecorded = 0;
+  st->sum = st->sumsq = 0;
+  st->min = INT64_MAX;
+  st->max = INT64_MIN;
+  st->txtime_errors = 0;
+  st->last_report_ns = now;
+}
+
+/* Drain the error queue - transmit timestamps, and packets the qdisc
+   dropped for missing their departure time */
+static void udp_read_send_times(struct udp_output_t* out)
+{
+  struct send_stats_t* st = out->stats;
+  uint8_t control[512];
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+
+  while (1) {
+    struct scm_timestamping* tss = NULL;
+    struct sock_extended_err* serr = NULL;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(out->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING))
+        tss = (struct scm_timestamping*)CMSG_DATA(cmsg);
+      else if (((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+               ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR)))
+        serr = (struct sock_extended_err*)CMSG_DATA(cmsg);
+    }
+
+    if (serr == NULL)
+      continue;
+
+    if (serr->ee_origin == SO_EE_ORIGIN_TXTIME) {
+      st->txtime_errors++;
+    } else if ((serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) && (tss)) {
+      uint64_t actual = tss->ts[0].tv_sec * 1000000000ULL + tss->ts[0].tv_nsec;
+      uint64_t ideal = st->ideal_ns[serr->ee_data % SEND_TIMES_RING];
+      int64_t error = (int64_t)(actual - ideal);
+
+      st->nrecorded++;
+      st->sum += error;
+      st->sumsq += (double)error * error;
+      st->min = MIN(st->min, error);
+      st->max = MAX(st->max, error);
+      if (st->log)
+        fprintf(st->log,"%u,%llu,%llu,%lld\n",serr->ee_data,(unsigned long long)ideal,
+                (unsigned long long)actual,(long long)error);
+
+      if (st->last_report_ns == 0)
+        st->last_report_ns = actual;
+      else if (actual - st->last_report_ns >= SEND_STATS_INTERVAL_NS)
+        send_stats_report(st, actual);
+    }
+  }
+}
+
+static int udp_open_common(struct mux_t* m, int rtp, int txtime)
+{
+  struct udp_output_t* out;
+  struct addrinfo* ai;
+  int sndbuf;
+  int i;
+
+  if (udp_resolve(m->device, &ai) < 0) {
+    fprintf(stderr,"Invalid output address %s, expected address:port\n",m->device);
+    return -1;
+  }
+
+  out = calloc(1, sizeof(struct udp_output_t));
+  if (out == NULL) {
+    fprintf(stderr,"Out of memory opening %s\n",m->device);
+    freeaddrinfo(ai);
+    return -1;
+  }
+
+  if ((out->fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket");
+    goto error;
+  }
+
+  if (udp_set_multicast(out->fd, ai, m->ttl ? m->ttl : DEFAULT_UDP_TTL, m->multicast_if) < 0)
+    goto error;
+
+  /* Room for a couple of chunks, so a batch never blocks in the kernel */
+  sndbuf = 4 * UDP_CHUNK_SIZE;
+  setsockopt(out->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  if ((txtime) && (udp_enable_txtime(out, m) < 0))
+    goto error;
+
+  if (((m->measure_send_times) || (m->send_time_log)) && (udp_enable_measurement(out, m) < 0))
+    goto error;
+
+  /* Connect so sendmmsg() doesn't need a destination per message */
+  if (connect(out->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+    fprintf(stderr,"Could not connect to %s: %s\n",m->device,strerror(errno));
+    goto error;
+  }
+  freeaddrinfo(ai);
+
+  out->rtp = rtp;
+  out->batch = m->udp_batch ? MIN(m->udp_batch, UDP_DATAGRAMS_PER_CHUNK) : DEFAULT_UDP_BATCH;
+  out->rtp_seq = random();
+  out->rtp_ssrc = random();
+
+  /* The headers and message layout never change, only the payload pointers */
+  for (i = 0; i < UDP_DATAGRAMS_PER_CHUNK; i++) {
+    struct msghdr* hdr = &out->msgs[i].msg_hdr;
+
+    out->iov[i][0].iov_base = out->rtp_hdr[i];
+    out->iov[i][0].iov_len = RTP_HEADER_SIZE;
+    out->iov[i][1].iov_len = DATAGRAM_SIZE;
+
+    hdr->msg_iov = rtp ? &out->iov[i][0] : &out->iov[i][1];
+    hdr->msg_iovlen = rtp ? 2 : 1;
+
+    if (out->txtime) {
+      struct cmsghdr* cmsg;
+
+      hdr->msg_control = out->control[i];
+      hdr->msg_controllen = sizeof(out->control[i]);
+      cmsg = CMSG_FIRSTHDR(hdr);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_TXTIME;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    }
+  }
+
+  m->output_priv = out;
+  return 0;
+
+error:
+  freeaddrinfo(ai);
+  if (out->fd >= 0)
+    close(out->fd);
+  if (out->stats) {
+    if (out->stats->log)
+      fclose(out->stats->log);
+    free(out->stats);
+  }
+  free(out);
+  return -1;
+}
+
+int udp_open(struct mux_t* m)
+{
+  return udp_open_common(m, 0, 0);
+}
+
+int rtp_open(struct mux_t* m)
+{
+  return udp_open_common(m, 1, 0);
+}
+
+int udp_txtime_open(struct mux_t* m)
+{
+  return udp_open_common(m, 0, 1);
+}
+
+int rtp_txtime_open(struct mux_t* m)
+{
+  return udp_open_common(m, 1, 1);
+}
+
+static void udp_start(struct udp_output_t* out, int bitrate)
+{
+  pacer_init(&out->pacer, bitrate);
+  out->start_real_ns = clock_ns(CLOCK_REALTIME);
+  out->start_txtime_ns = out->pacer.start.tv_sec * 1000000000ULL + out->pacer.start.tv_nsec;
+  if (out->txtime_clock == CLOCK_TAI)
+    out->start_txtime_ns += clock_ns(CLOCK_TAI) - clock_ns(CLOCK_MONOTONIC);
+}
+
+static void rtp_fill_header(struct udp_output_t* out, uint8_t* hdr, uint64_t bytes_sent, int bitrate)
+{
+  /* 90kHz timestamp of the first byte in the datagram */
+  uint32_t ts = bytes_sent * 8 * 90000 / bitrate;
+
+  hdr[0] = 0x80;                /* Version 2, no padding/extension/CSRCs */
+  hdr[1] = RTP_PAYLOAD_MP2T;
+  hdr[2] = (out->rtp_seq >> 8) & 0xff;
+  hdr[3] = out->rtp_seq & 0xff;
+  hdr[4] = (ts >> 24) & 0xff;
+  hdr[5] = (ts >> 16) & 0xff;
+  hdr[6] = (ts >> 8) & 0xff;
+  hdr[7] = ts & 0xff;
+  hdr[8] = (out->rtp_ssrc >> 24) & 0xff;
+  hdr[9] = (out->rtp_ssrc >> 16) & 0xff;
+  hdr[10] = (out->rtp_ssrc >> 8) & 0xff;
+  hdr[11] = out->rtp_ssrc & 0xff;
+
+  out->rtp_seq++;
+}
+
+int udp_write(struct mux_t* m, uint8_t* buf, int count)
+{
+  struct udp_output_t* out = m->output_priv;
+  int ndatagrams = count / DATAGRAM_SIZE;
+  int i, n, accepted;
+
+  for (i = 0; i < ndatagrams; i++) {
+    out->iov[i][1].iov_base = buf + i * DATAGRAM_SIZE;
+    if (out->rtp)
+      rtp_fill_header(out, out->rtp_hdr[i], out->bytes_sent + i * DATAGRAM_SIZE, m->channel_capacity);
+  }
+
+  i = 0;
+  while (i < ndatagrams) {
+    int batch = MIN(out->batch, ndatagrams - i);
+    int j;
+
+    if (out->bytes_sent == 0)
+      udp_start(out, m->channel_capacity);
+    else
+      pacer_wait(&out->pacer, out->bytes_sent);
+
+    for (j = 0; j < batch; j++) {
+      uint64_t t = out->lead_ns + pacer_bytes_to_ns(out->bytes_sent + j * DATAGRAM_SIZE, m->channel_capacity);
+
+      if (out->txtime) {
+        uint64_t txtime = out->start_txtime_ns + t;
+        memcpy(CMSG_DATA(CMSG_FIRSTHDR(&out->msgs[i+j].msg_hdr)), &txtime, sizeof(txtime));
+      }
+      if (out->stats)
+        out->stats->ideal_ns[(out->datagrams_sent + j) % SEND_TIMES_RING] = out->start_real_ns + t;
+    }
+
+    n = sendmmsg(out->fd, &out->msgs[i], batch, 0);
+    accepted = n;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      /* Nobody listening (unicast) or a full queue - drop the batch
+         rather than stall the mux */
+      if ((errno == ECONNREFUSED) || (errno == ENOBUFS) || (errno == EAGAIN)) {
+        n = batch;
+        accepted = 0;
+      } else {
+        perror("sendmmsg");
+        return -1;
+      }
+    }
+
+    i += n;
+    out->bytes_sent += n * DATAGRAM_SIZE;
+    /* Only datagrams the kernel took get an error queue timestamp ID */
+    out->datagrams_sent += accepted;
+
+    if (out->stats)
+      udp_read_send_times(out);
+  }
+
+  return count;
+}
+
+void udp_close(struct mux_t* m)
+{
+  struct udp_output_t* out = m->output_priv;
+
+  if (out->stats) {
+    udp_read_send_times(out);
+    send_stats_report(out->stats, 0);
+    if (out->stats->log)
+      fclose(out->stats->log);
+    free(out->stats);
+  }
+  close(out->fd);
+  free(out);
+  m->output_priv = NULL;
+}
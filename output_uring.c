@@ -0,0 +1,414 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "dvb2dvb.h"
+#include "output.h"
+
+/* Asynchronous writer for the file descriptor outputs, using io_uring
+   directly (no liburing).
+
+   Up to io_uring_depth writes of io_uring_chunk bytes are kept in
+   flight, straight from the output ringbuffer.  The whole (double
+   mapped) ringbuffer is registered with the kernel, so writes use
+   IORING_OP_WRITE_FIXED and the pages aren't pinned and unpinned for
+   every write.  Data is only consumed from the ringbuffer, and counted
+   as sent, when its write completes.
+
+   Regular files and block devices are written at explicit offsets, so
+   writes can complete in any order.  Anything else (the modulator, a
+   FIFO) has no offset, so in-flight writes are linked into a chain
+   that the kernel executes in order, and a new chain is only started
+   when the previous one has completed.  A short write breaks the
+   chain, and the remainder is resubmitted at the head of the next one.
+
+   The fraction of time with at least one write in flight ("busy") is
+   reported every UR_REPORT_INTERVAL_NS - close to 100% means the
+   device is the bottleneck.
+*/
+
+#define UR_REPORT_INTERVAL_NS 10000000000LL
+
+#define SLOT_FREE     0
+#define SLOT_QUEUED   1   /* Waiting to be (re)submitted */
+#define SLOT_INFLIGHT 2
+#define SLOT_DONE     3
+
+struct uring_t
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  unsigned sqe_tail;     /* Next SQE to fill */
+  unsigned to_submit;    /* Filled but not yet consumed by the kernel */
+  void* sq_ptr;
+  void* cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+/* One write - bytes pos to end of the output stream */
+struct uring_slot_t
+{
+  int state;
+  uint64_t pos;
+  uint64_t end;
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int uring_init(struct uring_t* ur, unsigned entries)
+{
+  struct io_uring_params p;
+
+  memset(ur, 0, sizeof(*ur));
+  memset(&p, 0, sizeof(p));
+
+  ur->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ur->fd < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+
+  ur->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ur->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ur->sq_len = ur->cq_len = MAX(ur->sq_len, ur->cq_len);
+
+  ur->sq_ptr = mmap(NULL, ur->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+  if (ur->sq_ptr == MAP_FAILED)
+    goto error;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ur->cq_ptr = ur->sq_ptr;
+  } else {
+    ur->cq_ptr = mmap(NULL, ur->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    if (ur->cq_ptr == MAP_FAILED)
+      goto error;
+  }
+
+  ur->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED)
+    goto error;
+
+  ur->sq_head = (unsigned*)((uint8_t*)ur->sq_ptr + p.sq_off.head);
+  ur->sq_tail = (unsigned*)((uint8_t*)ur->sq_ptr + p.sq_off.tail);
+  ur->sq_mask = (unsigned*)((uint8_t*)ur->sq_ptr + p.sq_off.ring_mask);
+  ur->sq_array = (unsigned*)((uint8_t*)ur->sq_ptr + p.sq_off.array);
+  ur->cq_head = (unsigned*)((uint8_t*)ur->cq_ptr + p.cq_off.head);
+  ur->cq_tail = (unsigned*)((uint8_t*)ur->cq_ptr + p.cq_off.tail);
+  ur->cq_mask = (unsigned*)((uint8_t*)ur->cq_ptr + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe*)((uint8_t*)ur->cq_ptr + p.cq_off.cqes);
+  ur->sqe_tail = *ur->sq_tail;
+
+  return 0;
+
+error:
+  perror("io_uring mmap");
+  close(ur->fd);
+  return -1;
+}
+
+static void uring_free(struct uring_t* ur)
+{
+  munmap(ur->sqes, ur->sqes_len);
+  if (ur->cq_ptr != ur->sq_ptr)
+    munmap(ur->cq_ptr, ur->cq_len);
+  munmap(ur->sq_ptr, ur->sq_len);
+  close(ur->fd);
+}
+
+/* Next free SQE.  The ring is sized so this can't run out. */
+static struct io_uring_sqe* uring_get_sqe(struct uring_t* ur)
+{
+  unsigned index = ur->sqe_tail & *ur->sq_mask;
+  struct io_uring_sqe* sqe = &ur->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  ur->sq_array[index] = index;
+  ur->sqe_tail++;
+  ur->to_submit++;
+  return sqe;
+}
+
+static int uring_submit(struct uring_t* ur, unsigned min_complete)
+{
+  int n;
+
+  __atomic_store_n(ur->sq_tail, ur->sqe_tail, __ATOMIC_RELEASE);
+
+  do {
+    n = syscall(__NR_io_uring_enter, ur->fd, ur->to_submit, min_complete,
+                min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while ((n < 0) && (errno == EINTR));
+
+  if (n < 0) {
+    perror("io_uring_enter");
+    return -1;
+  }
+
+  ur->to_submit -= n;
+  return 0;
+}
+
+struct uring_writer_t
+{
+  struct mux_t* m;
+  struct ringbuffer_t* rb;
+  struct pacer_t* pacer;
+  struct uring_t ur;
+  int fd;
+  int depth;
+  int chunk;
+  int seekable;
+  int fixed;
+  int64_t file_offset;
+
+  struct uring_slot_t* slots;  /* FIFO of depth writes, oldest first */
+  int first;
+  int nslots;
+  int inflight;
+  struct io_uring_sqe* chain_tail;
+
+  uint64_t consumed;           /* Stream position released from the ringbuffer */
+  uint64_t queued;             /* Stream position of the next new write */
+
+  uint64_t bytes_sent;
+  uint64_t last_bytes_sent;
+  uint64_t busy_ns;
+  uint64_t busy_start;
+  uint64_t last_report;
+};
+
+static void uw_prep(struct uring_writer_t* w, struct uring_slot_t* s)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(&w->ur);
+  /* Everything up to s->end is in the ringbuffer, so this doesn't block */
+  uint8_t* base = rb_peek(w->rb, (int)(s->end - w->consumed));
+
+  sqe->opcode = w->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = w->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(base + (s->pos - w->consumed));
+  sqe->len = s->end - s->pos;
+  sqe->off = w->seekable ? (uint64_t)(w->file_offset + s->pos) : (uint64_t)-1;
+  sqe->buf_index = 0;
+  sqe->user_data = s - w->slots;
+
+  if (!w->seekable) {
+    if (w->chain_tail)
+      w->chain_tail->flags |= IOSQE_IO_LINK;
+    w->chain_tail = sqe;
+  }
+
+  s->state = SLOT_INFLIGHT;
+  if (w->inflight++ == 0)
+    w->busy_start = now_ns();
+}
+
+/* Is the next new chunk in the ringbuffer, and due to be written? */
+static int uw_next_ready(struct uring_writer_t* w)
+{
+  if (rb_get_bytes_used(w->rb) < (int)(w->queued - w->consumed) + w->chunk)
+    return 0;
+  return ((w->pacer == NULL) || (w->queued == 0) || (pacer_due(w->pacer, w->queued)));
+}
+
+/* Queue a new chunk, waiting for data and the pacer if necessary */
+static void uw_queue_next(struct uring_writer_t* w)
+{
+  struct uring_slot_t* s = &w->slots[(w->first + w->nslots) % w->depth];
+
+  rb_wait(w->rb, (int)(w->queued - w->consumed) + w->chunk);
+  if (w->pacer) {
+    if (w->queued == 0)
+      pacer_init(w->pacer, w->m->channel_capacity);
+    else
+      pacer_wait(w->pacer, w->queued);
+  }
+
+  s->pos = w->queued;
+  s->end = w->queued + w->chunk;
+  w->queued += w->chunk;
+  w->nslots++;
+  uw_prep(w, s);
+}
+
+static int uw_reap(struct uring_writer_t* w)
+{
+  unsigned head = *w->ur.cq_head;
+  unsigned tail = __atomic_load_n(w->ur.cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe* cqe = &w->ur.cqes[head & *w->ur.cq_mask];
+    struct uring_slot_t* s = &w->slots[cqe->user_data];
+    int res = cqe->res;
+
+    head++;
+    if (res >= 0) {
+      s->pos += res;
+      w->bytes_sent += res;
+      s->state = (s->pos == s->end) ? SLOT_DONE : SLOT_QUEUED;
+    } else if ((res == -EAGAIN) || (res == -EINTR) || (res == -ECANCELED)) {
+      s->state = SLOT_QUEUED;
+    } else {
+      fprintf(stderr,"io_uring write failed: %s\n",strerror(-res));
+      __atomic_store_n(w->ur.cq_head, head, __ATOMIC_RELEASE);
+      return -1;
+    }
+
+    if (--w->inflight == 0)
+      w->busy_ns += now_ns() - w->busy_start;
+  }
+  __atomic_store_n(w->ur.cq_head, head, __ATOMIC_RELEASE);
+
+  /* Release completed writes from the ringbuffer, in stream order */
+  while ((w->nslots) && (w->slots[w->first].state == SLOT_DONE)) {
+    output_consume(w->m, (int)(w->slots[w->first].end - w->consumed));
+    w->consumed = w->slots[w->first].end;
+    w->slots[w->first].state = SLOT_FREE;
+    w->first = (w->first + 1) % w->depth;
+    w->nslots--;
+  }
+
+  return 0;
+}
+
+static void uw_report(struct uring_writer_t* w)
+{
+  uint64_t now = now_ns();
+  uint64_t elapsed = now - w->last_report;
+
+  if (elapsed < UR_REPORT_INTERVAL_NS)
+    return;
+
+  if (w->inflight) {
+    w->busy_ns += now - w->busy_start;
+    w->busy_start = now;
+  }
+  fprintf(stderr,"\nio_uring output: %.1f%% busy, %.3f Mbit/s written, %llu bytes total\n",
+          100.0 * w->busy_ns / elapsed,
+          (w->bytes_sent - w->last_bytes_sent) * 8000.0 / elapsed,
+          (unsigned long long)w->bytes_sent);
+  w->busy_ns = 0;
+  w->last_bytes_sent = w->bytes_sent;
+  w->last_report = now;
+}
+
+int uring_output_loop(struct mux_t* m, int fd, struct pacer_t* pacer)
+{
+  struct uring_writer_t w;
+  struct stat st;
+  struct iovec iov;
+  int i;
+
+  memset(&w, 0, sizeof(w));
+  w.m = m;
+  w.rb = &m->outbuf;
+  w.pacer = pacer;
+  w.fd = fd;
+  w.depth = m->io_uring_depth;
+  w.chunk = m->io_uring_chunk ? m->io_uring_chunk / 188 * 188 : OUTPUT_CHUNK_SIZE;
+
+  if ((w.chunk <= 0) || (w.chunk > w.rb->size / 2)) {
+    fprintf(stderr,"Invalid io_uring_chunk %d\n",m->io_uring_chunk);
+    return -1;
+  }
+
+  if (uring_init(&w.ur, w.depth) < 0)
+    return -1;
+
+  /* Register the whole ringbuffer (both mappings) for WRITE_FIXED */
+  iov.iov_base = w.rb->buf;
+  iov.iov_len = 2 * (size_t)w.rb->size;
+  w.fixed = (syscall(__NR_io_uring_register, w.ur.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+  if (!w.fixed)
+    fprintf(stderr,"WARNING: Could not register output buffer with io_uring (%s), using unregistered writes\n",strerror(errno));
+
+  w.file_offset = -1;
+  w.seekable = ((fstat(fd, &st) == 0) && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)));
+  if (w.seekable)
+    w.file_offset = lseek(fd, 0, SEEK_CUR);
+  if (w.file_offset < 0)
+    w.seekable = 0;
+
+  fprintf(stderr,"io_uring output: depth %d, %d byte writes, %s, %s\n",w.depth,w.chunk,
+          w.fixed ? "registered buffer" : "unregistered buffer",
+          w.seekable ? "unordered" : "linked");
+
+  w.slots = calloc(w.depth, sizeof(struct uring_slot_t));
+  w.last_report = now_ns();
+
+  while (1) {
+    /* Unordered writes can be topped up at any time, a chain can only
+       be started once the previous one has completed.  Never block
+       waiting for data or the pacer with writes prepared or in flight -
+       submit and wait for completions instead. */
+    if ((w.seekable) || (w.inflight == 0)) {
+      w.chain_tail = NULL;
+
+      for (i = 0; i < w.nslots; i++) {
+        struct uring_slot_t* s = &w.slots[(w.first + i) % w.depth];
+        if (s->state == SLOT_QUEUED)
+          uw_prep(&w, s);
+      }
+
+      while ((w.nslots < w.depth) && ((w.inflight == 0) || (uw_next_ready(&w))))
+        uw_queue_next(&w);
+    }
+
+    /* Wait for a completion unless there is more to queue straight away */
+    int more = ((w.seekable) && (w.nslots < w.depth) && (uw_next_ready(&w)));
+    if (uring_submit(&w.ur, (more || (w.inflight == 0)) ? 0 : 1) < 0)
+      break;
+
+    if (uw_reap(&w) < 0)
+      break;
+
+    uw_report(&w);
+  }
+
+  /* Closing the ring cancels anything still in flight */
+  free(w.slots);
+  uring_free(&w.ur);
+  return -1;
+}
@@ -4,10 +4,65 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
 
 #include "dvb2dvb.h"
+#include "output.h"
 #include "json.h"
 
+/* "<class>_policy", "<class>_priority" and "<class>_cpus" for each class
+   of thread.  Returns 1 if name was one of these, 0 if not, or -1 if
+   the value is invalid. */
+static int parse_thread_sched(struct mux_t *mux, char* name, json_value* value)
+{
+  static char* classes[] = { "mux_", "output_", "ingest_" };
+  struct thread_sched_t* scheds[] = { &mux->mux_sched, &mux->output_sched, &mux->ingest_sched };
+  int i;
+
+  for (i=0;i<3;i++) {
+    int len = strlen(classes[i]);
+    if (strncmp(name,classes[i],len))
+      continue;
+    if (!strcmp(name+len,"policy")) {
+      scheds[i]->policy = rt_parse_policy(value->u.string.ptr);
+      if (scheds[i]->policy < 0) {
+        fprintf(stderr,"Unknown %s %s\n",name,value->u.string.ptr);
+        return -1;
+      }
+      return 1;
+    } else if (!strcmp(name+len,"priority")) {
+      scheds[i]->priority = value->u.integer;
+      return 1;
+    } else if (!strcmp(name+len,"cpus")) {
+      scheds[i]->cpus = value->u.string.ptr;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* A real-time policy needs a priority of 1-99 (a priority on its own
+   means SCHED_FIFO).  Checked once the mux's settings are complete, as
+   policy and priority can come in either order or from "common". */
+static int check_thread_sched(struct mux_t *mux)
+{
+  static char* classes[] = { "mux", "output", "ingest" };
+  struct thread_sched_t* scheds[] = { &mux->mux_sched, &mux->output_sched, &mux->ingest_sched };
+  int i;
+
+  for (i=0;i<3;i++) {
+    if ((scheds[i]->policy == SCHED_OTHER) && (scheds[i]->priority == 0))
+      continue;
+    if ((scheds[i]->priority < 1) || (scheds[i]->priority > 99)) {
+      fprintf(stderr,"%s_priority must be 1-99 for a real-time %s_policy, not %d\n",classes[i],classes[i],scheds[i]->priority);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 static int parse_mux_params(struct mux_t *mux, json_value *json)
 {
   int i;
@@ -21,6 +76,15 @@ static int parse_mux_params(struct mux_t *mux, json_value *json)
   for (i=0;i<(int)json->u.object.length;i++) {
     if (!strcmp(json->u.object.values[i].name,"device"))
       mux->device = strdup(json->u.object.values[i].value->u.string.ptr);
+    else if (!strcmp(json->u.object.values[i].name,"output")) {
+      s = json->u.object.values[i].value->u.string.ptr;
+      mux->output = find_output(s);
+      if (mux->output == NULL) {
+        fprintf(stderr,"Unknown output %s\n",s);
+        return -1;
+      }
+    } else if (!strcmp(json->u.object.values[i].name,"bitrate"))
+      mux->bitrate = json->u.object.values[i].value->u.integer;
     else if (!strcmp(json->u.object.values[i].name,"frequency_khz"))
       mux->dvbmod_params.frequency_khz = json->u.object.values[i].value->u.integer;
     else if (!strcmp(json->u.object.values[i].name,"bandwidth_hz"))
@@ -75,6 +139,48 @@ static int parse_mux_params(struct mux_t *mux, json_value *json)
       mux->onid = json->u.object.values[i].value->u.integer;
     else if (!strcmp(json->u.object.values[i].name,"nid"))
       mux->nid = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"output_buffer_ms"))
+      mux->output_buffer_ms = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"output_prefill_ms"))
+      mux->output_prefill_ms = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"hugepages"))
+      mux->hugepages = json->u.object.values[i].value->u.boolean;
+    else if (!strcmp(json->u.object.values[i].name,"ingest_threads"))
+      mux->ingest_threads = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"ingest_buffer_size"))
+      mux->ingest_buffer_size = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"io_uring_depth"))
+      mux->io_uring_depth = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"io_uring_chunk"))
+      mux->io_uring_chunk = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"ttl"))
+      mux->ttl = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"multicast_if"))
+      mux->multicast_if = json->u.object.values[i].value->u.string.ptr;
+    else if (!strcmp(json->u.object.values[i].name,"udp_batch"))
+      mux->udp_batch = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"txtime_lookahead_us"))
+      mux->txtime_lookahead_us = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"txtime_clock"))
+      mux->txtime_clock = json->u.object.values[i].value->u.string.ptr;
+    else if (!strcmp(json->u.object.values[i].name,"measure_send_times"))
+      mux->measure_send_times = json->u.object.values[i].value->u.boolean;
+    else if (!strcmp(json->u.object.values[i].name,"send_time_log"))
+      mux->send_time_log = json->u.object.values[i].value->u.string.ptr;
+    else if (!strcmp(json->u.object.values[i].name,"tr101290"))
+      mux->tr101290 = json->u.object.values[i].value->u.boolean;
+    else if (!strcmp(json->u.object.values[i].name,"stats_shm"))
+      mux->stats_shm = json->u.object.values[i].value->u.string.ptr;
+    else if (!strcmp(json->u.object.values[i].name,"stats_port"))
+      mux->stats_port = json->u.object.values[i].value->u.integer;
+    else if (!strcmp(json->u.object.values[i].name,"latency_trace"))
+      mux->latency_trace = json->u.object.values[i].value->u.boolean;
+    else if (!strcmp(json->u.object.values[i].name,"cpus"))
+      mux->cpus = json->u.object.values[i].value->u.string.ptr;
+    else if (!strcmp(json->u.object.values[i].name,"mlockall"))
+      mux->mlockall = json->u.object.values[i].value->u.boolean;
+    else if (parse_thread_sched(mux, json->u.object.values[i].name, json->u.object.values[i].value) < 0)
+      return -1;
   }
 
   return 0;
@@ -155,11 +261,14 @@ int parse_config(char* filename, struct mux_t **muxes_res)
       *mux = *mux_defaults;
 
     json_value* m = muxes->u.array.values[j];
-    if (parse_mux_params(mux, m) < 0) {
+    if ((parse_mux_params(mux, m) < 0) || (check_thread_sched(mux) < 0)) {
       fprintf(stderr,"Error parsing muxes\n");
       return -9;
     }
 
+    if (mux->output == NULL)
+      mux->output = find_output("dvbmod");
+
     json_value *services = NULL;
     for (i=0;i<(int)m->u.object.length;i++) {
       if (!strcmp(m->u.object.values[i].name,"services"))
@@ -190,6 +299,12 @@ int parse_config(char* filename, struct mux_t **muxes_res)
           mux->services[i].new_service_id = s->u.object.values[j].value->u.integer;
         else if ((!strcmp(s->u.object.values[j].name,"lcn")) && (s->u.object.values[j].value->type == json_integer))
           mux->services[i].lcn = s->u.object.values[j].value->u.integer;
+        else if ((!strcmp(s->u.object.values[j].name,"max_bitrate")) && (s->u.object.values[j].value->type == json_integer))
+          mux->services[i].max_bitrate = s->u.object.values[j].value->u.integer;
+        else if ((!strcmp(s->u.object.values[j].name,"buffer_ms")) && (s->u.object.values[j].value->type == json_integer))
+          mux->services[i].buffer_ms = s->u.object.values[j].value->u.integer;
+        else if ((!strcmp(s->u.object.values[j].name,"http_client")) && (s->u.object.values[j].value->type == json_string))
+          mux->services[i].native_http = !strcmp(s->u.object.values[j].value->u.string.ptr,"native");
       }
       
       /* Add hbbtv to first service */
@@ -0,0 +1,79 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pktsched.h"
+
+/* Only the service at the top of the heap is ever output, so only its
+   key changes - O(log N) per packet instead of scanning every service. */
+
+static int before(struct pktsched_node_t* a, struct pktsched_node_t* b)
+{
+  return (a->key < b->key) || ((a->key == b->key) && (a->id < b->id));
+}
+
+static void sift_down(struct pktsched_t* s, int i)
+{
+  struct pktsched_node_t* h = s->heap;
+  struct pktsched_node_t node = h[i];
+  int n = s->n;
+
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= n)
+      break;
+    if ((child + 1 < n) && before(&h[child + 1], &h[child]))
+      child++;
+    if (!before(&h[child], &node))
+      break;
+    h[i] = h[child];
+    i = child;
+  }
+  h[i] = node;
+}
+
+int pktsched_init(struct pktsched_t* s, int n)
+{
+  s->n = n;
+  s->heap = calloc(n, sizeof(struct pktsched_node_t));
+  return s->heap ? 0 : -1;
+}
+
+void pktsched_build(struct pktsched_t* s, int64_t* keys)
+{
+  int i;
+
+  for (i = 0; i < s->n; i++) {
+    s->heap[i].key = keys[i];
+    s->heap[i].id = i;
+  }
+  for (i = s->n / 2 - 1; i >= 0; i--)
+    sift_down(s, i);
+}
+
+void pktsched_update_top(struct pktsched_t* s, int64_t key)
+{
+  s->heap[0].key = key;
+  sift_down(s, 0);
+}
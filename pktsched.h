@@ -0,0 +1,30 @@
+#ifndef _PKTSCHED_H
+#define _PKTSCHED_H
+
+#include <stdint.h>
+
+/* Min-heap of services keyed on the output bit position of their next
+   packet.  Ties go to the lowest service index, as with a linear scan. */
+
+struct pktsched_node_t {
+  int64_t key;
+  int id;
+};
+
+struct pktsched_t {
+  int n;
+  struct pktsched_node_t* heap;
+};
+
+int pktsched_init(struct pktsched_t* s, int n);
+
+/* Build the heap from each service's first key */
+void pktsched_build(struct pktsched_t* s, int64_t* keys);
+
+/* The most urgent service */
+#define pktsched_top(s) ((s)->heap[0].id)
+
+/* Give the most urgent service a new key and restore the heap */
+void pktsched_update_top(struct pktsched_t* s, int64_t key);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* Compares the packet scheduler's heap with the linear scan it
+   replaced: both are driven through the same synthetic services, the
+   heap must pick the same service as the scan for every packet, and
+   each is timed.  Build with "make pktsched_bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "pktsched.h"
+
+#define MAX_PACKETS 256
+#define PACKETS_PER_RUN 20000000
+
+/* Just what the mux loop looks at: the output positions of the
+   packets up to the service's next PCR */
+struct bench_service_t {
+  int packets_in_buf;
+  int packets_written;
+  int64_t bitpos[MAX_PACKETS];
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The next PCR interval of service i: a varying number of packets
+   spread over 40ms at 8Mbit/s */
+static void refill(struct bench_service_t* sv, int i)
+{
+  int64_t start = sv->bitpos[sv->packets_in_buf - 1];
+  int npackets = 20 + (i * 37 + sv->packets_in_buf) % 200;
+  int64_t span = 40 * 8000;
+  int j;
+
+  sv->packets_written = 0;
+  sv->packets_in_buf = npackets;
+  for (j = 0; j < npackets; j++)
+    sv->bitpos[j] = start + (span * j) / (npackets - 1);
+}
+
+static void setup(struct bench_service_t* s, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    s[i].packets_in_buf = 1;
+    s[i].bitpos[0] = i * 13;
+    refill(&s[i], i);
+  }
+}
+
+/* Output one packet from service i */
+static void output(struct bench_service_t* s, int i)
+{
+  s[i].packets_written++;
+  if (s[i].packets_in_buf - s[i].packets_written == 1)
+    refill(&s[i], i);
+}
+
+static int scan(struct bench_service_t* s, int n)
+{
+  int best = 0;
+  int i;
+
+  for (i = 1; i < n; i++) {
+    if (s[i].bitpos[s[i].packets_written] < s[best].bitpos[s[best].packets_written])
+      best = i;
+  }
+  return best;
+}
+
+int main(void)
+{
+  static int ns[] = { 4, 32, 128 };
+  int errors = 0;
+  int k, i;
+  long p;
+
+  printf("%-10s %14s %14s %8s\n", "services", "scan Mpkt/s", "heap Mpkt/s", "speedup");
+  for (k = 0; k < (int)(sizeof(ns) / sizeof(ns[0])); k++) {
+    int n = ns[k];
+    struct bench_service_t* a = calloc(n, sizeof(struct bench_service_t));
+    struct bench_service_t* b = calloc(n, sizeof(struct bench_service_t));
+    int64_t* keys = calloc(n, sizeof(int64_t));
+    struct pktsched_t sched;
+    volatile int sink = 0;
+    double t0, t_scan, t_heap;
+
+    if (!(a && b && keys) || (pktsched_init(&sched, n) < 0))
+      return 1;
+
+    /* The heap has to pick what the scan picks, packet by packet */
+    setup(a, n);
+    setup(b, n);
+    for (i = 0; i < n; i++)
+      keys[i] = b[i].bitpos[0];
+    pktsched_build(&sched, keys);
+    for (p = 0; p < PACKETS_PER_RUN / 10; p++) {
+      int want = scan(a, n);
+      int got = pktsched_top(&sched);
+      if ((want != got) && (errors++ < 10))
+        printf("MISMATCH: %d services, packet %ld: heap picked %d, scan %d\n", n, p, got, want);
+      output(a, want);
+      output(b, got);
+      pktsched_update_top(&sched, b[got].bitpos[b[got].packets_written]);
+    }
+
+    setup(a, n);
+    t0 = now();
+    for (p = 0; p < PACKETS_PER_RUN; p++) {
+      int id = scan(a, n);
+      sink += id;
+      output(a, id);
+    }
+    t_scan = now() - t0;
+
+    setup(b, n);
+    for (i = 0; i < n; i++)
+      keys[i] = b[i].bitpos[0];
+    pktsched_build(&sched, keys);
+    t0 = now();
+    for (p = 0; p < PACKETS_PER_RUN; p++) {
+      int id = pktsched_top(&sched);
+      sink += id;
+      output(b, id);
+      pktsched_update_top(&sched, b[id].bitpos[b[id].packets_written]);
+    }
+    t_heap = now() - t0;
+
+    printf("%-10d %14.1f %14.1f %7.1fx\n", n, PACKETS_PER_RUN / t_scan / 1e6,
+           PACKETS_PER_RUN / t_heap / 1e6, t_scan / t_heap);
+    free(a);
+    free(b);
+    free(keys);
+    free(sched.heap);
+  }
+  printf("Validation: %s\n", errors ? "FAILED" : "the heap picked the same service as the scan for every packet");
+
+  return errors ? 1 : 0;
+}
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "dvb2dvb.h"
@@ -362,6 +363,7 @@ void create_nit(struct section_t* nitsec, struct mux_t* mux)
   put_u32be(p, crc);
 
   nitsec->length = p - nit + 4;
+  packetise_section(nitsec, 0x10);
 }
 
 
@@ -387,9 +389,9 @@ void create_sdt(struct section_t* sdtsec, struct mux_t* mux)
 
   i = 11;
   for (k=0;k<mux->nservices;k++) {
-    uint8_t *buf = &services[k].sdt.buf[0];
+    uint8_t *buf = &services[k].sdt->buf[0];
     j = 11;
-    while (j < services[k].sdt.length - 4) {
+    while (j < services[k].sdt->length - 4) {
       int service_id = (buf[j] << 8) | buf[j+1];
       //fprintf(stderr,"Processing SDT: i=%d, service=%d\n",i,service_id);
       int EIT_schedule_flag = 0;
@@ -403,7 +405,7 @@ void create_sdt(struct section_t* sdtsec, struct mux_t* mux)
         put_u16be(sdt+i,services[k].new_service_id);
         sdt[i+2] = 0xfc | (EIT_schedule_flag << 1) | EIT_present_following_flag;
 
-        int new_descriptors_loop_length = copy_sdt_descriptors(sdt+i+5,&services[k].sdt.buf[j+5], descriptors_loop_length, services[k].onid);
+        int new_descriptors_loop_length = copy_sdt_descriptors(sdt+i+5,&services[k].sdt->buf[j+5], descriptors_loop_length, services[k].onid);
 
         put_u16be(sdt+i+3, (running_status << 13) | (free_CA_mode << 12) | new_descriptors_loop_length);
         i += 5 + new_descriptors_loop_length;
@@ -420,18 +422,19 @@ void create_sdt(struct section_t* sdtsec, struct mux_t* mux)
   put_u32be(sdt+i, crc);
 
   sdtsec->length = i + 4;
+  packetise_section(sdtsec, 0x11);
 
   //  check_sdt(&sv->new_sdt);
 }
 
 void create_pmt(struct service_t* sv)
 {
-  uint8_t *pmt = &sv->new_pmt.buf[0];
+  uint8_t *pmt = &sv->new_pmt->buf[0];
 
-  int version_number = 1;
+  int version_number = sv->pmt_version;  /* Follow the input, so receivers see a change */
   int current_next_indicator = 1;
 
-  memset(pmt,0,sizeof(sv->new_pmt.buf));
+  memset(pmt,0,sizeof(sv->new_pmt->buf));
 
   pmt[0] = 0x02; // table_id
   // skip section_length - 2 bytes
@@ -441,27 +444,27 @@ void create_pmt(struct service_t* sv)
   pmt[7] = 0x00;  // last_section_number
   put_u16be(pmt+8,0xe000 | sv->pid_map[sv->pcr_pid]);
 
-  int program_info_length = ((sv->pmt.buf[10] & 0x0f) << 8) | sv->pmt.buf[11];
+  int program_info_length = ((sv->pmt->buf[10] & 0x0f) << 8) | sv->pmt->buf[11];
   put_u16be(pmt+10,0xf000 | program_info_length);  // program_info_length
 
   int i = 12;
   if (program_info_length) {
-    memcpy(pmt + 12, &sv->pmt.buf[12], program_info_length);
+    memcpy(pmt + 12, &sv->pmt->buf[12], program_info_length);
     i += program_info_length;
   }
   int j = i;
 
-  while ( j < sv->pmt.length - 4) {
-    int stream_type = sv->pmt.buf[j];
-    int pid = ((sv->pmt.buf[j+1]&0x1f) << 8) | sv->pmt.buf[j+2];
-    int ES_info_length = ((sv->pmt.buf[j+3] & 0x0f) << 8) | sv->pmt.buf[j+4];
+  while ( j < sv->pmt->length - 4) {
+    int stream_type = sv->pmt->buf[j];
+    int pid = ((sv->pmt->buf[j+1]&0x1f) << 8) | sv->pmt->buf[j+2];
+    int ES_info_length = ((sv->pmt->buf[j+3] & 0x0f) << 8) | sv->pmt->buf[j+4];
 
     if (sv->pid_map[pid]) {
       pmt[i] = stream_type;
       put_u16be(pmt+i+1, 0xe000 | sv->pid_map[pid]);
 
       // TODO: Only copy interesting descriptors
-      int new_ES_info_length = copy_pmt_descriptors(pmt+i+5,&sv->pmt.buf[j+5], ES_info_length);
+      int new_ES_info_length = copy_pmt_descriptors(pmt+i+5,&sv->pmt->buf[j+5], ES_info_length);
       put_u16be(pmt+i+3, 0xf000 | new_ES_info_length);
 
       i += 5 + new_ES_info_length;
@@ -487,7 +490,8 @@ void create_pmt(struct service_t* sv)
 
   put_u32be(pmt+i, crc);
 
-  sv->new_pmt.length = i + 4;
+  sv->new_pmt->length = i + 4;
+  packetise_section(sv->new_pmt, sv->new_pmt_pid);
 }
 
 void create_pat(struct section_t *patsec, struct mux_t* mux)
@@ -500,7 +504,7 @@ void create_pat(struct section_t *patsec, struct mux_t* mux)
   int version_number = 1;
   int current_next_indicator = 1;
 
-  memset(pat,0,sizeof(struct section_t));
+  memset(pat,0,sizeof(patsec->buf));
 
   pat[0]  = 0x00;  // table_id
   put_u16be(pat+1, 0x8000 | section_length);
@@ -520,15 +524,16 @@ void create_pat(struct section_t *patsec, struct mux_t* mux)
   put_u32be(pat+i, crc);
 
   patsec->length = i + 4;
+  packetise_section(patsec, 0);
 }
 
 void create_ait(struct service_t* sv)
 {
-  uint8_t *ait = &sv->ait.buf[0];
+  uint8_t *ait = &sv->ait->buf[0];
   int i,j,k;
   int current_next_indicator = 1;
 
-  memset(ait,0,sizeof(sv->ait.buf));
+  memset(ait,0,sizeof(sv->ait->buf));
 
   ait[0] = 0x74; // table_id
   // skip section_length - 2 bytes
@@ -599,7 +604,8 @@ void create_ait(struct service_t* sv)
 
   put_u32be(ait+i, crc);
 
-  sv->ait.length = i + 4;
+  sv->ait->length = i + 4;
+  packetise_section(sv->ait, sv->ait_pid);
 }
 
 int copy_section(uint8_t* tsbuf, struct section_t* section, int pid)
@@ -637,40 +643,49 @@ int copy_section(uint8_t* tsbuf, struct section_t* section, int pid)
   return num_packets;
 }
 
+/* Split a section we have built into TS packets once, so each repetition
+   only has to copy them and fill in the continuity counters */
+void packetise_section(struct section_t* section, int pid)
+{
+  int cc = section->cc;
+
+  free(section->packets);
+  section->npackets = 0;
+  section->packets = malloc((section->length / 184 + 1) * 188);
+  if (section->packets == NULL) {
+    fprintf(stderr,"Could not allocate PSI packets, pid %d\n",pid);
+    return;
+  }
+  section->npackets = copy_section(section->packets, section, pid);
+  section->pid = pid;
+  section->cc = cc;
+}
+
+/* Packetise section directly into the ringbuffer */
 int write_section(struct ringbuffer_t* rb, struct section_t* section, int pid)
 {
-  int i;
-  uint8_t *buf = &section->buf[0];
-  uint8_t tsbuf[188];
-  int n = section->length;
-  int bytes_written = 0;
-  int num_packets = 0;
+  int i, n;
 
-  tsbuf[0] = 0x47;
+  if ((section->packets == NULL) || (section->pid != pid)) {
+    packetise_section(section, pid);
+    if (section->packets == NULL)
+      return 0;
+  }
+  n = section->npackets;
+
+  /* The ringbuffer is mapped twice, so the space is always contiguous */
+  uint8_t *tsbuf = rb_reserve(rb, n * 188);
+  if (tsbuf == NULL) {
+    /* Buffer full - packets are dropped */
+    section->cc = (section->cc + n) % 16;
+    return n;
+  }
 
-  while (n > 0) {
-    if (bytes_written == 0) {
-      put_u16be(tsbuf+1,0x4000 | pid);
-      tsbuf[4] = 0;
-      i = 5;
-    } else {
-      put_u16be(tsbuf+1,pid);
-      i = 4;
-    }
-    tsbuf[3] = 0x10 | section->cc;
+  memcpy(tsbuf, section->packets, n * 188);
+  for (i = 0; i < n; i++) {
+    tsbuf[i*188+3] = 0x10 | section->cc;
     section->cc = (section->cc + 1) % 16;
-
-    int to_write = MIN(188-i,n);
-    memcpy(tsbuf+i, buf+bytes_written, to_write);
-    if (i+to_write < 188) {
-      memset(tsbuf+i+to_write,0xff,188-(i+to_write));
-    }
-
-    rb_write(rb, tsbuf, 188);
-    bytes_written += to_write;
-    n -= to_write;
-    num_packets++;
   }
-  return num_packets;
+  rb_commit(rb, n * 188);
+  return n;
 }
-
@@ -21,6 +21,7 @@ void create_pmt(struct service_t* sv);
 void create_ait(struct service_t* sv);
 void create_pat(struct section_t *patsec, struct mux_t* mux);
 int copy_section(uint8_t* tsbuf, struct section_t* section, int pid);
+void packetise_section(struct section_t* section, int pid);
 int write_section(struct ringbuffer_t* rb, struct section_t* section, int pid);
 
 #endif
@@ -38,7 +38,7 @@ static char* RST[] = {
   "Reserved"
 };
 
-static char pts_text[30];
+static __thread char pts_text[30];
 char* pts2hmsu(uint64_t pts,char sep) {
   int h,m,s,u;
 
@@ -98,8 +98,8 @@ int process_pat(struct service_t* sv, uint8_t* buf)
 
 int process_sdt(struct service_t* sv)
 {
-  uint8_t *buf = &sv->sdt.buf[0];
-  int length = sv->sdt.length;
+  uint8_t *buf = &sv->sdt->buf[0];
+  int length = sv->sdt->length;
   int i = 3;
 
   sv->tsid = (buf[i] << 8) | buf[i+1]; i += 2;
@@ -154,7 +154,7 @@ int process_sdt(struct service_t* sv)
   }
   if (sv->name == NULL) {
     // Not found, keep searching for other sections.
-    sv->sdt.length = 0;
+    sv->sdt->length = 0;
   }
   return 0;
 }
@@ -166,8 +166,8 @@ int bcd2dec(unsigned char buf)
 
 int process_pmt(struct service_t* sv)
 {
-  uint8_t *buf = &sv->pmt.buf[0];
-  int length = sv->pmt.length;
+  uint8_t *buf = &sv->pmt->buf[0];
+  int length = sv->pmt->length;
   int i = 3;
 
   int program_id = (buf[i] << 8) | buf[i+1]; i += 2;
@@ -175,6 +175,7 @@ int process_pmt(struct service_t* sv)
   int current_next_indicator = buf[i] & 0x01; i++;
   int section_number = buf[i++];
   int last_section_number = buf[i++];
+  sv->pmt_version = version_number;
   sv->pcr_pid = ((buf[i]&0x1f)<<8) | buf[i+1]; i+=2;
   int program_info_length = ((buf[i]&0x0f)<<8) | buf[i+1]; i+=2;
   //fprintf(stderr,"PMT program_info_length=%d\n",program_info_length);
@@ -225,9 +226,11 @@ int process_pmt(struct service_t* sv)
   return 0;
 }
 
-void process_section(struct section_t* next, struct section_t* curr, uint8_t* buf, int table_id)
+/* Returns -1 if a section was completed but failed its CRC */
+int process_section(struct section_t* next, struct section_t* curr, uint8_t* buf, int table_id)
 {
   int i,n;
+  int res = 0;
 
   int payload_unit_start_indicator = (buf[1]&0x40)>>6;
 
@@ -241,10 +244,10 @@ void process_section(struct section_t* next, struct section_t* curr, uint8_t* bu
         next->bytes_read = to_copy;
       } else {
         //fprintf(stderr,"Skipping table_id 0x%02x\n",buf[i]);
-        return;
+        return 0;
       }
     } else {
-      return;
+      return 0;
     }
   } else { 
     i = 4;
@@ -262,12 +265,13 @@ void process_section(struct section_t* next, struct section_t* curr, uint8_t* bu
     if (psi_crc32(&next->buf[0],next->length,0xffffffff)==0) {
       memcpy(curr, next, sizeof(struct section_t));
     } else {
-      fprintf(stderr,"CRC error, skipping section - table_id=0x%02x, length=%d\n",next->buf[0],next->length);
+      /* Skip the section - the caller counts the error */
+      res = -1;
     }
 
     memset(next, 0, sizeof(struct section_t));
   }
 
-  return;
+  return res;
 }
 
@@ -9,6 +9,6 @@ int process_sdt(struct service_t* sv);
 int bcd2dec(unsigned char buf);
 char* pts2hmsu(uint64_t pts,char sep);
 int process_pmt(struct service_t* sv);
-void process_section(struct section_t* next, struct section_t* curr, uint8_t* buf, int table_id);
+int process_section(struct section_t* next, struct section_t* curr, uint8_t* buf, int table_id);
 
 #endif
@@ -1,108 +1,355 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "dvb2dvb.h"
 #include "ringbuffer.h"
 
-/* A simple mutex-free ringbuffer.
+/* A lock-free single-producer/single-consumer ringbuffer.
 
-   The read thread only modifies the head pointer.
-   The write thread only modifies the tail pointer.
+   The read thread only modifies head (and its private fields).
+   The write thread only modifies tail (and its private fields).
 
-   One byte is always left empty to distinguish between an empty and
-   full buffer.
+   head and tail are free-running byte counts.  The writer publishes
+   new data with a release store to tail and the reader acquires it;
+   the reader releases space with a release store to head and the
+   writer acquires it.  Each side keeps a cached copy of the other
+   side's index and only reloads it (touching the other side's cache
+   line) when the cached value says there isn't enough data or space.
 
-   rb->head - the next byte to read
-   rb->tail - the next free location to write
+   The writer can batch publication: rb_commit() only stores tail once
+   at least rb->batch bytes are unpublished.  rb_flush() publishes
+   immediately.
+
+   The buffer is a memfd mapped twice, back-to-back, so reads and
+   writes never have to be split at the end of the buffer - a pointer
+   anywhere in the first mapping can be used for up to rb->size bytes.
+
+   A reader that has to wait for data either polls (RB_WAIT_POLL), or
+   parks on rb->cond (RB_WAIT_BLOCK), optionally after spinning for a
+   while first (RB_WAIT_HYBRID).  A parked reader publishes the fill
+   level it needs in rb->wake_level, and the writer only takes the
+   mutex and signals once that level has been reached.  The mutex is
+   never touched while data is flowing and the reader is not parked.
 
 */
 
-int rb_init(struct ringbuffer_t *rb)
+/* Longest a parked reader sleeps before re-checking the fill level.
+   This bounds the stall if the writer stops before reaching wake_level. */
+#define RB_PARK_TIMEOUT_NS 100000000
+
+#define RB_HUGEPAGE_SIZE (2*1024*1024)
+
+/* Map a memfd of size bytes twice, back-to-back.  Returns NULL on failure. */
+static uint8_t* rb_map(int size, int hugepages, int prefault)
+{
+  uint8_t *addr;
+  int populate = prefault ? MAP_POPULATE : 0;
+  int fd;
+
+  fd = memfd_create("dvb2dvb-ringbuffer", MFD_CLOEXEC | (hugepages ? MFD_HUGETLB : 0));
+  if (fd < 0)
+    return NULL;
+
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  /* Reserve address space for both mappings, then map the memfd over it */
+  addr = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  if ((mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | populate, fd, 0) == MAP_FAILED) ||
+      (mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | populate, fd, 0) == MAP_FAILED)) {
+    munmap(addr, 2 * (size_t)size);
+    close(fd);
+    return NULL;
+  }
+
+  close(fd);
+  return addr;
+}
+
+/* Create a ringbuffer holding at least size bytes.  The size is
+   rounded up to a whole number of (huge) pages. */
+int rb_init(struct ringbuffer_t *rb, int size, int flags)
 {
-  rb->head = rb->buf;
-  rb->tail = rb->buf;
+  pthread_condattr_t attr;
+  int pagesize = sysconf(_SC_PAGESIZE);
+
+  rb->buf = NULL;
+  if (flags & RB_HUGEPAGES) {
+    rb->size = (size + RB_HUGEPAGE_SIZE - 1) / RB_HUGEPAGE_SIZE * RB_HUGEPAGE_SIZE;
+    rb->buf = rb_map(rb->size, 1, flags & RB_PREFAULT);
+    if (rb->buf == NULL) {
+      fprintf(stderr,"WARNING: Could not allocate %d bytes of huge pages for ringbuffer, using normal pages\n",rb->size);
+    }
+  }
+
+  if (rb->buf == NULL) {
+    rb->size = (size + pagesize - 1) / pagesize * pagesize;
+    rb->buf = rb_map(rb->size, 0, flags & RB_PREFAULT);
+    if (rb->buf == NULL) {
+      perror("Could not allocate ringbuffer");
+      return -1;
+    }
+  }
+
+  atomic_init(&rb->head, 0);
+  atomic_init(&rb->tail, 0);
+  rb->cached_tail = 0;
+  rb->cached_head = 0;
+  rb->write_pos = 0;
+  rb->read_ptr = rb->buf;
+  rb->write_ptr = rb->buf;
+
+  rb->wait_mode = RB_WAIT_BLOCK;
+  rb->low_water = 0;
+  rb->batch = 0;
+  rb->spin = 0;
+  atomic_init(&rb->wake_level, 0);
+
+  pthread_mutex_init(&rb->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&rb->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
   return 0;
 }
 
+void rb_free(struct ringbuffer_t *rb)
+{
+  if (rb->buf) {
+    munmap(rb->buf, 2 * (size_t)rb->size);
+    rb->buf = NULL;
+  }
+  pthread_mutex_destroy(&rb->lock);
+  pthread_cond_destroy(&rb->cond);
+}
+
+/* Configure how the reader waits, and how often the writer publishes.
+   low_water and batch are in bytes.  Data committed but not yet
+   published is invisible to the reader, so a writer using a batch
+   larger than the reader's requests should rb_flush() before going
+   idle. */
+void rb_set_wait(struct ringbuffer_t *rb, int mode, int low_water, int batch, int spin)
+{
+  rb->wait_mode = mode;
+  rb->low_water = MIN(low_water, rb->size);
+  rb->batch = batch;
+  rb->spin = spin;
+}
+
+/* Approximate fill level, safe to call from any thread */
 int rb_get_bytes_used(struct ringbuffer_t* rb)
 {
-  return((rb->tail - rb->head) % sizeof(rb->buf));
+  uint64_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+
+  return (tail > head) ? (int)(tail - head) : 0;
 }
 
-int rb_read(struct ringbuffer_t *rb, uint8_t* buf, int count)
+/* Bytes the read thread can access.  Unlike rb_get_bytes_used(), tail
+   is loaded with acquire ordering, so every byte counted here is safe
+   to read.  Can only be called by the read thread. */
+int rb_get_bytes_available(struct ringbuffer_t* rb)
 {
-  //  fprintf(stderr,"rb_read - entering loop\n");
-  int bytes_used = rb_get_bytes_used(rb);
+  uint64_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+  rb->cached_tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  return (int)(rb->cached_tail - head);
+}
 
-  //fprintf(stderr,"rb_read(): count=%d, bytes_used=%d\n",count,bytes_used);
-  while (count >= bytes_used) {
-    usleep(10);
-    bytes_used = rb_get_bytes_used(rb);
-    //    fprintf(stderr,"rb_read(): count=%d, bytes_used=%d\n",count,bytes_used);
+/* Space available to the write thread */
+int rb_get_bytes_free(struct ringbuffer_t* rb)
+{
+  rb->cached_head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  return rb->size - (int)(rb->write_pos - rb->cached_head);
+}
+
+/* Bytes available to the read thread, reloading tail only if the
+   cached copy doesn't show at least count bytes */
+static int rb_avail(struct ringbuffer_t *rb, uint64_t head, int count)
+{
+  if ((int)(rb->cached_tail - head) < count)
+    rb->cached_tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  return (int)(rb->cached_tail - head);
+}
+
+/* Advance a read or write pointer, wrapping back into the first mapping */
+static uint8_t* rb_advance(struct ringbuffer_t *rb, uint8_t* p, int count)
+{
+  p += count;
+  if (p >= rb->buf + rb->size)
+    p -= rb->size;
+  return p;
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* Wait until at least count bytes are available.  Can only be called
+   by the read thread.  Returns -1 at once if count is more than the
+   buffer can ever hold. */
+int rb_wait(struct ringbuffer_t *rb, int count)
+{
+  int i;
+  uint64_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+
+  if (count > rb->size)
+    return -1;
+
+  if (rb_avail(rb, head, count) >= count)
+    return 0;
+
+  if (rb->wait_mode == RB_WAIT_POLL) {
+    while (rb_avail(rb, head, count) < count) {
+      usleep(10);
+    }
+    return 0;
   }
-  //fprintf(stderr,"rb_read - leaving loop\n");
-
-    //    fprintf(stderr,"rb->head=%p, count=%d, rb->buf=%p, sizeof(rb->buf)=%d\n",rb->head,count,rb->buf,(int)sizeof(rb->buf));
-    if (rb->head + count >= rb->buf + sizeof(rb->buf)) {
-      /* Two-part copy */
-      int n1 = sizeof(rb->buf) - (rb->head - rb->buf);
-      memcpy(buf,rb->head,n1);
-      memcpy(buf+n1,rb->buf,count-n1);
-      rb->head = rb->buf + count - n1;
-    } else {
-      /* Single copy */
-      memcpy(buf,rb->head,count);
-      rb->head += count;
+
+  if (rb->wait_mode == RB_WAIT_HYBRID) {
+    for (i = 0; i < rb->spin; i++) {
+      if (rb_avail(rb, head, count) >= count)
+        return 0;
+      cpu_relax();
+    }
+  }
+
+  int level = MIN(MAX(count, rb->low_water), rb->size);
+
+  pthread_mutex_lock(&rb->lock);
+  atomic_store_explicit(&rb->wake_level, level, memory_order_relaxed);
+  /* Pairs with the fence in rb_publish() - either we see the new tail,
+     or the writer sees our wake_level. */
+  atomic_thread_fence(memory_order_seq_cst);
+  while (rb_avail(rb, head, level) < level) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += RB_PARK_TIMEOUT_NS;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
     }
+    pthread_cond_timedwait(&rb->cond, &rb->lock, &ts);
+
+    /* Accept a partial fill after a timeout, as long as the caller's
+       request can be satisfied. */
+    if (rb_avail(rb, head, count) >= count)
+      break;
+  }
+  atomic_store_explicit(&rb->wake_level, 0, memory_order_relaxed);
+  pthread_mutex_unlock(&rb->lock);
+  return 0;
+}
+
+/* Publish everything committed so far, and wake a parked reader if
+   it now has enough data.  Called by the write thread. */
+static void rb_publish(struct ringbuffer_t *rb)
+{
+  atomic_store_explicit(&rb->tail, rb->write_pos, memory_order_release);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  int level = atomic_load_explicit(&rb->wake_level, memory_order_relaxed);
+  if (level && ((int)(rb->write_pos - atomic_load_explicit(&rb->head, memory_order_relaxed)) >= level)) {
+    pthread_mutex_lock(&rb->lock);
+    pthread_cond_signal(&rb->cond);
+    pthread_mutex_unlock(&rb->lock);
+  }
+}
+
+void rb_flush(struct ringbuffer_t *rb)
+{
+  if (rb->write_pos != atomic_load_explicit(&rb->tail, memory_order_relaxed))
+    rb_publish(rb);
+}
+
+int rb_read(struct ringbuffer_t *rb, uint8_t* buf, int count)
+{
+  if (rb_wait(rb, count) < 0)
+    return -1;
+
+  memcpy(buf,rb->read_ptr,count);
+  rb_consume(rb, count);
 
   return count;
 }
 
-/* skip count bytes in the buffer (i.e. read and discard)
+/* consume count bytes from the buffer (i.e. read and discard, or
+   release bytes previously returned by rb_peek).
    can only be called by the read thread.
-   caller is responsible for ensuring there are enough bytes in the buffer to skip.
+   caller is responsible for ensuring there are enough bytes in the buffer to consume.
 */
-int rb_skip(struct ringbuffer_t *rb, int count)
-{
-  if (rb->head + count >= rb->buf + sizeof(rb->buf)) {
-    /* Two-part copy */
-    int n1 = sizeof(rb->buf) - (rb->head - rb->buf);
-    rb->head = rb->buf + count - n1;
-  } else {
-    /* Single copy */
-    rb->head += count;
-  }
+int rb_consume(struct ringbuffer_t *rb, int count)
+{
+  rb->read_ptr = rb_advance(rb, rb->read_ptr, count);
+  atomic_store_explicit(&rb->head, atomic_load_explicit(&rb->head, memory_order_relaxed) + count, memory_order_release);
 
   return count;
 }
 
-int rb_write(struct ringbuffer_t *rb, uint8_t* buf, int count)
+/* Zero-copy access.
+
+   rb_peek() waits for count bytes and returns a pointer to them in
+   the buffer (or NULL if count is larger than the buffer).  They stay
+   in the buffer until the reader calls rb_consume().
+
+   rb_reserve() returns a pointer to count bytes of free space at the
+   tail, or NULL if there isn't enough space.  The writer fills them
+   and then publishes them with rb_commit().
+*/
+uint8_t* rb_peek(struct ringbuffer_t *rb, int count)
 {
-  int to_copy;
+  if (rb_wait(rb, count) < 0)
+    return NULL;
+  return rb->read_ptr;
+}
 
-  int bytes_used = (rb->tail - rb->head) % sizeof(rb->buf);
-  //fprintf(stderr,"bytes_used = %d\n",bytes_used);
+uint8_t* rb_reserve(struct ringbuffer_t *rb, int count)
+{
+  if ((count > rb->size - (int)(rb->write_pos - rb->cached_head)) &&
+      (count > rb_get_bytes_free(rb)))
+    return NULL;
+  return rb->write_ptr;
+}
+
+int rb_commit(struct ringbuffer_t *rb, int count)
+{
+  rb->write_ptr = rb_advance(rb, rb->write_ptr, count);
+  rb->write_pos += count;
+  if ((int)(rb->write_pos - atomic_load_explicit(&rb->tail, memory_order_relaxed)) >= rb->batch)
+    rb_publish(rb);
+
+  return count;
+}
 
-  if (bytes_used + count >= (int)sizeof(rb->buf)) {
-    to_copy = sizeof(rb->buf) - bytes_used - 1;
-  } else {
-    to_copy = count;
+int rb_write(struct ringbuffer_t *rb, uint8_t* buf, int count)
+{
+  int to_copy = count;
+
+  if (count > rb->size - (int)(rb->write_pos - rb->cached_head)) {
+    int bytes_free = rb_get_bytes_free(rb);
+    to_copy = MIN(count, bytes_free);
   }
+
   //fprintf(stderr,"to_copy=%d, requested=%d\n",to_copy,count);
   if (to_copy) {
-    //fprintf(stderr,"rb->tail=%p, to_copy=%d, rb->buf=%p, sizeof(rb->buf)=%d\n",rb->tail,to_copy,rb->buf,(int)sizeof(rb->buf));
-    if (rb->tail + to_copy >= rb->buf + sizeof(rb->buf)) {
-      /* Two-part copy */
-      int n1 = sizeof(rb->buf) - (rb->tail - rb->buf);
-      memcpy(rb->tail,buf,n1);
-      memcpy(rb->buf,buf+n1,to_copy-n1);
-      rb->tail = rb->buf + to_copy - n1;
-    } else {
-      /* Single copy */
-      memcpy(rb->tail,buf,to_copy);
-      rb->tail += to_copy;
-    }
+    memcpy(rb->write_ptr,buf,to_copy);
+    rb_commit(rb, to_copy);
   }
 
   return to_copy;
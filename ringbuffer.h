@@ -1,16 +1,69 @@
 #ifndef _RINGBUFFER_H
 #define _RINGBUFFER_H
 
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* How a reader waits for data in rb_read()/rb_wait() */
+#define RB_WAIT_POLL    0  /* usleep() polling loop */
+#define RB_WAIT_BLOCK   1  /* Park on a condition variable until the writer wakes us */
+#define RB_WAIT_HYBRID  2  /* Spin for a while, then park */
+
+/* rb_init() flags */
+#define RB_HUGEPAGES    1  /* Try to back the buffer with huge pages */
+#define RB_PREFAULT     2  /* Allocate the pages now, on the calling thread's NUMA node */
+
+#define RB_CACHELINE    64
+
+/* head and tail are free-running byte counts, so the buffer holds
+   tail - head bytes and can be completely filled.  Each thread's
+   fields are padded onto their own cache line so the reader and
+   writer don't false-share. */
 struct ringbuffer_t {
-  uint8_t*  head;
-  uint8_t*  tail;
-  uint8_t   buf[15*1024*1024];
+  /* Read thread */
+  _Atomic uint64_t head;    /* Bytes consumed - published to the writer */
+  uint64_t cached_tail;     /* Reader's last view of tail */
+  uint8_t* read_ptr;        /* Address of byte "head" */
+  uint8_t  pad0[RB_CACHELINE - 2*sizeof(uint64_t) - sizeof(uint8_t*)];
+
+  /* Write thread */
+  _Atomic uint64_t tail;    /* Bytes published to the reader */
+  uint64_t write_pos;       /* Bytes committed, published to tail every "batch" bytes */
+  uint64_t cached_head;     /* Writer's last view of head */
+  uint8_t* write_ptr;       /* Address of byte "write_pos" */
+  uint8_t  pad1[RB_CACHELINE - 3*sizeof(uint64_t) - sizeof(uint8_t*)];
+
+  /* Blocking wait state */
+  _Atomic int wake_level;   /* Fill level a parked reader is waiting for, 0 if none */
+  uint8_t  pad2[RB_CACHELINE - sizeof(int)];
+  int wait_mode;
+  int low_water;            /* A parked reader is not woken until this many bytes are available */
+  int batch;                /* The writer publishes its tail (and looks for a parked reader) every "batch" bytes */
+  int spin;                 /* Number of polls before parking in RB_WAIT_HYBRID mode */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* The size bytes at buf are mapped a second time at buf+size, so
+     any span of up to size bytes starting inside the buffer is
+     contiguous in memory. */
+  uint8_t*  buf;
+  int       size;
 };
 
-int rb_init(struct ringbuffer_t *rb);
+int rb_init(struct ringbuffer_t *rb, int size, int flags);
+void rb_free(struct ringbuffer_t *rb);
+void rb_set_wait(struct ringbuffer_t *rb, int mode, int low_water, int batch, int spin);
+int rb_wait(struct ringbuffer_t *rb, int count);
 int rb_write(struct ringbuffer_t *rb, uint8_t* buf, int count);
 int rb_read(struct ringbuffer_t *rb, uint8_t* buf, int count);
-int rb_skip(struct ringbuffer_t *rb, int count);
+int rb_consume(struct ringbuffer_t *rb, int count);
+uint8_t* rb_reserve(struct ringbuffer_t *rb, int count);
+int rb_commit(struct ringbuffer_t *rb, int count);
+void rb_flush(struct ringbuffer_t *rb);
+uint8_t* rb_peek(struct ringbuffer_t *rb, int count);
 int rb_get_bytes_used(struct ringbuffer_t* rb);
+int rb_get_bytes_available(struct ringbuffer_t* rb);
+int rb_get_bytes_free(struct ringbuffer_t* rb);
 
 #endif
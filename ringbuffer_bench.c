@@ -0,0 +1,269 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* Ringbuffer benchmarks.
+
+   Throughput: a producer thread writes numbered TS packets as fast as
+   it can and a consumer thread reads and checks them, for each reader
+   wait mode and publish batch.
+
+   CPU per service: PACED_SERVICES producer threads each write a
+   PACED_BITRATE stream in curl-sized chunks, and a consumer per ring
+   reads it a packet at a time, as the mux thread does.  The consumers'
+   CPU time shows what waiting for input costs in each mode - RB_WAIT_POLL
+   is the old usleep(10) loop.
+
+   Build with "make ringbuffer_bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "ringbuffer.h"
+
+#define RING_SIZE (4*1024*1024)
+#define CHUNK_PACKETS 7          /* One UDP datagram's worth */
+#define RUN_SECONDS 0.5
+
+#define PACED_SERVICES 30
+#define PACED_BITRATE 5000000
+#define PACED_CHUNK 16384        /* Bytes per write, as curl delivers them */
+#define PACED_SECONDS 2.0
+#define PACED_WAKE_LEVEL (188*128)
+
+struct bench_t {
+  struct ringbuffer_t rb;
+  _Atomic int stop;
+  uint64_t packets;
+  uint64_t errors;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* producer(void* userp)
+{
+  struct bench_t* b = userp;
+  uint64_t seq = 0;
+  int i;
+
+  while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+    uint8_t* p = rb_reserve(&b->rb, CHUNK_PACKETS * 188);
+    if (p == NULL) {
+      sched_yield();
+      continue;
+    }
+    for (i = 0; i < CHUNK_PACKETS; i++) {
+      p[i*188] = 0x47;
+      memcpy(p + i*188 + 4, &seq, sizeof(seq));
+      seq++;
+    }
+    rb_commit(&b->rb, CHUNK_PACKETS * 188);
+  }
+
+  /* Enough to release a consumer waiting for one more chunk */
+  uint8_t* p;
+  while ((p = rb_reserve(&b->rb, CHUNK_PACKETS * 188)) == NULL)
+    sched_yield();
+  memset(p, 0, CHUNK_PACKETS * 188);
+  rb_commit(&b->rb, CHUNK_PACKETS * 188);
+  rb_flush(&b->rb);
+  return NULL;
+}
+
+static void* consumer(void* userp)
+{
+  struct bench_t* b = userp;
+  uint64_t seq = 0;
+  int i;
+
+  while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+    uint8_t* p = rb_peek(&b->rb, CHUNK_PACKETS * 188);
+    for (i = 0; i < CHUNK_PACKETS; i++) {
+      uint64_t got;
+      memcpy(&got, p + i*188 + 4, sizeof(got));
+      if ((p[i*188] != 0x47) || (got != seq)) {
+        if (atomic_load_explicit(&b->stop, memory_order_relaxed))
+          break;
+        b->errors++;
+        seq = got;
+      }
+      seq++;
+    }
+    rb_consume(&b->rb, CHUNK_PACKETS * 188);
+  }
+  b->packets = seq;
+  return NULL;
+}
+
+struct paced_t {
+  struct ringbuffer_t rb;
+  _Atomic int stop;
+  double cpu;
+};
+
+static double thread_cpu(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* paced_producer(void* userp)
+{
+  struct paced_t* s = userp;
+  struct timespec next;
+  long interval_ns = (long)((double)PACED_CHUNK * 8 / PACED_BITRATE * 1e9);
+  uint8_t* p;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!atomic_load_explicit(&s->stop, memory_order_relaxed)) {
+    if ((p = rb_reserve(&s->rb, PACED_CHUNK)) != NULL) {
+      memset(p, 0x47, PACED_CHUNK);
+      rb_commit(&s->rb, PACED_CHUNK);
+      rb_flush(&s->rb);
+    }
+    next.tv_nsec += interval_ns;
+    while (next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+
+  /* Release the consumer if it is waiting */
+  while ((p = rb_reserve(&s->rb, PACED_WAKE_LEVEL)) == NULL)
+    sched_yield();
+  rb_commit(&s->rb, PACED_WAKE_LEVEL);
+  rb_flush(&s->rb);
+  return NULL;
+}
+
+static void* paced_consumer(void* userp)
+{
+  struct paced_t* s = userp;
+  double cpu0 = thread_cpu();
+
+  while (!atomic_load_explicit(&s->stop, memory_order_relaxed)) {
+    rb_peek(&s->rb, 188);
+    rb_consume(&s->rb, 188);
+  }
+  s->cpu = thread_cpu() - cpu0;
+  return NULL;
+}
+
+static void cpu_per_service(void)
+{
+  static const char* mode_names[] = { "poll", "block", "hybrid" };
+  struct paced_t* s = calloc(PACED_SERVICES, sizeof(struct paced_t));
+  pthread_t* threads = calloc(2 * PACED_SERVICES, sizeof(pthread_t));
+  int mode, i;
+
+  if (!(s && threads))
+    return;
+
+  printf("\nCPU per service: %d services at %.1f Mbit/s, read a packet at a time\n",
+         PACED_SERVICES, PACED_BITRATE / 1e6);
+  printf("%-8s %16s\n", "wait", "consumer CPU %");
+  for (mode = RB_WAIT_POLL; mode <= RB_WAIT_HYBRID; mode++) {
+    double t0, cpu = 0;
+
+    memset(s, 0, PACED_SERVICES * sizeof(struct paced_t));
+    for (i = 0; i < PACED_SERVICES; i++) {
+      if (rb_init(&s[i].rb, 4*1024*1024, 0) < 0)
+        return;
+      rb_set_wait(&s[i].rb, mode, PACED_WAKE_LEVEL, 0, 1000);
+    }
+    t0 = now();
+    for (i = 0; i < PACED_SERVICES; i++) {
+      pthread_create(&threads[2*i], NULL, paced_consumer, &s[i]);
+      pthread_create(&threads[2*i+1], NULL, paced_producer, &s[i]);
+    }
+    while (now() - t0 < PACED_SECONDS)
+      usleep(10000);
+    for (i = 0; i < PACED_SERVICES; i++)
+      atomic_store(&s[i].stop, 1);
+    for (i = 0; i < 2 * PACED_SERVICES; i++)
+      pthread_join(threads[i], NULL);
+    t0 = now() - t0;
+
+    for (i = 0; i < PACED_SERVICES; i++) {
+      cpu += s[i].cpu;
+      rb_free(&s[i].rb);
+    }
+    printf("%-8s %15.2f%%\n", mode_names[mode], 100 * cpu / PACED_SERVICES / t0);
+  }
+
+  free(s);
+  free(threads);
+}
+
+int main(void)
+{
+  static const char* mode_names[] = { "poll", "block", "hybrid" };
+  static int batches[] = { 1, 20 };
+  int mode, k;
+  int errors = 0;
+
+  printf("%-8s %14s %10s %12s\n", "wait", "publish batch", "GB/s", "Mpackets/s");
+  for (mode = RB_WAIT_POLL; mode <= RB_WAIT_HYBRID; mode++) {
+    for (k = 0; k < (int)(sizeof(batches) / sizeof(batches[0])); k++) {
+      struct bench_t b;
+      pthread_t pt, ct;
+      double t0, t;
+
+      memset(&b, 0, sizeof(b));
+      if (rb_init(&b.rb, RING_SIZE, 0) < 0)
+        return 1;
+      rb_set_wait(&b.rb, mode, CHUNK_PACKETS * 188, batches[k] * 188, 1000);
+
+      t0 = now();
+      pthread_create(&ct, NULL, consumer, &b);
+      pthread_create(&pt, NULL, producer, &b);
+      while (now() - t0 < RUN_SECONDS)
+        usleep(10000);
+      atomic_store(&b.stop, 1);
+      pthread_join(pt, NULL);
+      pthread_join(ct, NULL);
+      t = now() - t0;
+
+      printf("%-8s %8d pkts %10.2f %12.2f%s\n", mode_names[mode], batches[k],
+             b.packets * 188 / t / 1e9, b.packets / t / 1e6,
+             b.errors ? "  DATA ERRORS" : "");
+      errors += b.errors;
+      rb_free(&b.rb);
+    }
+  }
+
+  cpu_per_service();
+
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "cpuset.h"
+#include "rtsched.h"
+
+/* Real-time scheduling for the timing-critical threads.
+
+   Each thread applies its own class's settings when it starts, rather
+   than having them set at pthread_create(), so that a thread that isn't
+   allowed real-time priority still runs - and says so.  Everything is
+   read back after being set, so the log shows what was really applied:
+   without CAP_SYS_NICE (or a large enough RLIMIT_RTPRIO) the policy
+   silently stays SCHED_OTHER, and CPUs outside the cpuset are
+   dropped. */
+
+int rt_parse_policy(const char* s)
+{
+  if (!strcmp(s,"fifo")) return SCHED_FIFO;
+  if (!strcmp(s,"rr")) return SCHED_RR;
+  if (!strcmp(s,"other")) return SCHED_OTHER;
+  return -1;
+}
+
+static char* policy_name(int policy)
+{
+  switch (policy) {
+    case SCHED_FIFO: return "SCHED_FIFO";
+    case SCHED_RR: return "SCHED_RR";
+    case SCHED_OTHER: return "SCHED_OTHER";
+    default: return "unknown";
+  }
+}
+
+int rt_apply(const char* name, struct thread_sched_t* ts)
+{
+  pthread_t self = pthread_self();
+  struct sched_param param;
+  cpu_set_t want, got;
+  char want_text[256], got_text[256];
+  int want_policy = ts->policy;
+  int policy;
+  int ok = 1;
+  int error;
+
+  /* A priority on its own means SCHED_FIFO */
+  if ((want_policy == SCHED_OTHER) && ts->priority)
+    want_policy = SCHED_FIFO;
+
+  if ((want_policy == SCHED_OTHER) && (ts->cpus == NULL))
+    return 0;
+
+  if (ts->cpus) {
+    if (cpuset_parse(ts->cpus, &want) < 0) {
+      fprintf(stderr,"RT check: %s: invalid CPU list \"%s\"\n",name,ts->cpus);
+      return -1;
+    }
+    error = pthread_setaffinity_np(self, sizeof(want), &want);
+    if (error)
+      fprintf(stderr,"RT check: %s: could not set CPUs %s - %s\n",name,ts->cpus,strerror(error));
+  }
+
+  if (want_policy != SCHED_OTHER) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = ts->priority;
+    error = pthread_setschedparam(self, want_policy, &param);
+    if (error) {
+      struct rlimit rl;
+      getrlimit(RLIMIT_RTPRIO, &rl);
+      fprintf(stderr,"RT check: %s: could not set %s priority %d - %s (RLIMIT_RTPRIO is %ld, CAP_SYS_NICE is needed above it)\n",
+              name,policy_name(want_policy),ts->priority,strerror(error),(long)rl.rlim_cur);
+    }
+  }
+
+  /* Self-check - report what the thread actually has */
+  pthread_getschedparam(self, &policy, &param);
+  if ((want_policy != SCHED_OTHER) && ((policy != want_policy) || (param.sched_priority != ts->priority)))
+    ok = 0;
+
+  pthread_getaffinity_np(self, sizeof(got), &got);
+  cpuset_format(&got, got_text, sizeof(got_text));
+  if (ts->cpus && !CPU_EQUAL(&want, &got))
+    ok = 0;
+
+  if (ts->cpus)
+    cpuset_format(&want, want_text, sizeof(want_text));
+  fprintf(stderr,"RT check: %s: %s priority %d on CPUs %s - %s",name,policy_name(policy),param.sched_priority,got_text,ok ? "OK\n" : "NOT as requested (");
+  if (!ok)
+    fprintf(stderr,"%s priority %d on CPUs %s)\n",policy_name(want_policy),ts->priority,ts->cpus ? want_text : got_text);
+
+  return ok ? 0 : -1;
+}
+
+int rt_lock_memory(void)
+{
+  struct rlimit rl;
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    int error = errno;
+    getrlimit(RLIMIT_MEMLOCK, &rl);
+    fprintf(stderr,"RT check: mlockall failed - %s (RLIMIT_MEMLOCK is %ld KB)\n",strerror(error),
+            rl.rlim_cur == RLIM_INFINITY ? -1L : (long)(rl.rlim_cur / 1024));
+    return -1;
+  }
+
+  fprintf(stderr,"RT check: memory locked - OK\n");
+  return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef _RTSCHED_H
+#define _RTSCHED_H
+
+/* Scheduling for one class of thread (ingest, mux or output) */
+struct thread_sched_t {
+  int policy;     /* SCHED_FIFO or SCHED_RR, SCHED_OTHER (0) to leave alone */
+  int priority;   /* 1-99 for the real-time policies, SCHED_FIFO if no policy is given */
+  char* cpus;     /* CPU list, NULL to keep the mux's CPUs */
+};
+
+/* Parse "fifo", "rr" or "other", returns -1 if unknown */
+int rt_parse_policy(const char* s);
+
+/* Apply ts to the calling thread, then check what it actually got and
+   report it.  Returns 0 if everything requested was applied. */
+int rt_apply(const char* name, struct thread_sched_t* ts);
+
+/* Lock all current and future memory (so the ringbuffers never page
+   fault) and report the result.  Returns 0 on success. */
+int rt_lock_memory(void);
+
+#endif
@@ -0,0 +1,431 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dvb2dvb.h"
+#include "tr101290.h"
+#include "latency.h"
+#include "stats.h"
+
+/* Live statistics for a mux.
+
+   The mux thread publishes its counters a few times a second into a
+   statistics page (stats_update).  If the mux has a stats_shm name the
+   page is a POSIX shared memory object, so other processes can map it
+   read-only and watch the mux without any cost to it.  If it has a
+   stats_port, a thread here serves the page (and the TR 101 290
+   results and latency histograms) as Prometheus text on that port -
+   scrapes only ever read the page, and never wait for the mux thread. */
+
+static int window_secs[STATS_WINDOWS] = { 1, 10, 60 };
+static char* psi_names[STATS_PSI_TYPES] = { "pat", "pmt", "sdt", "nit", "ait" };
+static char* error_names[TSERR_COUNT] = { "cc", "sync", "tei", "pcr_gap", "crc" };  /* In TSERR_ order */
+
+static int64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Copy a new version of a block into the page.  There is a single
+   writer, so the sequence count needs no locked instructions. */
+static void stats_write_block(_Atomic uint32_t* seq, void* dst, void* src, int size)
+{
+  uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+
+  atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy((uint8_t*)dst + sizeof(*seq), (uint8_t*)src + sizeof(*seq), size - sizeof(*seq));
+  atomic_store_explicit(seq, s + 2, memory_order_release);
+}
+
+void stats_read_block(void* dst, void* src, int size)
+{
+  _Atomic uint32_t* seq = src;
+  uint32_t s1, s2;
+
+  do {
+    while ((s1 = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+      sched_yield();
+    memcpy(dst, src, size);
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(seq, memory_order_relaxed);
+  } while (s1 != s2);
+}
+
+static uint32_t high_water(uint32_t* hw, uint32_t used)
+{
+  if (used > *hw)
+    *hw = used;
+  return *hw;
+}
+
+void stats_update(struct stats_t* st, int64_t output_bitpos, int64_t padding_bits, uint64_t* psi_sections)
+{
+  struct mux_t* m = st->m;
+  struct stats_page_t* page = st->page;
+  struct stats_mux_t mux;
+  struct stats_service_t svs;
+  int64_t now = now_ms();
+  int i, j;
+
+  /* Take a sample for the padding windows once a second */
+  if (now >= st->next_sample_ms) {
+    memmove(st->bytes_hist + 1, st->bytes_hist, sizeof(st->bytes_hist) - sizeof(st->bytes_hist[0]));
+    memmove(st->padding_hist + 1, st->padding_hist, sizeof(st->padding_hist) - sizeof(st->padding_hist[0]));
+    st->bytes_hist[0] = output_bitpos / 8;
+    st->padding_hist[0] = padding_bits / 8;
+    if (st->nhist < STATS_HISTORY)
+      st->nhist++;
+    st->next_sample_ms = (st->next_sample_ms ? st->next_sample_ms : now) + 1000;
+  }
+
+  memcpy(&mux, &page->mux, sizeof(mux));
+  mux.bytes_out = output_bitpos / 8;
+  mux.padding_bytes = padding_bits / 8;
+  mux.outbuf_used = rb_get_bytes_used(&m->outbuf);
+  high_water(&mux.outbuf_high_water, mux.outbuf_used);
+  for (i = 0; i < STATS_WINDOWS; i++) {
+    /* Until the window has filled, use as much history as there is */
+    j = MIN(window_secs[i], st->nhist - 1);
+    uint64_t bytes = st->bytes_hist[0] - st->bytes_hist[j];
+    uint64_t padding = st->padding_hist[0] - st->padding_hist[j];
+    mux.padding_ratio[i] = bytes ? (double)padding / (double)bytes : 0.0;
+  }
+  memcpy(mux.psi_sections, psi_sections, sizeof(mux.psi_sections));
+  stats_write_block(&page->mux.seq, &page->mux, &mux, sizeof(mux));
+
+  for (i = 0; i < m->nservices; i++) {
+    struct service_t* sv = &m->services[i];
+    struct ts_errors_t* errors[2] = { sv->errors, sv->ingest_errors };
+
+    memcpy(&svs, &page->services[i], sizeof(svs));
+    svs.inbuf_used = rb_get_bytes_used(&sv->inbuf);
+    high_water(&svs.inbuf_high_water, svs.inbuf_used);
+    svs.bytes_in = atomic_load_explicit(&sv->bytes_in, memory_order_relaxed);
+    svs.packets_filtered = atomic_load_explicit(&sv->packets_filtered, memory_order_relaxed);
+    svs.packets_out = sv->packets_out;
+    for (j = 0; j < TSERR_COUNT; j++)
+      svs.errors[j] = ts_errors_count(errors, 2, j);
+    svs.pcr_delta = sv->pcr_delta;
+    svs.pcr_delta_max = sv->pcr_delta_max;
+    stats_write_block(&page->services[i].seq, &page->services[i], &svs, sizeof(svs));
+  }
+}
+
+/* Prometheus text exposition */
+
+struct stats_text_t {
+  char* buf;
+  int len;
+  int size;
+};
+
+/* Appends to t->buf - on allocation failure t->buf becomes NULL */
+static void out(struct stats_text_t* t, const char* fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  while (t->buf) {
+    va_start(ap, fmt);
+    n = vsnprintf(t->buf + t->len, t->size - t->len, fmt, ap);
+    va_end(ap);
+    if (n < t->size - t->len)
+      break;
+    t->size *= 2;
+    char* buf = realloc(t->buf, t->size);
+    if (buf == NULL)
+      free(t->buf);
+    t->buf = buf;
+  }
+  if (t->buf)
+    t->len += n;
+}
+
+static void help(struct stats_text_t* t, char* name, char* type, char* text)
+{
+  out(t, "# HELP dvb2dvb_%s %s\n# TYPE dvb2dvb_%s %s\n", name, text, name, type);
+}
+
+static void stats_format(struct stats_t* st, struct stats_text_t* t)
+{
+  struct stats_mux_t mux;
+  struct stats_service_t* svs;
+  int n = st->page->nservices;
+  int i, j;
+
+  stats_read_block(&mux, &st->page->mux, sizeof(mux));
+  svs = malloc(n * sizeof(struct stats_service_t));
+  if (svs == NULL) {
+    fprintf(stderr,"WARNING: Could not allocate stats for %d services\n",n);
+    return;
+  }
+  for (i = 0; i < n; i++)
+    stats_read_block(&svs[i], &st->page->services[i], sizeof(struct stats_service_t));
+
+#define MUX_LABEL "mux=\"%u\""
+#define SERVICE_LABELS "mux=\"%u\",service=\"%u\""
+
+  help(t, "output_capacity_bits_per_second", "gauge", "Output channel capacity.");
+  out(t, "dvb2dvb_output_capacity_bits_per_second{" MUX_LABEL "} %u\n", mux.tsid, mux.channel_capacity);
+  help(t, "output_bytes_total", "counter", "Bytes muxed, including padding.");
+  out(t, "dvb2dvb_output_bytes_total{" MUX_LABEL "} %llu\n", mux.tsid, (unsigned long long)mux.bytes_out);
+  help(t, "output_padding_bytes_total", "counter", "Null packet bytes muxed.");
+  out(t, "dvb2dvb_output_padding_bytes_total{" MUX_LABEL "} %llu\n", mux.tsid, (unsigned long long)mux.padding_bytes);
+  help(t, "output_padding_ratio", "gauge", "Fraction of the output that was padding.");
+  for (i = 0; i < STATS_WINDOWS; i++)
+    out(t, "dvb2dvb_output_padding_ratio{" MUX_LABEL ",window=\"%ds\"} %.6f\n", mux.tsid, window_secs[i], mux.padding_ratio[i]);
+  help(t, "outbuf_bytes", "gauge", "Output ringbuffer fill.");
+  out(t, "dvb2dvb_outbuf_bytes{" MUX_LABEL "} %u\n", mux.tsid, mux.outbuf_used);
+  help(t, "outbuf_high_water_bytes", "gauge", "Highest output ringbuffer fill seen.");
+  out(t, "dvb2dvb_outbuf_high_water_bytes{" MUX_LABEL "} %u\n", mux.tsid, mux.outbuf_high_water);
+  help(t, "outbuf_size_bytes", "gauge", "Output ringbuffer size.");
+  out(t, "dvb2dvb_outbuf_size_bytes{" MUX_LABEL "} %u\n", mux.tsid, mux.outbuf_size);
+  help(t, "psi_sections_total", "counter", "PSI/SI table insertions.");
+  for (i = 0; i < STATS_PSI_TYPES; i++)
+    out(t, "dvb2dvb_psi_sections_total{" MUX_LABEL ",table=\"%s\"} %llu\n", mux.tsid, psi_names[i], (unsigned long long)mux.psi_sections[i]);
+
+  help(t, "input_bytes_total", "counter", "Bytes received for the service.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_input_bytes_total{" SERVICE_LABELS "} %llu\n", mux.tsid, svs[i].id, (unsigned long long)svs[i].bytes_in);
+  help(t, "input_filtered_packets_total", "counter", "Input packets dropped by the PID filter.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_input_filtered_packets_total{" SERVICE_LABELS "} %llu\n", mux.tsid, svs[i].id, (unsigned long long)svs[i].packets_filtered);
+  help(t, "output_packets_total", "counter", "Packets muxed from the service.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_output_packets_total{" SERVICE_LABELS "} %llu\n", mux.tsid, svs[i].id, (unsigned long long)svs[i].packets_out);
+  help(t, "inbuf_bytes", "gauge", "Input ringbuffer fill.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_inbuf_bytes{" SERVICE_LABELS "} %u\n", mux.tsid, svs[i].id, svs[i].inbuf_used);
+  help(t, "inbuf_high_water_bytes", "gauge", "Highest input ringbuffer fill seen.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_inbuf_high_water_bytes{" SERVICE_LABELS "} %u\n", mux.tsid, svs[i].id, svs[i].inbuf_high_water);
+  help(t, "inbuf_size_bytes", "gauge", "Input ringbuffer size.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_inbuf_size_bytes{" SERVICE_LABELS "} %u\n", mux.tsid, svs[i].id, svs[i].inbuf_size);
+  help(t, "input_errors_total", "counter", "Errors found in the input.");
+  for (i = 0; i < n; i++)
+    for (j = 0; j < TSERR_COUNT; j++)
+      out(t, "dvb2dvb_input_errors_total{" SERVICE_LABELS ",type=\"%s\"} %llu\n", mux.tsid, svs[i].id, error_names[j], (unsigned long long)svs[i].errors[j]);
+  help(t, "pcr_delta_ticks", "gauge", "27MHz ticks between the last two input PCRs.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_pcr_delta_ticks{" SERVICE_LABELS "} %lld\n", mux.tsid, svs[i].id, (long long)svs[i].pcr_delta);
+  help(t, "pcr_delta_max_ticks", "gauge", "Largest gap seen between input PCRs.");
+  for (i = 0; i < n; i++)
+    out(t, "dvb2dvb_pcr_delta_max_ticks{" SERVICE_LABELS "} %lld\n", mux.tsid, svs[i].id, (long long)svs[i].pcr_delta_max);
+
+  if (st->m->analyser) {
+    struct tr101290_snapshot_t s;
+    tr101290_snapshot(st->m->analyser, &s);
+    help(t, "tr101290_checks_total", "counter", "TR 101 290 checks made on the output.");
+    for (i = 0; i < TR_COUNT; i++)
+      out(t, "dvb2dvb_tr101290_checks_total{" MUX_LABEL ",check=\"%s\"} %llu\n", mux.tsid, tr101290_name(i), (unsigned long long)s.checks[i]);
+    help(t, "tr101290_errors_total", "counter", "TR 101 290 errors found in the output.");
+    for (i = 0; i < TR_COUNT; i++)
+      out(t, "dvb2dvb_tr101290_errors_total{" MUX_LABEL ",check=\"%s\"} %llu\n", mux.tsid, tr101290_name(i), (unsigned long long)s.errors[i]);
+    help(t, "tr101290_max_pcr_error_ns", "gauge", "Largest PCR accuracy error seen.");
+    out(t, "dvb2dvb_tr101290_max_pcr_error_ns{" MUX_LABEL "} %lld\n", mux.tsid, (long long)s.max_pcr_error_ns);
+    help(t, "tr101290_skipped_bytes_total", "counter", "Output the analyser was too far behind to check.");
+    out(t, "dvb2dvb_tr101290_skipped_bytes_total{" MUX_LABEL "} %llu\n", mux.tsid, (unsigned long long)s.bytes_skipped);
+  }
+
+  if (st->m->latency) {
+    static double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    help(t, "latency_seconds", "summary", "Time sampled packets took through each stage.");
+    for (i = 0; i < LAT_STAGES; i++) {
+      struct lat_hist_t* h = &st->m->latency->hist[i];
+      char* stage = latency_stage_name(i);
+      for (j = 0; j < 4; j++)
+        out(t, "dvb2dvb_latency_seconds{" MUX_LABEL ",stage=\"%s\",quantile=\"%g\"} %.6f\n", mux.tsid, stage, quantiles[j], lat_hist_percentile(h, quantiles[j] * 100) / 1e6);
+      out(t, "dvb2dvb_latency_seconds_sum{" MUX_LABEL ",stage=\"%s\"} %.6f\n", mux.tsid, stage, atomic_load_explicit(&h->sum_us, memory_order_relaxed) / 1e6);
+      out(t, "dvb2dvb_latency_seconds_count{" MUX_LABEL ",stage=\"%s\"} %llu\n", mux.tsid, stage, (unsigned long long)atomic_load_explicit(&h->count, memory_order_relaxed));
+    }
+  }
+
+  free(svs);
+}
+
+/* One request per connection - read (and ignore) the request and
+   reply with the current metrics. */
+static void stats_serve(struct stats_t* st, int fd)
+{
+  struct stats_text_t t;
+  char req[1024];
+  int res, done;
+  char* hdr = "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Connection: close\r\n\r\n";
+
+  struct timeval tv = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  res = recv(fd, req, sizeof(req), 0);
+  if (res <= 0)
+    return;
+
+  t.size = 16384;
+  t.len = 0;
+  t.buf = malloc(t.size);
+  out(&t, "%s", hdr);
+  stats_format(st, &t);
+  if (t.buf == NULL) {
+    fprintf(stderr,"WARNING: Could not allocate stats reply\n");
+    return;
+  }
+
+  for (done = 0; done < t.len; done += res) {
+    res = send(fd, t.buf + done, t.len - done, MSG_NOSIGNAL);
+    if (res <= 0)
+      break;
+  }
+  free(t.buf);
+}
+
+static void* stats_thread(void* userp)
+{
+  struct stats_t* st = userp;
+
+  while (1) {
+    int fd = accept(st->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR)
+        fprintf(stderr,"WARNING: stats exporter accept() failed, errno %d\n",errno);
+      continue;
+    }
+    stats_serve(st, fd);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+static int stats_listen(struct stats_t* st, int port)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+
+  st->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (st->listen_fd < 0)
+    return -1;
+  setsockopt(st->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((bind(st->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(st->listen_fd, 8) < 0)) {
+    fprintf(stderr,"Could not listen on port %d for stats, errno %d\n",port,errno);
+    close(st->listen_fd);
+    return -1;
+  }
+
+  int error = pthread_create(&st->threadid, NULL, stats_thread, (void *)st);
+  if (error) {
+    fprintf(stderr,"Couldn't create stats exporter thread, errno %d\n",error);
+    close(st->listen_fd);
+    return -1;
+  }
+
+  fprintf(stderr,"Serving stats on http://127.0.0.1:%d/metrics\n",port);
+  return 0;
+}
+
+/* Called by the mux thread when it stops.  The page stays mapped for
+   the exporter, but the shared memory object's name is removed. */
+void stats_stop(struct stats_t* st)
+{
+  if ((st->m->stats_shm) && (shm_unlink(st->m->stats_shm) < 0))
+    fprintf(stderr,"Could not remove shared memory %s, errno %d\n",st->m->stats_shm,errno);
+}
+
+/* Called by the mux thread once the ringbuffers have been created */
+struct stats_t* stats_create(struct mux_t* m)
+{
+  struct stats_t* st = calloc(1, sizeof(struct stats_t));
+  int i;
+
+  st->m = m;
+  st->size = sizeof(struct stats_page_t) + m->nservices * sizeof(struct stats_service_t);
+
+  if (m->stats_shm) {
+    int fd = shm_open(m->stats_shm, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr,"Could not create shared memory %s, errno %d\n",m->stats_shm,errno);
+      free(st);
+      return NULL;
+    }
+    if (ftruncate(fd, st->size) < 0) {
+      fprintf(stderr,"Could not size shared memory %s, errno %d\n",m->stats_shm,errno);
+      close(fd);
+      free(st);
+      return NULL;
+    }
+    st->page = mmap(NULL, st->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  } else {
+    st->page = mmap(NULL, st->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (st->page == MAP_FAILED) {
+    fprintf(stderr,"Could not map stats page, errno %d\n",errno);
+    free(st);
+    return NULL;
+  }
+
+  st->page->version = STATS_VERSION;
+  st->page->nservices = m->nservices;
+  st->page->pid = getpid();
+  st->page->mux.tsid = m->tsid;
+  st->page->mux.channel_capacity = m->channel_capacity;
+  st->page->mux.outbuf_size = m->outbuf.size;
+  for (i = 0; i < m->nservices; i++) {
+    st->page->services[i].id = i;
+    st->page->services[i].inbuf_size = m->services[i].inbuf.size;
+  }
+  /* Readers check the magic number last */
+  atomic_thread_fence(memory_order_release);
+  st->page->magic = STATS_MAGIC;
+
+  if (m->stats_shm)
+    fprintf(stderr,"Publishing stats in shared memory %s\n",m->stats_shm);
+
+  if (m->stats_port && (stats_listen(st, m->stats_port) < 0))
+    fprintf(stderr,"WARNING: Stats will not be exported\n");
+
+  return st;
+}
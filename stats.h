@@ -0,0 +1,93 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "tserror.h"
+
+#define STATS_MAGIC   0x53425644   /* "DVBS" */
+#define STATS_VERSION 1
+
+#define STATS_WINDOWS 3            /* Padding ratio over 1s, 10s and 60s */
+#define STATS_HISTORY 61           /* Seconds of history kept for the windows */
+
+#define STATS_PAT 0
+#define STATS_PMT 1
+#define STATS_SDT 2
+#define STATS_NIT 3
+#define STATS_AIT 4
+#define STATS_PSI_TYPES 5
+
+/* The statistics page is a header followed by one block for the mux and
+   one per service.  Each block is written by the mux thread under a
+   sequence count: seq is odd while the block is being updated, so a
+   reader copies the block and retries if seq was odd or changed (see
+   stats_read_block). */
+
+struct stats_mux_t {
+  _Atomic uint32_t seq;
+  uint32_t tsid;
+  uint32_t channel_capacity;
+  uint32_t outbuf_size;
+  uint32_t outbuf_used;
+  uint32_t outbuf_high_water;
+  uint64_t bytes_out;
+  uint64_t padding_bytes;
+  double padding_ratio[STATS_WINDOWS];
+  uint64_t psi_sections[STATS_PSI_TYPES];
+} __attribute__((aligned(64)));
+
+struct stats_service_t {
+  _Atomic uint32_t seq;
+  uint32_t id;
+  uint32_t inbuf_size;
+  uint32_t inbuf_used;
+  uint32_t inbuf_high_water;
+  uint32_t pad;
+  uint64_t bytes_in;
+  uint64_t packets_filtered;
+  uint64_t packets_out;
+  uint64_t errors[TSERR_COUNT];
+  int64_t pcr_delta;           /* 27MHz ticks between the last two PCRs */
+  int64_t pcr_delta_max;
+} __attribute__((aligned(64)));
+
+struct stats_page_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nservices;
+  uint32_t pid;
+  struct stats_mux_t mux;
+  struct stats_service_t services[];
+};
+
+struct mux_t;
+
+struct stats_t {
+  struct mux_t* m;
+  struct stats_page_t* page;
+  int size;
+
+  /* Mux thread - once a second samples for the padding windows */
+  uint64_t bytes_hist[STATS_HISTORY];
+  uint64_t padding_hist[STATS_HISTORY];
+  int nhist;
+  int64_t next_sample_ms;
+
+  /* Exporter */
+  int listen_fd;
+  pthread_t threadid;
+};
+
+struct stats_t* stats_create(struct mux_t* m);
+
+/* Called by the mux thread */
+void stats_stop(struct stats_t* st);
+void stats_update(struct stats_t* st, int64_t output_bitpos, int64_t padding_bits, uint64_t* psi_sections);
+
+/* Consistent copy of a block from any thread or process */
+void stats_read_block(void* dst, void* src, int size);
+
+#endif
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+# Check a dvb2dvb output file: every packet synced, no continuity errors
+# (after the first second, outside the null PID), and the PAT, every PMT
+# it lists, the SDT and the NIT all present.
+#
+# usage: check_ts.py file.ts nservices
+
+import sys, collections
+
+data = open(sys.argv[1], 'rb').read()
+nservices = int(sys.argv[2])
+npackets = len(data) // 188
+errors = []
+pids = collections.Counter()
+last_cc = {}
+ccerr = collections.Counter()
+pmt_pids = set()
+
+for i in range(npackets):
+    p = data[i * 188:(i + 1) * 188]
+    if p[0] != 0x47:
+        errors.append('packet %d: no sync byte' % i)
+        break
+    pid = ((p[1] & 0x1f) << 8) | p[2]
+    pids[pid] += 1
+    if pid == 0x1fff:
+        continue
+    cc, has_payload = p[3] & 15, p[3] & 0x10
+    if pid in last_cc and i > npackets // 10:
+        expected = (last_cc[pid] + 1) % 16 if has_payload else last_cc[pid]
+        if cc != expected:
+            ccerr[pid] += 1
+    last_cc[pid] = cc
+    if pid == 0 and (p[1] & 0x40) and not pmt_pids:
+        n = ((p[6] & 0x0f) << 8 | p[7]) - 9
+        for j in range(13, 13 + n, 4):
+            pmt_pids.add(((p[j + 2] & 0x1f) << 8) | p[j + 3])
+
+if npackets == 0:
+    errors.append('no output')
+if ccerr:
+    errors.append('continuity errors %s' % dict(ccerr))
+if len(pmt_pids) != nservices:
+    errors.append('PAT lists %d services, expected %d' % (len(pmt_pids), nservices))
+for pid, name in [(0, 'PAT'), (0x10, 'NIT'), (0x11, 'SDT')] + [(p, 'PMT') for p in sorted(pmt_pids)]:
+    if not pids[pid]:
+        errors.append('no %s (PID %d)' % (name, pid))
+
+print('%s: %d packets, %.1f%% padding%s' % (sys.argv[1], npackets, 100.0 * pids[0x1fff] / max(1, npackets),
+      '' if not errors else ' - ' + '; '.join(errors)))
+sys.exit(1 if errors else 0)
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Generate a synthetic SPTS for dvb2dvb tests: PAT, PMT, SDT and EIT p/f
+# every 100ms, PCRs on the video PID every 30ms, video and audio packets.
+#
+# usage: gen_ts.py service_id seconds kbps output.ts
+
+import sys, struct
+
+def crc32mpeg(data):
+    crc = 0xffffffff
+    for b in data:
+        crc ^= b << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04c11db7) & 0xffffffff if crc & 0x80000000 else (crc << 1) & 0xffffffff
+    return crc
+
+def section(table_id, ext, body, syntax_bits=0xb000):
+    sec = bytes([table_id]) + struct.pack('>H', syntax_bits | (len(body) + 9)) + struct.pack('>H', ext) + bytes([0xc1, 0, 0]) + body
+    return sec + struct.pack('>I', crc32mpeg(sec))
+
+cc = {}
+
+def next_cc(pid):
+    c = cc.get(pid, 0)
+    cc[pid] = (c + 1) % 16
+    return c
+
+def packets(pid, payload):
+    out = []
+    data = b'\x00' + payload
+    first = True
+    while data:
+        chunk, data = data[:184], data[184:]
+        hdr = struct.pack('>BHB', 0x47, (0x4000 if first else 0) | pid, 0x10 | next_cc(pid))
+        out.append(hdr + chunk + b'\xff' * (184 - len(chunk)))
+        first = False
+    return out
+
+def pes_packet(pid, payload):
+    hdr = struct.pack('>BHB', 0x47, 0x4000 | pid, 0x10 | next_cc(pid))
+    return hdr + payload + b'\xff' * (184 - len(payload))
+
+def pcr_packet(pid, pcr):
+    base, ext = pcr // 300, pcr % 300
+    af = bytes([7, 0x10]) + struct.pack('>IH', (base >> 1) & 0xffffffff, ((base & 1) << 15) | 0x7e00 | ext)
+    hdr = struct.pack('>BHB', 0x47, pid, 0x30 | next_cc(pid))
+    return hdr + af + b'\xaa' * (184 - len(af))
+
+sid, secs, kbps, out = int(sys.argv[1]), float(sys.argv[2]), int(sys.argv[3]), sys.argv[4]
+
+pat = section(0, 1, struct.pack('>HH', sid, 0xe000 | 0x20))
+pmt = section(2, sid, struct.pack('>HH', 0xe000 | 0x100, 0xf000) +
+              bytes([0x1b]) + struct.pack('>HH', 0xe000 | 0x100, 0xf000) +
+              bytes([0x03]) + struct.pack('>HH', 0xe000 | 0x101, 0xf000))
+name, prov = b'Test %d' % sid, b'gen'
+desc = bytes([0x48, 3 + len(prov) + len(name), 1, len(prov)]) + prov + bytes([len(name)]) + name
+sdt = section(0x42, 1, struct.pack('>HB', 1, 0xff) + struct.pack('>HBH', sid, 0xfc, 0x8000 | len(desc)) + desc, 0xf000)
+ev = bytes([0x4d, 12, ord('e'), ord('n'), ord('g'), 3]) + b'abc' + bytes([0])
+eit = section(0x4e, sid, struct.pack('>HHBB', 1, 1, 0, 0x4e) + struct.pack('>H', 1) +
+              b'\xe2\x00\x12\x00\x00' + b'\x01\x00\x00' + struct.pack('>H', 0x8000 | len(ev)) + ev, 0xf000)
+
+pkts_per_sec = kbps * 1000 // (188 * 8)
+with open(out, 'wb') as f:
+    for i in range(int(secs * pkts_per_sec)):
+        if i % max(1, pkts_per_sec // 10) == 0:
+            for p in packets(0, pat) + packets(0x20, pmt) + packets(0x11, sdt) + packets(0x12, eit):
+                f.write(p)
+        if i % max(1, int(pkts_per_sec * 0.03)) == 0:
+            f.write(pcr_packet(0x100, i * 27000000 // pkts_per_sec))
+        elif i % 10 == 3:
+            f.write(pes_packet(0x101, b'\x00\x00\x01\xc0' + b'\x11' * 150))
+        else:
+            f.write(pes_packet(0x100, b'\x00\x00\x01\xe0' + b'\x22' * 170))
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Run one mux, then three muxes at once, into file outputs from locally
+# served synthetic streams.  Checks every output file, and reports the
+# CPU used per mux in each run - with independent per-mux pipelines it
+# should stay about the same as muxes are added.
+#
+# usage: run.sh [path/to/dvb2dvb] [seconds]
+
+DVB2DVB=$(realpath "${1:-./dvb2dvb}")
+SECONDS_RUN=${2:-10}
+TESTDIR=$(dirname "$(realpath "$0")")
+WORK=$(mktemp -d)
+PORT=18090
+FAILED=0
+
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+
+echo "Generating inputs in $WORK"
+for s in 1 2 3; do
+  python3 "$TESTDIR/gen_ts.py" $s 30 1500 "$WORK/s$s.ts" || exit 1
+done
+
+python3 "$TESTDIR/serve_ts.py" $PORT 1500 "$WORK" &
+SERVER=$!
+sleep 1
+
+ticks_per_sec=$(getconf CLK_TCK)
+
+# run config nmuxes - runs dvb2dvb for SECONDS_RUN, sets CPU_PER_MUX (ms/s)
+run() {
+  rm -f "$WORK"/multimux_*.ts
+  (cd "$WORK" && exec "$DVB2DVB" "$TESTDIR/$1" > "$WORK/$1.log" 2>&1) &
+  pid=$!
+  sleep 3   # Startup and output prefill
+  t1=$(awk '{print $14+$15}' /proc/$pid/stat)
+  sleep $SECONDS_RUN
+  t2=$(awk '{print $14+$15}' /proc/$pid/stat)
+  kill $pid
+  wait $pid 2>/dev/null
+  CPU_PER_MUX=$(( (t2 - t1) * 1000 / ticks_per_sec / SECONDS_RUN / $2 ))
+
+  k=0
+  while [ $k -lt $2 ]; do
+    python3 "$TESTDIR/check_ts.py" "$WORK/multimux_$k.ts" 3 || FAILED=1
+    k=$((k + 1))
+  done
+}
+
+run single.json 1
+SINGLE=$CPU_PER_MUX
+run multimux.json 3
+MULTI=$CPU_PER_MUX
+
+echo "CPU per mux: 1 mux ${SINGLE}ms/s, 3 muxes ${MULTI}ms/s"
+if [ $FAILED -ne 0 ]; then
+  echo "FAILED"
+  exit 1
+fi
+echo "OK"
@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+# Serve dir/sN.ts as http://127.0.0.1:port/N, paced at kbps, looping.
+#
+# usage: serve_ts.py port kbps dir
+
+import sys, os, time, http.server, socketserver
+
+port, kbps, root = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.0'
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        try:
+            data = open(os.path.join(root, 's%s.ts' % self.path.strip('/')), 'rb').read()
+        except OSError:
+            self.send_response(404)
+            self.end_headers()
+            return
+        self.send_response(200)
+        self.send_header('Content-Type', 'video/mp2t')
+        self.end_headers()
+        rate = kbps * 1000 / 8
+        start, sent, i = time.time(), 0, 0
+        try:
+            while True:
+                n = 7000 + (i * 1337) % 9000
+                i += 1
+                pos = sent % len(data)
+                chunk = data[pos:pos + n]
+                self.wfile.write(chunk)
+                sent += len(chunk)
+                delay = start + sent / rate - time.time()
+                if delay > 0:
+                    time.sleep(delay)
+        except OSError:
+            pass
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+Server(('127.0.0.1', port), Handler).serve_forever()
@@ -0,0 +1,470 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "dvb2dvb.h"
+#include "psi_read.h"
+#include "output.h"
+#include "tr101290.h"
+
+/* An ETSI TR 101 290 priority 1 and 2 analyser for the output
+   multiplex.
+
+   The output thread copies everything it has written into the tap
+   ringbuffer (tr101290_tap), as records stamped with their stream
+   position, and this module's own thread checks them.  If the
+   analyser falls behind, the tap skips records rather than waiting, so
+   neither the mux nor the output thread is ever slowed down - the
+   analyser just sees a sample of the output, and restarts its state
+   after each gap.
+
+   Times are measured in output bits, so PAT/PMT repetition is checked
+   against pat_freq_in_bits/pmt_freq_in_bits (with 50% tolerance) and
+   PCRs against their position in the multiplex. */
+
+struct tr_record_t {
+  uint64_t pos;
+  int len;
+  int pad;
+};
+
+static char* names[TR_COUNT] = {
+  "TS sync loss", "sync byte", "PAT", "CC", "PMT", "CRC",
+  "PCR repetition", "PCR discontinuity", "PCR accuracy"
+};
+
+char* tr101290_name(int check)
+{
+  return names[check];
+}
+
+static int64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Results have a single writer, so no locked increments are needed */
+static void tr_add(_Atomic uint64_t* counter, uint64_t n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void tr_check(struct tr101290_t* a, int check, int failed)
+{
+  tr_add(&a->checks[check], 1);
+  if (failed)
+    tr_add(&a->errors[check], 1);
+}
+
+static void tr_add_table(struct tr101290_t* a, int pid, int table_id)
+{
+  if ((pid <= 0x1f) && (pid != 0) && (pid != 0x10) && (pid != 0x11) && (pid != 0x12))
+    return;
+  if (a->sections[pid] == NULL)
+    a->sections[pid] = calloc(1, sizeof(struct section_t));
+  if (a->sections[pid] == NULL) {
+    fprintf(stderr,"WARNING: TR 101 290: Could not allocate section for pid %d, not checking it\n",pid);
+    return;
+  }
+  a->table_id[pid] = table_id;
+}
+
+/* Find the PSI PIDs - called on the first output, once the mux thread
+   has set the services up */
+static void tr_start(struct tr101290_t* a)
+{
+  struct mux_t* m = a->m;
+  int i;
+
+  tr_add_table(a, 0x00, 0x00);   /* PAT */
+  tr_add_table(a, 0x10, 0x40);   /* NIT */
+  tr_add_table(a, 0x11, 0x42);   /* SDT */
+  tr_add_table(a, 0x12, 0x4e);   /* EIT p/f */
+  for (i = 0; i < m->nservices; i++)
+    tr_add_table(a, m->services[i].new_pmt_pid, 0x02);
+  if (m->services[0].ait_pid)
+    tr_add_table(a, m->services[0].ait_pid, 0x74);
+
+  a->pat_limit = (int64_t)m->pat_freq_in_bits * 3 / 2;
+  a->pmt_limit = (int64_t)m->pmt_freq_in_bits * 3 / 2;
+  a->started = 1;
+}
+
+/* Forget everything that depends on seeing consecutive packets */
+static void tr_reset(struct tr101290_t* a)
+{
+  int pid;
+
+  memset(a->cc, 0xff, sizeof(a->cc));
+  memset(a->cc_dup, 0, sizeof(a->cc_dup));
+  memset(a->table_late, 0, sizeof(a->table_late));
+  for (pid = 0; pid < 8192; pid++) {
+    a->last_table[pid] = -1;
+    if (a->sections[pid])
+      memset(a->sections[pid], 0, sizeof(struct section_t));
+  }
+  a->npcrs = 0;
+  a->partial_len = 0;
+  a->bad_syncs = 0;
+}
+
+static struct tr_pcr_t* tr_find_pcr(struct tr101290_t* a, int pid)
+{
+  int i;
+
+  for (i = 0; i < a->npcrs; i++) {
+    if (a->pcrs[i].pid == pid)
+      return &a->pcrs[i];
+  }
+  if (a->npcrs == TR_MAX_PCR_PIDS)
+    return NULL;
+
+  a->pcrs[a->npcrs].pid = pid;
+  a->pcrs[a->npcrs].last_bitpos = -1;
+  return &a->pcrs[a->npcrs++];
+}
+
+static void tr_pcr(struct tr101290_t* a, uint8_t* pkt, int pid, int64_t bitpos, int discontinuity)
+{
+  struct tr_pcr_t* p = tr_find_pcr(a, pid);
+  int64_t capacity = a->m->channel_capacity;
+  int64_t pcr;
+
+  if (p == NULL)
+    return;
+
+  pcr  = (int64_t)pkt[6] << 25;
+  pcr |= (int64_t)pkt[7] << 17;
+  pcr |= (int64_t)pkt[8] << 9;
+  pcr |= (int64_t)pkt[9] << 1;
+  pcr |= ((int64_t)pkt[10] >> 7) & 0x01;
+  pcr = pcr * 300 + (((pkt[10] & 0x01) << 8) | pkt[11]);
+
+  if (p->last_bitpos >= 0) {
+    int64_t interval_ms = (bitpos - p->last_bitpos) * 1000 / capacity;
+    int64_t jump = pcr - p->last_pcr;
+
+    if (jump < 0)
+      jump += TR_PCR_WRAP;   /* Either a wrap or a real backwards jump, which is far too big */
+
+    tr_check(a, TR_PCR_REPETITION, interval_ms > TR_PCR_REPETITION_MS);
+
+    if (!discontinuity) {
+      tr_check(a, TR_PCR_DISCONTINUITY, jump > TR_PCR_DISCONTINUITY_MS * 27000LL);
+      if (jump <= TR_PCR_DISCONTINUITY_MS * 27000LL) {
+        /* Move the reference up in whole seconds (capacity bits is exactly
+           27000000 ticks), so the multiply below can't overflow */
+        int64_t secs = (bitpos - p->ref_bitpos) / capacity;
+        p->ref_bitpos += secs * capacity;
+        p->ref_pcr = (p->ref_pcr + secs * 27000000) % TR_PCR_WRAP;
+
+        /* Where the PCR should be, given its position in the multiplex */
+        int64_t expected = p->ref_pcr + (bitpos - p->ref_bitpos) * 27000000 / capacity;
+        int64_t diff = (pcr - expected) % TR_PCR_WRAP;
+        if (diff > TR_PCR_WRAP / 2)
+          diff -= TR_PCR_WRAP;
+        else if (diff < -TR_PCR_WRAP / 2)
+          diff += TR_PCR_WRAP;
+        int64_t error_ns = diff * 1000 / 27;
+        if (error_ns < 0)
+          error_ns = -error_ns;
+
+        tr_check(a, TR_PCR_ACCURACY, error_ns > TR_PCR_ACCURACY_NS);
+        if (error_ns > atomic_load_explicit(&a->max_pcr_error_ns, memory_order_relaxed))
+          atomic_store_explicit(&a->max_pcr_error_ns, error_ns, memory_order_relaxed);
+
+        p->last_pcr = pcr;
+        p->last_bitpos = bitpos;
+        return;
+      }
+    }
+  }
+
+  /* First PCR, or a new timebase */
+  p->ref_pcr = pcr;
+  p->ref_bitpos = bitpos;
+  p->last_pcr = pcr;
+  p->last_bitpos = bitpos;
+}
+
+/* PAT and PMT repetition - limit is in bits */
+static void tr_table_start(struct tr101290_t* a, uint8_t* pkt, int pid, int64_t bitpos, int check, int table_id, int64_t limit)
+{
+  int ptr = 5 + pkt[4];
+
+  if (a->last_table[pid] >= 0) {
+    tr_check(a, check, (!a->table_late[pid]) && (bitpos - a->last_table[pid] > limit));
+  }
+  if (ptr < 188)
+    tr_check(a, check, pkt[ptr] != table_id);
+
+  a->last_table[pid] = bitpos;
+  a->table_late[pid] = 0;
+}
+
+/* Count PAT/PMTs that are overdue now, rather than when (or if) they turn up */
+static void tr_check_late(struct tr101290_t* a, int64_t bitpos)
+{
+  struct mux_t* m = a->m;
+  int i;
+
+  if ((a->last_table[0] >= 0) && (!a->table_late[0]) && (bitpos - a->last_table[0] > a->pat_limit)) {
+    tr_check(a, TR_PAT, 1);
+    a->table_late[0] = 1;
+  }
+
+  for (i = 0; i < m->nservices; i++) {
+    int pid = m->services[i].new_pmt_pid;
+    if ((a->last_table[pid] >= 0) && (!a->table_late[pid]) && (bitpos - a->last_table[pid] > a->pmt_limit)) {
+      tr_check(a, TR_PMT, 1);
+      a->table_late[pid] = 1;
+    }
+  }
+}
+
+static void tr_packet(struct tr101290_t* a, uint8_t* pkt, int64_t bitpos)
+{
+  int pid, afc, cc, pusi, discontinuity;
+
+  /* 1.1 and 1.2 */
+  tr_check(a, TR_SYNC_BYTE, pkt[0] != 0x47);
+  if (pkt[0] != 0x47) {
+    if (++a->bad_syncs == 2)
+      tr_check(a, TR_SYNC_LOSS, 1);
+    return;
+  }
+  a->bad_syncs = 0;
+
+  pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+  pusi = pkt[1] & 0x40;
+  afc = (pkt[3] & 0x30) >> 4;
+  cc = pkt[3] & 0x0f;
+  discontinuity = (afc & 2) && (pkt[4] > 0) && (pkt[5] & 0x80);
+
+  if ((pid == 0x1fff) || (afc == 0))
+    return;
+
+  /* 1.4 - one duplicate packet is allowed */
+  if ((a->cc[pid] != 0xff) && (!discontinuity)) {
+    int expected = (afc & 1) ? ((a->cc[pid] + 1) & 0x0f) : a->cc[pid];
+    int failed = 0;
+
+    if (cc == expected) {
+      a->cc_dup[pid] = 0;
+    } else if ((afc & 1) && (cc == a->cc[pid]) && (!a->cc_dup[pid])) {
+      a->cc_dup[pid] = 1;
+    } else {
+      failed = 1;
+      if (a->sections[pid])
+        memset(a->sections[pid], 0, sizeof(struct section_t));
+    }
+    tr_check(a, TR_CC, failed);
+  }
+  a->cc[pid] = cc;
+
+  /* 2.3 and 2.4 */
+  if ((afc & 2) && (pkt[4] >= 7) && (pkt[5] & 0x10))
+    tr_pcr(a, pkt, pid, bitpos, discontinuity);
+
+  /* 1.3, 1.5 and 2.2 */
+  if (a->sections[pid]) {
+    struct section_t curr;
+
+    if (pusi) {
+      if (pid == 0)
+        tr_table_start(a, pkt, pid, bitpos, TR_PAT, 0x00, a->pat_limit);
+      else if (a->table_id[pid] == 0x02)
+        tr_table_start(a, pkt, pid, bitpos, TR_PMT, 0x02, a->pmt_limit);
+
+      /* Sections always start a new packet in our output */
+      memset(a->sections[pid], 0, sizeof(struct section_t));
+    }
+
+    /* A complete section either fails its CRC or is copied to curr */
+    curr.length = 0;
+    int res = process_section(a->sections[pid], &curr, pkt, a->table_id[pid]);
+    if ((res < 0) || (curr.length))
+      tr_check(a, TR_CRC, res < 0);
+  }
+}
+
+static void tr_process(struct tr101290_t* a, uint64_t pos, uint8_t* buf, int len)
+{
+  if (!a->started)
+    tr_start(a);
+
+  if (pos != a->pos) {
+    /* The tap skipped some output - start again at the next packet */
+    tr_reset(a);
+    a->pos = pos;
+    int skip = (188 - pos % 188) % 188;
+    if (skip >= len) {
+      a->pos += len;
+      return;
+    }
+    buf += skip;
+    len -= skip;
+    a->pos += skip;
+  }
+
+  if (a->partial_len) {
+    int n = MIN(188 - a->partial_len, len);
+    memcpy(a->partial + a->partial_len, buf, n);
+    a->partial_len += n;
+    buf += n;
+    len -= n;
+    a->pos += n;
+    if (a->partial_len < 188)
+      return;
+    tr_packet(a, a->partial, (int64_t)(a->pos - 188) * 8);
+    a->partial_len = 0;
+  }
+
+  while (len >= 188) {
+    tr_packet(a, buf, (int64_t)a->pos * 8);
+    buf += 188;
+    len -= 188;
+    a->pos += 188;
+  }
+
+  if (len) {
+    memcpy(a->partial, buf, len);
+    a->partial_len = len;
+    a->pos += len;
+  }
+
+  tr_check_late(a, (int64_t)a->pos * 8);
+}
+
+static void tr_report(struct tr101290_t* a)
+{
+  struct tr101290_snapshot_t s;
+  int64_t now = now_ms();
+  char msg[512];
+  int len = 0;
+  int i;
+
+  if (now - a->last_report_ms < TR_REPORT_INTERVAL_MS)
+    return;
+  a->last_report_ms = now;
+
+  tr101290_snapshot(a, &s);
+  for (i = 0; i < TR_COUNT; i++) {
+    if (s.errors[i] != a->reported[i])
+      len += snprintf(msg + len, sizeof(msg) - len, "%s%d %s",len ? ", " : "",(int)(s.errors[i] - a->reported[i]),names[i]);
+    a->reported[i] = s.errors[i];
+  }
+
+  if (len)
+    fprintf(stderr,"\nTR 101 290: %s errors (max PCR error %dus, %d%% of output analysed)\n",msg,(int)(s.max_pcr_error_ns/1000),
+            (int)(100 * s.bytes_analysed / MAX(1, s.bytes_analysed + s.bytes_skipped)));
+}
+
+static void *tr101290_thread(void* userp)
+{
+  struct tr101290_t* a = userp;
+  struct tr_record_t rec;
+
+  while (1) {
+    uint8_t* p = rb_peek(&a->tap, sizeof(rec));
+    memcpy(&rec, p, sizeof(rec));
+    p = rb_peek(&a->tap, sizeof(rec) + rec.len);
+
+    tr_process(a, rec.pos, p + sizeof(rec), rec.len);
+    rb_consume(&a->tap, sizeof(rec) + rec.len);
+    tr_add(&a->bytes_analysed, rec.len);
+
+    tr_report(a);
+  }
+
+  return NULL;
+}
+
+struct tr101290_t* tr101290_create(struct mux_t* m)
+{
+  struct tr101290_t* a = calloc(1, sizeof(struct tr101290_t));
+  int size = MAX((int)((int64_t)m->channel_capacity * TR_TAP_MS / 8000), 4 * TR_MAX_RECORD);
+
+  if (a == NULL) {
+    fprintf(stderr,"Could not allocate TR 101 290 analyser\n");
+    return NULL;
+  }
+  a->m = m;
+  tr_reset(a);
+  if (rb_init(&a->tap, size, 0) < 0) {
+    free(a);
+    return NULL;
+  }
+  rb_set_wait(&a->tap, RB_WAIT_BLOCK, output_chunk_size(m->output), 0, 0);
+
+  int error = pthread_create(&a->threadid, NULL, tr101290_thread, (void *)a);
+  if (error) {
+    fprintf(stderr,"Couldn't create TR 101 290 analyser thread, errno %d\n",error);
+    rb_free(&a->tap);
+    free(a);
+    return NULL;
+  }
+
+  return a;
+}
+
+/* Called by the output thread with data it has finished with */
+void tr101290_tap(struct tr101290_t* a, uint8_t* buf, int count)
+{
+  while (count > 0) {
+    int n = MIN(count, TR_MAX_RECORD);
+    uint8_t* p = rb_reserve(&a->tap, sizeof(struct tr_record_t) + n);
+
+    if (p) {
+      struct tr_record_t rec = { a->tap_pos, n, 0 };
+      memcpy(p, &rec, sizeof(rec));
+      memcpy(p + sizeof(rec), buf, n);
+      rb_commit(&a->tap, sizeof(rec) + n);
+    } else {
+      tr_add(&a->bytes_skipped, n);
+    }
+
+    a->tap_pos += n;
+    buf += n;
+    count -= n;
+  }
+}
+
+void tr101290_snapshot(struct tr101290_t* a, struct tr101290_snapshot_t* s)
+{
+  int i;
+
+  for (i = 0; i < TR_COUNT; i++) {
+    s->checks[i] = atomic_load_explicit(&a->checks[i], memory_order_relaxed);
+    s->errors[i] = atomic_load_explicit(&a->errors[i], memory_order_relaxed);
+  }
+  s->max_pcr_error_ns = atomic_load_explicit(&a->max_pcr_error_ns, memory_order_relaxed);
+  s->bytes_analysed = atomic_load_explicit(&a->bytes_analysed, memory_order_relaxed);
+  s->bytes_skipped = atomic_load_explicit(&a->bytes_skipped, memory_order_relaxed);
+}
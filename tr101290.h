@@ -0,0 +1,89 @@
+#ifndef _TR101290_H
+#define _TR101290_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "ringbuffer.h"
+#include "dvb2dvb.h"
+
+/* Checks, numbered as in ETSI TR 101 290 */
+#define TR_SYNC_LOSS          0   /* 1.1 TS_sync_loss */
+#define TR_SYNC_BYTE          1   /* 1.2 Sync_byte_error */
+#define TR_PAT                2   /* 1.3 PAT_error */
+#define TR_CC                 3   /* 1.4 Continuity_count_error */
+#define TR_PMT                4   /* 1.5 PMT_error */
+#define TR_CRC                5   /* 2.2 CRC_error */
+#define TR_PCR_REPETITION     6   /* 2.3 PCR_repetition_error */
+#define TR_PCR_DISCONTINUITY  7   /* 2.3 PCR_discontinuity_indicator_error */
+#define TR_PCR_ACCURACY       8   /* 2.4 PCR_accuracy_error */
+#define TR_COUNT              9
+
+#define TR_TAP_MS              500         /* Analyser backlog before the tap starts skipping */
+#define TR_MAX_RECORD          (188*1024)
+#define TR_PCR_REPETITION_MS   40
+#define TR_PCR_DISCONTINUITY_MS 100
+#define TR_PCR_ACCURACY_NS     500
+#define TR_MAX_PCR_PIDS        64
+#define TR_PCR_WRAP            ((1LL << 33) * 300)  /* PCRs count modulo this */
+#define TR_REPORT_INTERVAL_MS  10000
+
+struct tr_pcr_t {
+  int pid;
+  int64_t ref_pcr;       /* Reference point for PCR accuracy, moved */
+  int64_t ref_bitpos;    /* on a whole second at a time */
+  int64_t last_pcr;
+  int64_t last_bitpos;
+};
+
+struct tr101290_t {
+  struct mux_t* m;
+  pthread_t threadid;
+  struct ringbuffer_t tap;   /* Copy of the output, as tr_record_t + data */
+
+  /* Output thread */
+  uint64_t tap_pos;          /* Stream position of the next byte output */
+  _Atomic uint64_t bytes_skipped;  /* Output not analysed because the analyser was behind */
+
+  /* Results, published by the analyser thread */
+  _Atomic uint64_t checks[TR_COUNT];
+  _Atomic uint64_t errors[TR_COUNT];
+  _Atomic int64_t max_pcr_error_ns;
+  _Atomic uint64_t bytes_analysed;
+
+  /* Analyser thread state */
+  int started;
+  uint64_t pos;              /* Stream position of the next byte expected */
+  uint8_t partial[188];
+  int partial_len;
+  int bad_syncs;             /* Consecutive packets without a sync byte */
+  uint8_t cc[8192];          /* Last CC, 0xff if unknown */
+  uint8_t cc_dup[8192];      /* Last packet was a duplicate */
+  uint8_t table_id[8192];    /* Expected table_id for PSI/SI PIDs */
+  struct section_t* sections[8192];
+  int64_t last_table[8192];  /* Bit position of the last PAT/PMT, -1 for none */
+  uint8_t table_late[8192];
+  int64_t pat_limit;         /* PAT/PMT repetition limits, in bits */
+  int64_t pmt_limit;
+  struct tr_pcr_t pcrs[TR_MAX_PCR_PIDS];
+  int npcrs;
+
+  uint64_t reported[TR_COUNT];
+  int64_t last_report_ms;
+};
+
+struct tr101290_snapshot_t {
+  uint64_t checks[TR_COUNT];
+  uint64_t errors[TR_COUNT];
+  int64_t max_pcr_error_ns;
+  uint64_t bytes_analysed;
+  uint64_t bytes_skipped;
+};
+
+struct tr101290_t* tr101290_create(struct mux_t* m);
+void tr101290_tap(struct tr101290_t* a, uint8_t* buf, int count);
+void tr101290_snapshot(struct tr101290_t* a, struct tr101290_snapshot_t* s);
+char* tr101290_name(int check);
+
+#endif
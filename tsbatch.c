@@ -0,0 +1,188 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tsbatch.h"
+
+/* Batch packet classification.  The first eight bytes of each packet
+   (header, adaptation field length and flags) are reduced to PID, CC
+   and a flags byte, so the mux thread's loops can work on small arrays
+   instead of parsing each packet header.
+
+   With AVX2 the headers of eight packets are fetched with two gathers
+   and decoded together; with SSE4.1, four at a time.  The plain C
+   version is used elsewhere, and for the last few packets. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TSBATCH_X86
+#endif
+
+static void ts_classify_c(uint8_t* buf, int n, struct ts_batch_t* b, int i)
+{
+  for (; i < n; i++) {
+    uint8_t* p = buf + i*188;
+    int afc = (p[3] & 0x30) >> 4;
+    int flags = 0;
+
+    if (p[0] != 0x47) flags |= TS_NO_SYNC;
+    if (p[1] & 0x80) flags |= TS_TEI;
+    if (p[1] & 0x40) flags |= TS_PUSI;
+    if (afc & 1) flags |= TS_HAS_PAYLOAD;
+    if (afc & 2) {
+      flags |= TS_HAS_AF;
+      if ((p[4] > 0) && (p[5] & 0x80)) flags |= TS_DISCONTINUITY;
+      if ((p[4] > 5) && (p[5] & 0x10)) flags |= TS_HAS_PCR;
+    }
+
+    b->pid[i] = ((p[1] & 0x1f) << 8) | p[2];
+    b->flags[i] = flags;
+    b->cc[i] = p[3] & 0x0f;
+  }
+}
+
+void ts_classify_scalar(uint8_t* buf, int n, struct ts_batch_t* b)
+{
+  ts_classify_c(buf, n, b, 0);
+}
+
+#ifdef TSBATCH_X86
+
+/* In both vector versions, each 32-bit lane holds bytes 0-3 of a packet
+   (hdr) and bytes 4-7 (af), little-endian. */
+
+__attribute__((target("sse4.1")))
+void ts_classify_sse4(uint8_t* buf, int n, struct ts_batch_t* b)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    uint8_t* p = buf + i*188;
+
+    /* Each 8-byte load picks up hdr and af together */
+    __m128i lo = _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i*)p), _mm_loadl_epi64((__m128i*)(p + 188)));
+    __m128i hi = _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i*)(p + 2*188)), _mm_loadl_epi64((__m128i*)(p + 3*188)));
+    __m128i hdr = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i af = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1)));
+
+    __m128i af_on = _mm_cmpeq_epi32(_mm_and_si128(hdr, _mm_set1_epi32(0x20000000)), _mm_set1_epi32(0x20000000));
+    __m128i af_len = _mm_and_si128(af, _mm_set1_epi32(0xff));
+    __m128i sync = _mm_cmpeq_epi32(_mm_and_si128(hdr, _mm_set1_epi32(0xff)), _mm_set1_epi32(0x47));
+
+    __m128i flags = _mm_andnot_si128(sync, _mm_set1_epi32(TS_NO_SYNC));
+    flags = _mm_or_si128(flags, _mm_and_si128(_mm_srli_epi32(hdr, 14), _mm_set1_epi32(TS_PUSI)));
+    flags = _mm_or_si128(flags, _mm_and_si128(_mm_srli_epi32(hdr, 10), _mm_set1_epi32(TS_TEI)));
+    flags = _mm_or_si128(flags, _mm_and_si128(_mm_srli_epi32(hdr, 28), _mm_set1_epi32(TS_HAS_AF)));
+    flags = _mm_or_si128(flags, _mm_and_si128(_mm_srli_epi32(hdr, 26), _mm_set1_epi32(TS_HAS_PAYLOAD)));
+    flags = _mm_or_si128(flags, _mm_and_si128(_mm_and_si128(af_on, _mm_cmpgt_epi32(af_len, zero)),
+                                              _mm_and_si128(_mm_srli_epi32(af, 12), _mm_set1_epi32(TS_DISCONTINUITY))));
+    flags = _mm_or_si128(flags, _mm_and_si128(_mm_and_si128(af_on, _mm_cmpgt_epi32(af_len, _mm_set1_epi32(5))),
+                                              _mm_and_si128(_mm_srli_epi32(af, 8), _mm_set1_epi32(TS_HAS_PCR))));
+
+    __m128i pid = _mm_or_si128(_mm_and_si128(hdr, _mm_set1_epi32(0x1f00)),
+                               _mm_and_si128(_mm_srli_epi32(hdr, 16), _mm_set1_epi32(0xff)));
+    __m128i cc = _mm_and_si128(_mm_srli_epi32(hdr, 24), _mm_set1_epi32(0x0f));
+
+    /* Narrow: pid to 16 bits, flags and cc to 8 bits */
+    _mm_storel_epi64((__m128i*)&b->pid[i], _mm_packus_epi32(pid, zero));
+    __m128i fc = _mm_packus_epi16(_mm_packus_epi32(flags, cc), zero);
+    uint64_t bytes = _mm_cvtsi128_si64(fc);
+    memcpy(&b->flags[i], &bytes, 4);
+    bytes >>= 32;
+    memcpy(&b->cc[i], &bytes, 4);
+  }
+
+  ts_classify_c(buf, n, b, i);
+}
+
+__attribute__((target("avx2")))
+void ts_classify_avx2(uint8_t* buf, int n, struct ts_batch_t* b)
+{
+  const __m256i offsets = _mm256_setr_epi32(0, 188, 2*188, 3*188, 4*188, 5*188, 6*188, 7*188);
+  const __m256i zero = _mm256_setzero_si256();
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    uint8_t* p = buf + i*188;
+    __m256i hdr = _mm256_i32gather_epi32((const int*)p, offsets, 1);
+    __m256i af = _mm256_i32gather_epi32((const int*)(p + 4), offsets, 1);
+
+    __m256i af_on = _mm256_cmpeq_epi32(_mm256_and_si256(hdr, _mm256_set1_epi32(0x20000000)), _mm256_set1_epi32(0x20000000));
+    __m256i af_len = _mm256_and_si256(af, _mm256_set1_epi32(0xff));
+    __m256i sync = _mm256_cmpeq_epi32(_mm256_and_si256(hdr, _mm256_set1_epi32(0xff)), _mm256_set1_epi32(0x47));
+
+    __m256i flags = _mm256_andnot_si256(sync, _mm256_set1_epi32(TS_NO_SYNC));
+    flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_srli_epi32(hdr, 14), _mm256_set1_epi32(TS_PUSI)));
+    flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_srli_epi32(hdr, 10), _mm256_set1_epi32(TS_TEI)));
+    flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_srli_epi32(hdr, 28), _mm256_set1_epi32(TS_HAS_AF)));
+    flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_srli_epi32(hdr, 26), _mm256_set1_epi32(TS_HAS_PAYLOAD)));
+    flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_and_si256(af_on, _mm256_cmpgt_epi32(af_len, zero)),
+                                                    _mm256_and_si256(_mm256_srli_epi32(af, 12), _mm256_set1_epi32(TS_DISCONTINUITY))));
+    flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_and_si256(af_on, _mm256_cmpgt_epi32(af_len, _mm256_set1_epi32(5))),
+                                                    _mm256_and_si256(_mm256_srli_epi32(af, 8), _mm256_set1_epi32(TS_HAS_PCR))));
+
+    __m256i pid = _mm256_or_si256(_mm256_and_si256(hdr, _mm256_set1_epi32(0x1f00)),
+                                  _mm256_and_si256(_mm256_srli_epi32(hdr, 16), _mm256_set1_epi32(0xff)));
+    __m256i cc = _mm256_and_si256(_mm256_srli_epi32(hdr, 24), _mm256_set1_epi32(0x0f));
+
+    /* Narrow.  The packs work within 128-bit lanes, so put the 64-bit
+       quarters back in order before going down to bytes. */
+    __m256i pid16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(pid, zero), 0xd8);
+    _mm_storeu_si128((__m128i*)&b->pid[i], _mm256_castsi256_si128(pid16));
+
+    __m256i fc16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(flags, cc), 0xd8);
+    __m128i fc8 = _mm_packus_epi16(_mm256_castsi256_si128(fc16), _mm256_extracti128_si256(fc16, 1));
+    _mm_storel_epi64((__m128i*)&b->flags[i], fc8);
+    _mm_storel_epi64((__m128i*)&b->cc[i], _mm_srli_si128(fc8, 8));
+  }
+
+  ts_classify_c(buf, n, b, i);
+}
+
+#endif
+
+static void (*classify)(uint8_t* buf, int n, struct ts_batch_t* b) = ts_classify_scalar;
+static const char* classify_name = "scalar";
+
+const char* ts_classify_init(void)
+{
+#ifdef TSBATCH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    classify = ts_classify_avx2;
+    classify_name = "AVX2";
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    classify = ts_classify_sse4;
+    classify_name = "SSE4.1";
+  }
+#endif
+
+  return classify_name;
+}
+
+void ts_classify(uint8_t* buf, int n, struct ts_batch_t* b)
+{
+  classify(buf, n, b);
+}
@@ -0,0 +1,40 @@
+#ifndef _TSBATCH_H
+#define _TSBATCH_H
+
+#include <stdint.h>
+
+#define TS_BATCH_MAX 64
+
+/* ts_batch_t flags */
+#define TS_PUSI          0x01
+#define TS_HAS_AF        0x02   /* Adaptation field present */
+#define TS_HAS_PAYLOAD   0x04
+#define TS_DISCONTINUITY 0x08   /* discontinuity_indicator set */
+#define TS_HAS_PCR       0x10
+#define TS_TEI           0x20   /* transport_error_indicator set */
+#define TS_NO_SYNC       0x80
+
+/* Header fields of a run of consecutive packets */
+struct ts_batch_t {
+  uint16_t pid[TS_BATCH_MAX];
+  uint8_t flags[TS_BATCH_MAX];
+  uint8_t cc[TS_BATCH_MAX];
+};
+
+/* Pick the fastest implementation for this CPU, before any mux thread
+   starts - until then ts_classify() is scalar.  Returns its name. */
+const char* ts_classify_init(void);
+
+/* Classify n (up to TS_BATCH_MAX) packets at buf */
+void ts_classify(uint8_t* buf, int n, struct ts_batch_t* b);
+
+/* ts_classify() for each instruction set.  The SIMD versions finish
+   the last few packets of a batch with the scalar code, and need the
+   CPU feature they are named after. */
+void ts_classify_scalar(uint8_t* buf, int n, struct ts_batch_t* b);
+#if defined(__x86_64__) || defined(__i386__)
+void ts_classify_sse4(uint8_t* buf, int n, struct ts_batch_t* b);
+void ts_classify_avx2(uint8_t* buf, int n, struct ts_batch_t* b);
+#endif
+
+#endif
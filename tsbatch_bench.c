@@ -0,0 +1,167 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* Checks the vector packet classifiers against the plain C one, then
+   measures each on a buffer of input-like packets.  Build with
+   "make tsbatch_bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "tsbatch.h"
+
+#define NPACKETS 16384   /* About 3MB - larger than most L2 caches */
+
+struct classify_impl_t {
+  const char* name;
+  void (*fn)(uint8_t* buf, int n, struct ts_batch_t* b);
+  const char* feature;
+};
+
+static struct classify_impl_t impls[] = {
+  { "scalar", ts_classify_scalar, NULL },
+#if defined(__x86_64__) || defined(__i386__)
+  { "sse4.1", ts_classify_sse4, "sse4.1" },
+  { "avx2", ts_classify_avx2, "avx2" },
+#endif
+  { "ts_classify", ts_classify, NULL },
+};
+#define NIMPLS (int)(sizeof(impls) / sizeof(impls[0]))
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int supported(struct classify_impl_t* impl)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (impl->feature) {
+    __builtin_cpu_init();
+    if (!strcmp(impl->feature, "avx2"))
+      return __builtin_cpu_supports("avx2");
+    return __builtin_cpu_supports("sse4.1");
+  }
+#else
+  (void)impl;
+#endif
+  return 1;
+}
+
+/* Random headers, with every flag the classifier reports turning up */
+static void make_packets(uint8_t* buf, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    uint8_t* p = buf + i*188;
+    int r = rand();
+    int j;
+
+    for (j = 0; j < 188; j++)
+      p[j] = rand();
+    p[0] = (r % 97) ? 0x47 : rand();
+    if ((r >> 8) % 7 == 0) {
+      p[3] = (p[3] & 0xcf) | 0x30;   /* Adaptation field and payload */
+      p[4] = rand() % 8;
+    }
+  }
+}
+
+int main(void)
+{
+  uint8_t* buf = malloc(NPACKETS * 188);
+  struct ts_batch_t ref, b;
+  volatile int sink = 0;
+  int errors = 0;
+  int i, j, n, pos;
+
+  if (buf == NULL)
+    return 1;
+  printf("ts_classify uses %s\n", ts_classify_init());
+  srand(1);
+  make_packets(buf, NPACKETS);
+
+  /* Every batch length, at every position in a few thousand packets */
+  for (j = 1; j < NIMPLS; j++) {
+    if (!supported(&impls[j])) {
+      printf("%s not supported on this CPU - skipping\n", impls[j].name);
+      continue;
+    }
+    for (pos = 0; pos < 4096; pos += 61) {
+      for (n = 1; n <= TS_BATCH_MAX; n++) {
+        ts_classify_scalar(buf + pos*188, n, &ref);
+        memset(&b, 0xaa, sizeof(b));
+        impls[j].fn(buf + pos*188, n, &b);
+        if (memcmp(ref.pid, b.pid, n * sizeof(ref.pid[0])) ||
+            memcmp(ref.flags, b.flags, n) || memcmp(ref.cc, b.cc, n)) {
+          if (errors++ < 10)
+            printf("MISMATCH: %s, %d packets at packet %d\n", impls[j].name, n, pos);
+        }
+      }
+    }
+  }
+  printf("Batches of 1-%d packets: %s\n", TS_BATCH_MAX, errors ? "FAILED" : "pid, flags and cc agree with ts_classify_scalar()");
+
+  printf("%-14s %12s %12s\n", "", "hot ns/pkt", "cold ns/pkt");
+  for (j = 0; j < NIMPLS; j++) {
+    double t0, t_hot, t_cold;
+    long iters;
+
+    if (!supported(&impls[j]))
+      continue;
+
+    /* The same batch over and over, so it stays in L1 */
+    iters = 0;
+    t0 = now();
+    do {
+      for (i = 0; i < 1000; i++) {
+        impls[j].fn(buf, TS_BATCH_MAX, &b);
+        sink += b.flags[i & (TS_BATCH_MAX-1)];
+      }
+      iters += 1000;
+    } while (now() - t0 < 0.2);
+    t_hot = (now() - t0) / iters / TS_BATCH_MAX;
+
+    /* Walking the whole buffer, as the mux thread walks a ringbuffer */
+    iters = 0;
+    t0 = now();
+    do {
+      for (pos = 0; pos + TS_BATCH_MAX <= NPACKETS; pos += TS_BATCH_MAX) {
+        impls[j].fn(buf + pos*188, TS_BATCH_MAX, &b);
+        sink += b.flags[0];
+      }
+      iters += NPACKETS / TS_BATCH_MAX;
+    } while (now() - t0 < 0.2);
+    t_cold = (now() - t0) / iters / TS_BATCH_MAX;
+
+    printf("%-14s %12.2f %12.2f\n", impls[j].name, t_hot * 1e9, t_cold * 1e9);
+  }
+
+  free(buf);
+  return errors ? 1 : 0;
+}
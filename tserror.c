@@ -0,0 +1,104 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "tserror.h"
+
+static char* names[TSERR_COUNT] = {
+  "CC errors", "sync losses", "TEI packets", "PCR gaps", "CRC errors"
+};
+
+char* ts_error_name(int type)
+{
+  return names[type];
+}
+
+void ts_error(struct ts_errors_t* e, int type, int pid)
+{
+  atomic_store_explicit(&e->count[type], atomic_load_explicit(&e->count[type], memory_order_relaxed) + 1, memory_order_relaxed);
+  if (pid >= 0)
+    atomic_store_explicit(&e->pid[pid], atomic_load_explicit(&e->pid[pid], memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void ts_errors_snapshot(struct ts_errors_t** e, int n, struct ts_errors_snapshot_t* s)
+{
+  int i, j;
+
+  memset(s, 0, sizeof(*s));
+  s->worst_pid = -1;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < TSERR_COUNT; j++)
+      s->count[j] += atomic_load_explicit(&e[i]->count[j], memory_order_relaxed);
+  }
+
+  for (j = 0; j < 8192; j++) {
+    uint32_t count = 0;
+    for (i = 0; i < n; i++)
+      count += atomic_load_explicit(&e[i]->pid[j], memory_order_relaxed);
+    if (count > s->worst_pid_count) {
+      s->worst_pid = j;
+      s->worst_pid_count = count;
+    }
+  }
+}
+
+uint64_t ts_errors_count(struct ts_errors_t** e, int n, int type)
+{
+  uint64_t count = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    count += atomic_load_explicit(&e[i]->count[type], memory_order_relaxed);
+
+  return count;
+}
+
+void ts_errors_report(char* name, struct ts_errors_t** e, int n, struct ts_errors_report_t* r)
+{
+  struct ts_errors_snapshot_t s;
+  struct timespec now;
+  int64_t now_ms;
+  char msg[256];
+  int len = 0;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  now_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+  if (now_ms - r->last_ms < TSERR_REPORT_INTERVAL_MS)
+    return;
+  r->last_ms = now_ms;
+
+  ts_errors_snapshot(e, n, &s);
+  for (i = 0; i < TSERR_COUNT; i++) {
+    if (s.count[i] != r->reported[i])
+      len += snprintf(msg + len, sizeof(msg) - len, "%s%d %s",len ? ", " : "",(int)(s.count[i] - r->reported[i]),names[i]);
+    r->reported[i] = s.count[i];
+  }
+
+  if (len)
+    fprintf(stderr,"\n%s: %s (most on PID %d, %u in total)\n",name,msg,s.worst_pid,s.worst_pid_count);
+}
@@ -0,0 +1,53 @@
+#ifndef _TSERROR_H
+#define _TSERROR_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Error types */
+#define TSERR_CC       0   /* Continuity counter errors */
+#define TSERR_SYNC     1   /* Sync byte lost */
+#define TSERR_TEI      2   /* transport_error_indicator set */
+#define TSERR_PCR_GAP  3   /* PCRs more than TS_MAX_PCR_INTERVAL apart */
+#define TSERR_CRC      4   /* PSI/SI sections failing their CRC */
+#define TSERR_COUNT    5
+
+#define TS_MAX_PCR_INTERVAL (27000000/10)   /* 100ms, in 27MHz ticks */
+#define TSERR_REPORT_INTERVAL_MS 10000
+
+/* Error counters for one service, written by a single thread - so
+   counting is a plain load and store, with no locked instructions.
+   Other threads read them with ts_errors_snapshot(). */
+struct ts_errors_t {
+  _Atomic uint64_t count[TSERR_COUNT];
+  _Atomic uint32_t pid[8192];     /* Errors of all types, by PID */
+};
+
+struct ts_errors_snapshot_t {
+  uint64_t count[TSERR_COUNT];
+  int worst_pid;                  /* PID with the most errors, -1 if none */
+  uint32_t worst_pid_count;
+};
+
+/* Rate limiting state for ts_errors_report() */
+struct ts_errors_report_t {
+  uint64_t reported[TSERR_COUNT];
+  int64_t last_ms;
+};
+
+/* Count an error, pid is -1 if there isn't one */
+void ts_error(struct ts_errors_t* e, int type, int pid);
+
+/* Sum n sets of counters (e.g. one per thread) */
+void ts_errors_snapshot(struct ts_errors_t** e, int n, struct ts_errors_snapshot_t* s);
+
+/* ... or just one type, without the per-PID scan */
+uint64_t ts_errors_count(struct ts_errors_t** e, int n, int type);
+
+/* Print a summary of the errors since the last one, at most once every
+   TSERR_REPORT_INTERVAL_MS and only if there were any */
+void ts_errors_report(char* name, struct ts_errors_t** e, int n, struct ts_errors_report_t* r);
+
+char* ts_error_name(int type);
+
+#endif
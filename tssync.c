@@ -0,0 +1,206 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tssync.h"
+
+/* Input resynchronisation.  Data is checked for a sync byte every 188
+   bytes as it arrives, and only whole, aligned packets are committed to
+   the input ringbuffer.  When a sync byte is missing, the stream is
+   searched for TS_SYNC_RUN sync bytes in a row, everything before them
+   is dropped, and the rest is moved down in place.
+
+   The check and the search are vectorised with AVX2 (gathering eight
+   packet headers at a time, and comparing 32 candidate offsets at a
+   time) or SSE2, selected at runtime.  Other architectures use the
+   plain C versions. */
+
+#define TS_SYNC_SPAN ((TS_SYNC_RUN - 1) * 188)   /* Bytes after a candidate that must be present */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TSSYNC_X86
+#endif
+
+static int ts_find_sync_c(uint8_t* buf, int len, int i)
+{
+  for (; i + TS_SYNC_SPAN < len; i++) {
+    if ((buf[i] == 0x47) && (buf[i+188] == 0x47) && (buf[i+376] == 0x47))
+      return i;
+  }
+  return -1;
+}
+
+static int ts_check_sync_c(uint8_t* buf, int npackets, int i)
+{
+  /* Branch-free over 8 packets at a time */
+  for (; i + 8 <= npackets; i += 8) {
+    uint8_t* p = buf + i*188;
+    uint8_t diff = (p[0] ^ 0x47) | (p[188] ^ 0x47) | (p[2*188] ^ 0x47) | (p[3*188] ^ 0x47) |
+                   (p[4*188] ^ 0x47) | (p[5*188] ^ 0x47) | (p[6*188] ^ 0x47) | (p[7*188] ^ 0x47);
+    if (diff)
+      break;
+  }
+  for (; i < npackets; i++) {
+    if (buf[i*188] != 0x47)
+      break;
+  }
+  return i;
+}
+
+int ts_find_sync_scalar(uint8_t* buf, int len)
+{
+  return ts_find_sync_c(buf, len, 0);
+}
+
+int ts_check_sync_scalar(uint8_t* buf, int npackets)
+{
+  return ts_check_sync_c(buf, npackets, 0);
+}
+
+#ifdef TSSYNC_X86
+int ts_find_sync_sse2(uint8_t* buf, int len)
+{
+  const __m128i sync = _mm_set1_epi8(0x47);
+  int i;
+
+  for (i = 0; i + TS_SYNC_SPAN + 16 <= len; i += 16) {
+    __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(buf + i)), sync);
+    __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(buf + i + 188)), sync);
+    __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(buf + i + 376)), sync);
+    int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return ts_find_sync_c(buf, len, i);
+}
+
+__attribute__((target("avx2")))
+int ts_find_sync_avx2(uint8_t* buf, int len)
+{
+  const __m256i sync = _mm256_set1_epi8(0x47);
+  int i;
+
+  for (i = 0; i + TS_SYNC_SPAN + 32 <= len; i += 32) {
+    __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(buf + i)), sync);
+    __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(buf + i + 188)), sync);
+    __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(buf + i + 376)), sync);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return ts_find_sync_c(buf, len, i);
+}
+
+/* Gather the first four bytes of 8 packets and compare their low bytes */
+__attribute__((target("avx2")))
+int ts_check_sync_avx2(uint8_t* buf, int npackets)
+{
+  const __m256i offsets = _mm256_setr_epi32(0, 188, 2*188, 3*188, 4*188, 5*188, 6*188, 7*188);
+  const __m256i lowbyte = _mm256_set1_epi32(0xff);
+  const __m256i sync = _mm256_set1_epi32(0x47);
+  int i;
+
+  for (i = 0; i + 8 <= npackets; i += 8) {
+    __m256i v = _mm256_i32gather_epi32((const int*)(buf + i*188), offsets, 1);
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(v, lowbyte), sync);
+    if (_mm256_movemask_epi8(eq) != -1)
+      break;
+  }
+  return ts_check_sync_c(buf, npackets, i);
+}
+
+#endif
+
+static int (*find_sync)(uint8_t* buf, int len) = ts_find_sync_scalar;
+static int (*check_sync)(uint8_t* buf, int npackets) = ts_check_sync_scalar;
+static const char* sync_name = "scalar";
+
+const char* tssync_init(void)
+{
+#ifdef TSSYNC_X86
+  find_sync = ts_find_sync_sse2;
+  sync_name = "SSE2";
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    find_sync = ts_find_sync_avx2;
+    check_sync = ts_check_sync_avx2;
+    sync_name = "AVX2";
+  }
+#endif
+
+  return sync_name;
+}
+
+int ts_find_sync(uint8_t* buf, int len)
+{
+  return find_sync(buf, len);
+}
+
+int ts_check_sync(uint8_t* buf, int npackets)
+{
+  return check_sync(buf, npackets);
+}
+
+int tssync_process(struct tssync_t* s, uint8_t* p, int n)
+{
+  int len = s->pending + n;
+  int done = 0;      /* Aligned, checked bytes at p */
+
+  while (1) {
+    if (s->synced) {
+      int npackets = (len - done) / 188;
+      int good = ts_check_sync(p + done, npackets);
+
+      done += good * 188;
+      if ((good == npackets) && ((done == len) || (p[done] == 0x47)))
+        break;
+
+      s->synced = 0;
+      s->resyncs++;
+    }
+
+    int i = ts_find_sync(p + done, len - done);
+    if (i < 0) {
+      /* Keep the bytes that haven't been fully searched yet */
+      int keep = len - done;
+      if (keep > TS_SYNC_SPAN)
+        keep = TS_SYNC_SPAN;
+      s->bytes_dropped += len - done - keep;
+      memmove(p + done, p + len - keep, keep);
+      len = done + keep;
+      break;
+    }
+
+    if (i) {
+      memmove(p + done, p + done + i, len - done - i);
+      len -= i;
+      s->bytes_dropped += i;
+    }
+    s->synced = 1;
+  }
+
+  s->pending = len - done;
+  return done;
+}
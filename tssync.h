@@ -0,0 +1,47 @@
+#ifndef _TSSYNC_H
+#define _TSSYNC_H
+
+#include <stdint.h>
+
+/* Input stream alignment state, owned by the thread writing a
+   service's input ringbuffer */
+struct tssync_t {
+  int synced;
+  int pending;             /* Uncommitted bytes at the ringbuffer's write pointer */
+  uint64_t resyncs;        /* Times sync was lost */
+  uint64_t bytes_dropped;  /* Bytes discarded while searching for sync */
+};
+
+/* n new bytes have been written at p + s->pending, where p is the
+   ringbuffer's write pointer.  Realigns the data in place and returns
+   the number of bytes (whole, aligned packets) at p to commit - the rest
+   stay pending. */
+int tssync_process(struct tssync_t* s, uint8_t* p, int n);
+
+/* Pick the fastest sync search and check for this CPU, before any
+   ingest thread starts - until then they are scalar.  Returns the
+   name. */
+const char* tssync_init(void);
+
+/* Offset of the first run of TS_SYNC_RUN sync bytes 188 bytes apart,
+   or -1 */
+int ts_find_sync(uint8_t* buf, int len);
+
+/* Number of packets at buf, up to npackets, before the first one
+   without a sync byte */
+int ts_check_sync(uint8_t* buf, int npackets);
+
+#define TS_SYNC_RUN 3
+
+/* The loops behind ts_find_sync() and ts_check_sync().  SSE2 is the
+   x86 baseline; the AVX2 pair may only be called once the CPU has been
+   checked for it. */
+int ts_find_sync_scalar(uint8_t* buf, int len);
+int ts_check_sync_scalar(uint8_t* buf, int npackets);
+#if defined(__x86_64__) || defined(__i386__)
+int ts_find_sync_sse2(uint8_t* buf, int len);
+int ts_find_sync_avx2(uint8_t* buf, int len);
+int ts_check_sync_avx2(uint8_t* buf, int npackets);
+#endif
+
+#endif
@@ -0,0 +1,203 @@
+/*
+
+dvb2dvb - combine multiple SPTS to a MPTS
+
+Copyright (C) 2014 Dave Chapman
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
+/* Checks the vector sync check and sync search against the plain C
+   versions, then measures their throughput.  Build with
+   "make tssync_bench". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "tssync.h"
+
+#define NPACKETS 16384
+#define SEARCH_LEN (64*1024)
+
+struct find_impl_t {
+  const char* name;
+  int (*fn)(uint8_t* buf, int len);
+  int avx2;
+};
+
+struct check_impl_t {
+  const char* name;
+  int (*fn)(uint8_t* buf, int npackets);
+  int avx2;
+};
+
+static struct find_impl_t finds[] = {
+  { "scalar", ts_find_sync_scalar, 0 },
+#if defined(__x86_64__) || defined(__i386__)
+  { "sse2", ts_find_sync_sse2, 0 },
+  { "avx2", ts_find_sync_avx2, 1 },
+#endif
+  { "ts_find_sync", ts_find_sync, 0 },
+};
+#define NFINDS (int)(sizeof(finds) / sizeof(finds[0]))
+
+static struct check_impl_t checks[] = {
+  { "scalar", ts_check_sync_scalar, 0 },
+#if defined(__x86_64__) || defined(__i386__)
+  { "avx2", ts_check_sync_avx2, 1 },
+#endif
+  { "ts_check_sync", ts_check_sync, 0 },
+};
+#define NCHECKS (int)(sizeof(checks) / sizeof(checks[0]))
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int have_avx2(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+/* Random bytes with no 0x47 in them */
+static void fill_noise(uint8_t* buf, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = rand();
+    if (buf[i] == 0x47)
+      buf[i] = 0;
+  }
+}
+
+static void fill_packets(uint8_t* buf, int npackets)
+{
+  int i;
+
+  fill_noise(buf, npackets * 188);
+  for (i = 0; i < npackets; i++)
+    buf[i*188] = 0x47;
+}
+
+int main(void)
+{
+  uint8_t* packets = malloc(NPACKETS * 188);
+  uint8_t* noise = malloc(SEARCH_LEN);
+  uint8_t* buf = malloc(4096);
+  int avx2 = have_avx2();
+  volatile int sink = 0;
+  int errors = 0;
+  int i, j, len, t;
+
+  if (!(packets && noise && buf))
+    return 1;
+  printf("ts_find_sync and ts_check_sync use %s\n", tssync_init());
+  if (!avx2)
+    printf("No AVX2 on this CPU - skipping avx2\n");
+
+  /* Search: noise with stray sync bytes, and a run of packets starting
+     at a random offset (or none), at every length up to 2000 bytes */
+  srand(1);
+  for (t = 0; t < 20000; t++) {
+    len = rand() % 2000;
+    fill_noise(buf, 4096);
+    for (i = 0; i < 4; i++)
+      buf[rand() % 4096] = 0x47;
+    if (t % 4) {
+      int start = rand() % 2000;
+      for (i = start; i < 4096; i += 188)
+        buf[i] = 0x47;
+    }
+    int expected = ts_find_sync_scalar(buf, len);
+    for (j = 1; j < NFINDS; j++) {
+      if (finds[j].avx2 && !avx2)
+        continue;
+      int res = finds[j].fn(buf, len);
+      if ((res != expected) && (errors++ < 10))
+        printf("MISMATCH: find %s, len %d: %d, expected %d\n", finds[j].name, len, res, expected);
+    }
+  }
+
+  /* Check: a packet stream with one sync byte missing (or none) */
+  fill_packets(packets, NPACKETS);
+  for (t = 0; t < 20000; t++) {
+    int npackets = rand() % 200;
+    int bad = rand() % 220;
+    if (bad < 200)
+      packets[bad*188] = 0;
+    int expected = ts_check_sync_scalar(packets, npackets);
+    for (j = 1; j < NCHECKS; j++) {
+      if (checks[j].avx2 && !avx2)
+        continue;
+      int res = checks[j].fn(packets, npackets);
+      if ((res != expected) && (errors++ < 10))
+        printf("MISMATCH: check %s, %d packets: %d, expected %d\n", checks[j].name, npackets, res, expected);
+    }
+    if (bad < 200)
+      packets[bad*188] = 0x47;
+  }
+  printf("Sync search and check: %s\n", errors ? "FAILED" : "same results as the scalar code");
+
+  /* Throughput, in bytes of input stream covered per second */
+  fill_noise(noise, SEARCH_LEN);
+  printf("Sync search, %d bytes with no sync:\n", SEARCH_LEN);
+  for (j = 0; j < NFINDS; j++) {
+    long iters = 0;
+    double t0 = now(), el;
+    if (finds[j].avx2 && !avx2)
+      continue;
+    do {
+      for (i = 0; i < 100; i++)
+        sink += finds[j].fn(noise, SEARCH_LEN);
+      iters += 100;
+      el = now() - t0;
+    } while (el < 0.2);
+    printf("  %-14s %8.2f GB/s\n", finds[j].name, (double)iters * SEARCH_LEN / el / 1e9);
+  }
+
+  printf("Sync check, %d aligned packets:\n", NPACKETS);
+  for (j = 0; j < NCHECKS; j++) {
+    long iters = 0;
+    double t0 = now(), el;
+    if (checks[j].avx2 && !avx2)
+      continue;
+    do {
+      for (i = 0; i < 100; i++)
+        sink += checks[j].fn(packets, NPACKETS);
+      iters += 100;
+      el = now() - t0;
+    } while (el < 0.2);
+    printf("  %-14s %8.2f GB/s  (%.0f Mpackets/s)\n", checks[j].name,
+           (double)iters * NPACKETS * 188 / el / 1e9, (double)iters * NPACKETS / el / 1e6);
+  }
+
+  free(packets);
+  free(noise);
+  free(buf);
+  return errors ? 1 : 0;
+}